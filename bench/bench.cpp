@@ -0,0 +1,1396 @@
+#include "fagramm.h"
+#include "structure_expression.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <cctype>
+#include <cstdlib>
+#include <new>
+
+using fagramm::symbol_id;
+
+//
+// Allocation counting - every operator new of the process is counted
+//
+#if defined(__GNUC__) && !defined(__clang__)
+// the replacements below pair malloc with free, GCC sees only the inlined operator new and the free
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+
+static std::atomic<size_t> s_allocations {0};
+
+void* operator new(size_t size)
+{
+    s_allocations.fetch_add(1, std::memory_order_relaxed);
+
+    if(void* ptr = std::malloc((size != 0) ? size : 1)) return ptr;
+
+    throw std::bad_alloc();
+}
+void operator delete(void* ptr) noexcept
+{
+    std::free(ptr);
+}
+void operator delete(void* ptr, size_t) noexcept
+{
+    std::free(ptr);
+}
+
+//
+// Measurement - a call is run once to warm up the buffers and then calls times; the results are per call
+//
+struct measurement
+{
+    double seconds;
+    double allocations;
+};
+
+template<class Call>
+static measurement measure(size_t calls, const Call& call)
+{
+    call();
+
+    const size_t allocations = s_allocations.load(std::memory_order_relaxed);
+
+    const auto start = std::chrono::steady_clock::now();
+
+    for(size_t index = 0; index < calls; ++index)
+    {
+        call();
+    }
+
+    const auto stop = std::chrono::steady_clock::now();
+
+    const double seconds = std::chrono::duration<double>(stop - start).count();
+
+    return {seconds / double(calls), double(s_allocations.load(std::memory_order_relaxed) - allocations) / double(calls)};
+}
+
+// times first and second called in turns, e.g. an edit and the edit that undoes it - each by its own clock
+template<class First, class Second>
+static std::pair<measurement, measurement> measure_turns(size_t calls, const First& first, const Second& second)
+{
+    first();
+    second();
+
+    double seconds    [2] = {0, 0};
+    size_t allocations[2] = {0, 0};
+
+    for(size_t index = 0; index < calls; ++index)
+    {
+        for(size_t turn = 0; turn < 2; ++turn)
+        {
+            const size_t before = s_allocations.load(std::memory_order_relaxed);
+            const auto   start  = std::chrono::steady_clock::now();
+
+            if(turn == 0) first(); else second();
+
+            const auto stop = std::chrono::steady_clock::now();
+
+            seconds    [turn] += std::chrono::duration<double>(stop - start).count();
+            allocations[turn] += s_allocations.load(std::memory_order_relaxed) - before;
+        }
+    }
+    return {
+        {seconds[0] / double(calls), double(allocations[0]) / double(calls)},
+        {seconds[1] / double(calls), double(allocations[1]) / double(calls)},
+    };
+}
+
+//
+// Report - every measurement is a record; the text output is for reading, JSON and CSV for comparing builds
+//
+enum class report_format
+{
+    text,
+    json,
+    csv,
+};
+
+struct bench_record
+{
+    const char* group;
+    std::string name;
+    double      seconds;     // per call
+    double      tokens;      // per call (0 - not applicable)
+    double      bytes;       // per call (0 - not applicable)
+    double      allocations; // per call
+};
+
+struct bench_report
+{
+    report_format format = report_format::text;
+    std::FILE*    output = stdout; // JSON or CSV go here, with a file the text goes to stdout as well
+
+    const char*               group = "";
+    std::vector<bench_record> records;
+
+    bool show_text() const
+    {
+        return (format == report_format::text) || (output != stdout);
+    }
+
+    void section(const char* group_name, const char* title)
+    {
+        group = group_name;
+
+        if(show_text()) std::printf("%s\n", title);
+    }
+
+    void add(const std::string& name, const measurement& m, double tokens = 0, double bytes = 0, const char* note = "")
+    {
+        records.push_back({group, name, m.seconds, tokens, bytes, m.allocations});
+
+        if(!show_text()) return;
+
+        std::printf("  %-44s %12.1f ns/call", name.c_str(), m.seconds * 1e9);
+
+        if(tokens != 0) std::printf(" %8.2f Mtokens/s", tokens / m.seconds / 1e6); else std::printf("%19s", "");
+        if(bytes  != 0) std::printf(" %8.2f MB/s"     , bytes  / m.seconds / 1e6); else std::printf("%14s", "");
+
+        std::printf(" %8.2f allocs/call%s%s\n", m.allocations, (*note != '\0') ? "  " : "", note);
+    }
+
+    void write_string(const char* str) const
+    {
+        // JSON escapes with a backslash, CSV doubles the quotes
+        const char* escape = (format == report_format::json) ? "\\" : "\"";
+
+        std::fputc('"', output);
+
+        for(; *str != '\0'; ++str)
+        {
+            if((*str == '"') || ((*str == '\\') && (format == report_format::json))) std::fputs(escape, output);
+
+            std::fputc(*str, output);
+        }
+        std::fputc('"', output);
+    }
+
+    // a rate per second - null (JSON) or empty (CSV) when the amount is not applicable
+    void write_rate(double amount, double seconds) const
+    {
+        if(amount != 0)
+        {
+            std::fprintf(output, "%.6g", amount / seconds);
+        }
+        else if(format == report_format::json)
+        {
+            std::fputs("null", output);
+        }
+    }
+
+    void write() const
+    {
+        if(format == report_format::json)
+        {
+#ifdef _DEBUG
+            constexpr const char* build = "debug";
+#else
+            constexpr const char* build = "release";
+#endif
+            std::fprintf(output, "{\n  \"build\": \"%s\",\n  \"hardware_threads\": %u,\n  \"benchmarks\": [\n", build, std::thread::hardware_concurrency());
+
+            for(size_t index = 0; index < records.size(); ++index)
+            {
+                const bench_record& r = records[index];
+
+                std::fputs("    {\"group\": ", output); write_string(r.group);
+                std::fputs(", \"name\": "    , output); write_string(r.name.c_str());
+
+                std::fprintf(output, ", \"ns_per_call\": %.6g, \"calls_per_sec\": %.6g", r.seconds * 1e9, 1 / r.seconds);
+
+                std::fputs(", \"tokens_per_sec\": ", output); write_rate(r.tokens, r.seconds);
+                std::fputs(", \"bytes_per_sec\": " , output); write_rate(r.bytes , r.seconds);
+
+                std::fprintf(output, ", \"allocations_per_call\": %.6g}%s\n", r.allocations, (index + 1 < records.size()) ? "," : "");
+            }
+            std::fputs("  ]\n}\n", output);
+        }
+        else if(format == report_format::csv)
+        {
+            std::fputs("group,name,ns_per_call,calls_per_sec,tokens_per_sec,bytes_per_sec,allocations_per_call\n", output);
+
+            for(const bench_record& r : records)
+            {
+                write_string(r.group);
+                std::fputc(',', output);
+                write_string(r.name.c_str());
+
+                std::fprintf(output, ",%.6g,%.6g,", r.seconds * 1e9, 1 / r.seconds);
+
+                write_rate(r.tokens, r.seconds);
+                std::fputc(',', output);
+                write_rate(r.bytes , r.seconds);
+
+                std::fprintf(output, ",%.6g\n", r.allocations);
+            }
+        }
+    }
+};
+
+static bench_report s_report;
+
+// checks of the benches that failed - fagramm_bench exits with 1 when there are any
+static size_t s_failures = 0;
+
+static constexpr fagramm::token_info bench_keywords[] = {
+    {symbol_id( 1), "ADD"      }, {symbol_id( 2), "INTERSECT"}, {symbol_id( 3), "XOR"     }, {symbol_id( 4), "SUBTRACT"},
+    {symbol_id( 5), "EXPAND"   }, {symbol_id( 6), "CONTRACT" }, {symbol_id( 7), "SELECT"  }, {symbol_id( 8), "FROM"    },
+    {symbol_id( 9), "WHERE"    }, {symbol_id(10), "GROUP"    }, {symbol_id(11), "ORDER"   }, {symbol_id(12), "BY"      },
+    {symbol_id(13), "HAVING"   }, {symbol_id(14), "JOIN"     }, {symbol_id(15), "INNER"   }, {symbol_id(16), "OUTER"   },
+    {symbol_id(17), "LEFT"     }, {symbol_id(18), "RIGHT"    }, {symbol_id(19), "UNION"   }, {symbol_id(20), "DISTINCT"},
+    {symbol_id(21), "INSERT"   }, {symbol_id(22), "UPDATE"   }, {symbol_id(23), "DELETE"  }, {symbol_id(24), "VALUES"  },
+    {symbol_id(25), "BETWEEN"  }, {symbol_id(26), "LIKE"     }, {symbol_id(27), "IN"      }, {symbol_id(28), "IS"      },
+    {symbol_id(29), "NOT"      }, {symbol_id(30), "NULL"     }, {symbol_id(31), "AND"     }, {symbol_id(32), "OR"      },
+};
+static constexpr const char* bench_idents[] = {
+    "abc", "Add", "contracted", "x", "INTERSECTION", "SUB", "value1", "ORDERS", "select", "JOINT",
+};
+
+//
+// Reference keyword lookup - binary search over the sorted keywords (the lookup the keyword index replaced)
+//
+struct binary_search_keywords
+{
+    struct desc
+    {
+        symbol_id   id;
+        const char* str;
+        size_t      len;
+    };
+    std::vector<desc> keywords;
+    bool case_sensitive;
+
+    static int compare(bool case_sensitive, const char* str1, size_t len1, const char* str2, size_t len2)
+    {
+        size_t len = std::min(len1, len2);
+
+        int dif;
+
+        if(case_sensitive)
+        {
+            dif = std::strncmp(str1, str2, len);
+
+            if(dif != 0) return dif;
+        }
+        else while(len-- != 0)
+        {
+            dif = std::toupper(*str1++) - std::toupper(*str2++);
+
+            if(dif != 0) return dif;
+        }
+        return int(len1 - len2);
+    }
+
+    binary_search_keywords(bool cs) : case_sensitive(cs)
+    {
+        for(const fagramm::token_info& info : bench_keywords)
+        {
+            keywords.push_back({info.id, info.str, std::strlen(info.str)});
+        }
+        std::sort(keywords.begin(), keywords.end(), [cs] (const desc& desc1, const desc& desc2)
+        {
+            return compare(cs, desc1.str, desc1.len, desc2.str, desc2.len) < 0;
+        });
+    }
+
+    bool find(symbol_id& id, const char* str, size_t len) const
+    {
+        const desc key {symbol_id(0), str, len};
+
+        const bool cs = case_sensitive;
+
+        return std::binary_search(keywords.begin(), keywords.end(), key, [&id, cs] (const desc& desc1, const desc& desc2)
+        {
+            const int res = compare(cs, desc1.str, desc1.len, desc2.str, desc2.len);
+            if(res == 0) id = symbol_id(int(desc1.id) + int(desc2.id));
+            return (res < 0);
+        });
+    }
+};
+
+struct word
+{
+    const char* str;
+    size_t      len;
+};
+
+static std::vector<word> make_words(size_t count)
+{
+    std::vector<word> words;
+    words.reserve(count);
+
+    unsigned seed = 12345;
+
+    for(size_t index = 0; index < count; ++index)
+    {
+        seed = seed * 1103515245u + 12345u;
+
+        const unsigned pick = (seed >> 8);
+
+        const char* str = ((pick % 4) != 0)
+            ? bench_keywords[(pick / 4) % std::size(bench_keywords)].str
+            : bench_idents  [(pick / 4) % std::size(bench_idents  )];
+
+        words.push_back({str, std::strlen(str)});
+    }
+    return words;
+}
+
+// a call looks up all the words
+template<class Finder>
+static void bench_lookup(const std::string& name, const std::vector<word>& words, const Finder& finder)
+{
+    size_t found = 0;
+    long long sum = 0;
+
+    const measurement m = measure(50, [&] ()
+    {
+        found = 0;
+
+        for(const word& w : words)
+        {
+            symbol_id id = symbol_id(0);
+
+            if(finder(id, w.str, w.len))
+            {
+                ++found;
+                sum += id;
+            }
+        }
+    });
+
+    char note[64];
+    std::snprintf(note, sizeof(note), "(found %zu, checksum %lld)", found, sum);
+
+    s_report.add(name, {m.seconds / double(words.size()), m.allocations / double(words.size())}, 0, 0, note);
+}
+
+static void bench_find_keyword()
+{
+    const std::vector<word> words = make_words(100000);
+
+    s_report.section("find_keyword", "find_keyword (per lookup)");
+
+    for(const bool case_sensitive : {true, false})
+    {
+        const unsigned flags = case_sensitive ? fagramm::tokenizer::Flag_Case_Sensitive_Keywords : fagramm::tokenizer::Flag_Default;
+
+        fagramm::tokenizer tokenizer;
+        tokenizer.reset(nullptr, 0, bench_keywords, std::size(bench_keywords), flags);
+
+        const binary_search_keywords reference(case_sensitive);
+
+        const std::string suffix = case_sensitive ? " (case sensitive)" : " (case insensitive)";
+
+        bench_lookup("binary search" + suffix, words, [&reference] (symbol_id& id, const char* str, size_t len)
+        {
+            return reference.find(id, str, len);
+        });
+        bench_lookup("keyword index" + suffix, words, [&tokenizer] (symbol_id& id, const char* str, size_t len)
+        {
+            return tokenizer.find_keyword(id, str, len);
+        });
+    }
+}
+
+static std::string make_input(const char* const* lines, size_t lines_count)
+{
+    std::string input;
+
+    while(input.size() < (8u << 20))
+    {
+        for(size_t index = 0; index < lines_count; ++index)
+        {
+            input += lines[index];
+        }
+    }
+    return input;
+}
+
+// a call tokenizes the whole text into the same tokens
+static void bench_tokenize_text(const std::string& name, const fagramm::tokenizer& tokenizer, const std::string& text)
+{
+    fagramm::tokens_t tokens;
+
+    const measurement m = measure(5, [&] ()
+    {
+        tokens.clear();
+        tokenizer.tokenize(tokens, text.data(), text.size());
+    });
+
+    s_report.add(name, m, double(tokens.size()), double(text.size()));
+}
+
+static constexpr fagramm::token_info paren_punctuations[] = {
+    {symbol_id(40), "("},
+    {symbol_id(41), ")"},
+    {symbol_id(42), ","},
+};
+
+static constexpr const char* formula_lines[] = {
+    "CONTRACT(\n",
+    "    ADD(\n",
+    "        CONTRACT(\"abc\", 1.2, 2.3, 3.4),\n",
+    "        EXPAND(\"some long string argument\", 1.25)\n",
+    "    ),\n",
+    "    1.2, 1.2, 1.2, 1.2, 1.2, 1.2\n",
+    ")\n",
+};
+static constexpr const char* strings_lines[] = {
+    "ADD(\"a rather long string literal with \\\"escaped\\\" quotes that goes on and on and on\",\n",
+    "    \"another long string literal used as the second argument of the set operation....\")\n",
+};
+
+static void bench_tokenize()
+{
+    static constexpr const char* idents_lines[] = {
+        "abcdefghijklmnopqrstuvwxyz0123456789 ABCDEFGHIJKLMNOPQRSTUVWXYZ CONTRACTION INTERSECTIONS\n",
+    };
+
+    struct input_data
+    {
+        const char* name;
+        std::string text;
+    };
+    const input_data inputs[] = {
+        {"formula text", make_input(formula_lines, std::size(formula_lines))},
+        {"long strings", make_input(strings_lines, std::size(strings_lines))},
+        {"identifiers" , make_input(idents_lines , std::size(idents_lines ))},
+    };
+
+    s_report.section("tokenize", "tokenize (8 MB inputs)");
+
+    for(const input_data& input : inputs)
+    {
+        for(const bool scalar : {true, false})
+        {
+            const unsigned flags = fagramm::tokenizer::Flag_Case_Sensitive_Keywords | (scalar ? fagramm::tokenizer::Flag_Scalar_Scanning : 0u);
+
+            fagramm::tokenizer tokenizer;
+            tokenizer.reset(paren_punctuations, std::size(paren_punctuations), bench_keywords, std::size(bench_keywords), flags);
+
+            bench_tokenize_text(std::string(input.name) + (scalar ? " (scalar)" : " (vectorized)"), tokenizer, input.text);
+        }
+    }
+}
+
+// punctuations only, back to back - check_punct is the whole tokenizing
+static void bench_check_punct()
+{
+    static constexpr fagramm::token_info operators[] = {
+        {symbol_id(40), "(" }, {symbol_id(41), ")"  }, {symbol_id(42), "," }, {symbol_id(43), ";" },
+        {symbol_id(44), "[" }, {symbol_id(45), "]"  }, {symbol_id(46), "{" }, {symbol_id(47), "}" },
+        {symbol_id(48), "+" }, {symbol_id(49), "++" }, {symbol_id(50), "+="}, {symbol_id(51), "-" },
+        {symbol_id(52), "--"}, {symbol_id(53), "-=" }, {symbol_id(54), "->"}, {symbol_id(55), "*" },
+        {symbol_id(56), "*="}, {symbol_id(57), "/"  }, {symbol_id(58), "/="}, {symbol_id(59), "%" },
+        {symbol_id(60), "<" }, {symbol_id(61), "<=" }, {symbol_id(62), "<<"}, {symbol_id(63), "<<="},
+        {symbol_id(64), ">" }, {symbol_id(65), ">=" }, {symbol_id(66), ">>"}, {symbol_id(67), ">>="},
+        {symbol_id(68), "=" }, {symbol_id(69), "==" }, {symbol_id(70), "!" }, {symbol_id(71), "!="},
+        {symbol_id(72), "&" }, {symbol_id(73), "&&" }, {symbol_id(74), "|" }, {symbol_id(75), "||"},
+        {symbol_id(76), "^" }, {symbol_id(77), "~"  }, {symbol_id(78), "?" }, {symbol_id(79), ":" },
+        {symbol_id(80), "::"}, {symbol_id(81), "."  }, {symbol_id(82), "..."},
+    };
+
+    std::string parens, ops;
+
+    unsigned seed = 777;
+
+    while(ops.size() < (8u << 20))
+    {
+        seed = seed * 1103515245u + 12345u;
+
+        const unsigned pick = (seed >> 8);
+
+        parens += paren_punctuations[pick % std::size(paren_punctuations)].str;
+        ops    += operators         [pick % std::size(operators         )].str;
+    }
+
+    fagramm::tokenizer paren_tokenizer;
+    paren_tokenizer.reset(paren_punctuations, std::size(paren_punctuations), nullptr, 0, fagramm::tokenizer::Flag_Default);
+
+    fagramm::tokenizer op_tokenizer;
+    op_tokenizer.reset(operators, std::size(operators), nullptr, 0, fagramm::tokenizer::Flag_Default);
+
+    s_report.section("check_punct", "check_punct (tokenizing 8 MB of punctuations)");
+
+    bench_tokenize_text("3 single character punctuations", paren_tokenizer, parens);
+    bench_tokenize_text("43 C operators (longest match)" , op_tokenizer   , ops   );
+}
+
+// short tokens between long and short runs of whitespace - the whitespace scanning is most of the tokenizing
+static void bench_remove_whitespace()
+{
+    static constexpr const char* indented_lines[] = {
+        "ADD(\n",
+        "                                                                \"abc\",\n",
+        "                                                                SUBTRACT(\"x\",\n",
+        "                                                                         \"y\"))\n",
+    };
+    static constexpr const char* spaced_lines[] = {
+        "( ) , ( ) , ( ( ) ) ,\n",
+    };
+    static constexpr const char* mixed_lines[] = {
+        "(\t\t\r\n  ,\t \r\n\t  )\r\n",
+    };
+
+    struct input_data
+    {
+        const char* name;
+        std::string text;
+    };
+    const input_data inputs[] = {
+        {"indentation"  , make_input(indented_lines, std::size(indented_lines))},
+        {"single spaces", make_input(spaced_lines  , std::size(spaced_lines  ))},
+        {"mixed"        , make_input(mixed_lines   , std::size(mixed_lines   ))},
+    };
+
+    s_report.section("remove_whitespace", "remove_whitespace (tokenizing 8 MB inputs)");
+
+    for(const input_data& input : inputs)
+    {
+        for(const bool scalar : {true, false})
+        {
+            const unsigned flags = fagramm::tokenizer::Flag_Case_Sensitive_Keywords | (scalar ? fagramm::tokenizer::Flag_Scalar_Scanning : 0u);
+
+            fagramm::tokenizer tokenizer;
+            tokenizer.reset(paren_punctuations, std::size(paren_punctuations), bench_keywords, std::size(bench_keywords), flags);
+
+            bench_tokenize_text(std::string(input.name) + (scalar ? " (scalar)" : " (vectorized)"), tokenizer, input.text);
+        }
+    }
+}
+
+// a call extracts every number or string token of the input
+static void bench_extract()
+{
+    fagramm::tokenizer tokenizer;
+    tokenizer.reset(paren_punctuations, std::size(paren_punctuations), bench_keywords, std::size(bench_keywords), fagramm::tokenizer::Flag_Default);
+
+    const std::string formulas = make_input(formula_lines, std::size(formula_lines));
+    const std::string strings  = make_input(strings_lines, std::size(strings_lines));
+
+    fagramm::tokens_t numbers_tokens, strings_tokens;
+    tokenizer.tokenize(numbers_tokens, formulas.data(), formulas.size());
+    tokenizer.tokenize(strings_tokens, strings .data(), strings .size());
+
+    const auto select = [] (fagramm::tokens_t& tokens, fagramm::token_type type)
+    {
+        tokens.erase(std::remove_if(tokens.begin(), tokens.end(), [type] (const fagramm::token_data& token) { return token.type != type; }), tokens.end());
+
+        size_t bytes = 0;
+        for(const fagramm::token_data& token : tokens) bytes += token.len;
+        return bytes;
+    };
+    const size_t numbers_bytes = select(numbers_tokens, fagramm::token_type::number);
+    const size_t strings_bytes = select(strings_tokens, fagramm::token_type::string);
+
+    s_report.section("extract", "extract (numbers of the formula text, strings of the long strings text)");
+
+    double sum = 0;
+
+    const measurement as_double = measure(5, [&] ()
+    {
+        for(const fagramm::token_data& token : numbers_tokens)
+        {
+            double number;
+            fagramm::tokenizer::extract_token_number(formulas.data(), token, number);
+            sum += number;
+        }
+    });
+    const measurement as_float = measure(5, [&] ()
+    {
+        for(const fagramm::token_data& token : numbers_tokens)
+        {
+            float number;
+            fagramm::tokenizer::extract_token_number(formulas.data(), token, number);
+            sum += double(number);
+        }
+    });
+
+    std::string out;
+    size_t length = 0;
+
+    const measurement as_is = measure(5, [&] ()
+    {
+        for(const fagramm::token_data& token : strings_tokens)
+        {
+            fagramm::tokenizer::extract_token_string(strings.data(), token, out);
+            length += out.size();
+        }
+    });
+    const measurement unescaped = measure(5, [&] ()
+    {
+        for(const fagramm::token_data& token : strings_tokens)
+        {
+            fagramm::tokenizer::extract_token_string(strings.data(), token, out, true);
+            length += out.size();
+        }
+    });
+
+    char note[64];
+    std::snprintf(note, sizeof(note), "(checksum %.0f)", sum);
+
+    s_report.add("extract_token_number (double)"  , as_double, double(numbers_tokens.size()), double(numbers_bytes), note);
+    s_report.add("extract_token_number (float)"   , as_float , double(numbers_tokens.size()), double(numbers_bytes), note);
+
+    std::snprintf(note, sizeof(note), "(checksum %zu)", length);
+
+    s_report.add("extract_token_string"           , as_is    , double(strings_tokens.size()), double(strings_bytes), note);
+    s_report.add("extract_token_string (unescape)", unescaped, double(strings_tokens.size()), double(strings_bytes), note);
+}
+
+// a structure_expression with every path depth levels deep - balanced branches into both set operation arguments
+// (2^depth strings), chained nests a scale operation into the next one
+static void append_structure(std::string& out, unsigned& seed, int depth, bool balanced)
+{
+    if(depth == 0)
+    {
+        out += "\"abc\"";
+        return;
+    }
+    seed = seed * 1103515245u + 12345u;
+
+    const unsigned pick = (seed >> 8);
+
+    if(balanced)
+    {
+        out += structure_expression::keywords[pick % 4].str;
+        out += '(';
+        append_structure(out, seed, depth - 1, balanced);
+        out += ", ";
+        append_structure(out, seed, depth - 1, balanced);
+        out += ')';
+        return;
+    }
+    static constexpr const char* margins[] = {
+        ", 1.5)",
+        ", 1.5, 2.5, 3.5)",
+        ", 1, 2, 3, 4, 5, 6)",
+    };
+    out += ((pick % 2) == 0) ? "EXPAND(" : "CONTRACT(";
+    append_structure(out, seed, depth - 1, balanced);
+    out += margins[(pick / 2) % 3];
+}
+
+static void bench_structure_expression()
+{
+    const fagramm::tokenizer tokenizer(structure_expression{});
+    const fagramm::grammar   grammar  (structure_expression{});
+
+    // the same rules after the optimizer - S_MARGIN left-factored, the grammar becomes LL(1)
+    fagramm::grammar optimized(structure_expression{});
+    optimized.prepare(structure_expression::start_symbol, fagramm::grammar_engine::automatic, fagramm::grammar::Optimize_All);
+
+    // the general engine on the same rules, for its cost against the ordered choice
+    fagramm::grammar earley(structure_expression{});
+    earley.prepare(structure_expression::start_symbol, fagramm::grammar_engine::earley);
+
+    struct input_data
+    {
+        bool balanced;
+        int  depth;
+    };
+    static constexpr input_data inputs[] = {
+        {true ,  2}, {true ,  6}, {true , 10}, {true , 14},
+        {false, 16}, {false, 256}, {false, 4096},
+    };
+
+    s_report.section("structure_expression", "structure_expression (msvs/main.cpp grammar)");
+
+    for(const input_data& input : inputs)
+    {
+        std::string text;
+
+        unsigned seed = 1000u + unsigned(input.depth);
+
+        append_structure(text, seed, input.depth, input.balanced);
+
+        fagramm::tokens_t tokens;
+        tokenizer.tokenize(tokens, text.data(), text.size());
+
+        // about four million tokens a case
+        const size_t calls = std::max<size_t>(5, (size_t(4) << 20) / tokens.size());
+
+        const double tokens_count = double(tokens.size());
+        const double bytes        = double(text.size());
+
+        char name[64];
+        std::snprintf(name, sizeof(name), "%s depth %d", input.balanced ? "balanced" : "chained", input.depth);
+
+        fagramm::tokens_t tokenized;
+
+        const measurement tokenize = measure(calls, [&] ()
+        {
+            tokenized.clear();
+            tokenizer.tokenize(tokenized, text.data(), text.size());
+        });
+
+        fagramm::result_t result {};
+
+        const measurement check = measure(calls, [&] ()
+        {
+            result = grammar.check(tokens);
+        });
+
+        const measurement check_optimized = measure(calls, [&] ()
+        {
+            result = optimized.check(tokens);
+        });
+
+        const measurement check_earley = measure(calls, [&] ()
+        {
+            result = earley.check(tokens);
+        });
+
+        fagramm::check_context ctx;
+
+        const measurement with_context = measure(calls, [&] ()
+        {
+            result = tokenizer.tokenize(ctx, text.data(), text.size());
+
+            if(result) result = grammar.check(ctx);
+        });
+
+        // the cost of recording - the ring buffer wraps around on the deep inputs
+        fagramm::trace_buffer trace;
+
+        ctx.stack.set_trace(&trace);
+
+        const measurement traced = measure(calls, [&] ()
+        {
+            trace.clear();
+
+            result = tokenizer.tokenize(ctx, text.data(), text.size());
+
+            if(result) result = grammar.check(ctx);
+        });
+
+        ctx.stack.set_trace(nullptr);
+
+        // a one character edit of the last string in the first half of the text and the check after it
+        fagramm::incremental_check incremental(tokenizer, grammar);
+        incremental.reset(text.data(), text.size());
+
+        const size_t edited = text.rfind("\"abc\"", text.size() / 2) + 2;
+
+        bool flip = false;
+
+        const measurement edit = measure(calls, [&] ()
+        {
+            flip = !flip;
+            result = incremental.edit(edited, 1, flip ? "x" : "b", 1);
+        });
+
+        // a character inserted into that string and removed again - the edits move the text and the tokens behind it
+        const auto chars = measure_turns(calls, [&] ()
+        {
+            result = incremental.edit(edited, 0, "y", 1);
+        }, [&] ()
+        {
+            if(result) result = incremental.edit(edited, 1, "", 0);
+        });
+
+        // that string replaced by a set operation of two strings and back - the edits move the nodes behind it as well
+        const size_t string_pos = edited - 2;
+
+        const std::string_view with_operation = "ADD(\"abc\", \"abc\")";
+
+        const auto nested = measure_turns(calls, [&] ()
+        {
+            result = incremental.edit(string_pos, 5, with_operation.data(), with_operation.size());
+        }, [&] ()
+        {
+            if(result) result = incremental.edit(string_pos, with_operation.size(), "\"abc\"", 5);
+        });
+
+        const char* note = result ? "" : "(FAILED)";
+
+        s_report.add(std::string(name) + ", tokenize"              , tokenize       , tokens_count, bytes, note);
+        s_report.add(std::string(name) + ", check"                 , check          , tokens_count, bytes, note);
+        s_report.add(std::string(name) + ", check optimized"       , check_optimized, tokens_count, bytes, note);
+        s_report.add(std::string(name) + ", check earley"          , check_earley   , tokens_count, bytes, note);
+        s_report.add(std::string(name) + ", tokenize + check (ctx)", with_context   , tokens_count, bytes, note);
+        s_report.add(std::string(name) + ", traced (ctx)"          , traced         , tokens_count, bytes, note);
+        s_report.add(std::string(name) + ", edit (incremental)"    , edit           , tokens_count, bytes, note);
+        s_report.add(std::string(name) + ", edit insert char"      , chars.first    , tokens_count, bytes, note);
+        s_report.add(std::string(name) + ", edit delete char"      , chars.second   , tokens_count, bytes, note);
+        s_report.add(std::string(name) + ", edit insert tokens"    , nested.first   , tokens_count, bytes, note);
+        s_report.add(std::string(name) + ", edit delete tokens"    , nested.second  , tokens_count, bytes, note);
+    }
+}
+
+// generated sentences, one per line, every near_miss_every-th of them a near miss (0 - none)
+static void append_corpus(fagramm::sentence_generator& generator, std::string& out, size_t size, size_t near_miss_every)
+{
+    for(size_t index = 1; out.size() < size; ++index)
+    {
+        const bool near_miss = (near_miss_every != 0) && ((index % near_miss_every) == 0);
+
+        if(!(near_miss ? generator.generate_near_miss(out) : generator.generate(out))) break;
+
+        out += '\n';
+    }
+}
+
+// a call tokenizes and checks every line of the corpus
+static void bench_corpus(const std::string& name, const fagramm::tokenizer& tokenizer, const fagramm::grammar& grammar, const std::string& corpus)
+{
+    std::vector<std::string_view> lines;
+
+    for(size_t pos = 0, end; (end = corpus.find('\n', pos)) != std::string::npos; pos = end + 1)
+    {
+        lines.emplace_back(corpus.data() + pos, end - pos);
+    }
+
+    fagramm::check_context ctx;
+
+    size_t passed = 0, tokens = 0;
+
+    const measurement m = measure((corpus.size() < (size_t(16) << 20)) ? 3 : 1, [&] ()
+    {
+        passed = tokens = 0;
+
+        for(const std::string_view& line : lines)
+        {
+            fagramm::result_t result = tokenizer.tokenize(ctx, line.data(), line.size());
+
+            tokens += ctx.tokens.size();
+
+            if(result) result = grammar.check(ctx);
+
+            passed += bool(result);
+        }
+    });
+
+    char note[64];
+    std::snprintf(note, sizeof(note), "(passed %zu of %zu)", passed, lines.size());
+
+    s_report.add(name, m, double(tokens), double(corpus.size()), note);
+}
+
+static void bench_generated()
+{
+    const fagramm::tokenizer tokenizer(structure_expression{});
+    const fagramm::grammar   grammar  (structure_expression{});
+
+    s_report.section("generated", "generated (structure_expression sentences, every 8th line a near miss)");
+
+    {
+        fagramm::sentence_generator generator(tokenizer, grammar);
+
+        std::string corpus;
+
+        const measurement m = measure(1, [&] ()
+        {
+            corpus.clear();
+            append_corpus(generator, corpus, size_t(8) << 20, 8);
+        });
+
+        s_report.add("sentence_generator (8 MB, verified)", m, 0, double(corpus.size()));
+    }
+
+    // corpora of growing size
+    for(const size_t megabytes : {size_t(1), size_t(8), size_t(64)})
+    {
+        fagramm::sentence_options options;
+        options.seed = megabytes;
+
+        fagramm::sentence_generator generator(tokenizer, grammar, options);
+
+        std::string corpus;
+        append_corpus(generator, corpus, megabytes << 20, 8);
+
+        bench_corpus(std::to_string(megabytes) + " MB corpus, tokenize + check (ctx)", tokenizer, grammar, corpus);
+    }
+
+    // single sentences of growing nesting
+    for(const size_t min_depth : {size_t(12), size_t(24), size_t(36), size_t(48)})
+    {
+        fagramm::sentence_options options;
+        options.min_depth  = min_depth;
+        options.max_depth  = min_depth + 16;
+        options.max_tokens = size_t(1) << 24;
+
+        fagramm::sentence_generator generator(tokenizer, grammar, options);
+
+        std::string corpus;
+        append_corpus(generator, corpus, 1, 0);
+
+        bench_corpus("sentence of depth " + std::to_string(min_depth) + "+, tokenize + check (ctx)", tokenizer, grammar, corpus);
+    }
+}
+
+// writes a corpus of structure_expression sentences a megabyte at a time, so it may be far bigger than the memory
+static int write_corpus(const char* path, size_t megabytes)
+{
+    const fagramm::tokenizer tokenizer(structure_expression{});
+    const fagramm::grammar   grammar  (structure_expression{});
+
+    fagramm::sentence_generator generator(tokenizer, grammar);
+
+    std::FILE* file = std::fopen(path, "wb");
+
+    if(file == nullptr)
+    {
+        std::fprintf(stderr, "fagramm_bench: cannot open %s\n", path);
+        return 1;
+    }
+
+    std::string piece;
+
+    for(size_t written = 0; written < (megabytes << 20); written += piece.size())
+    {
+        piece.clear();
+        append_corpus(generator, piece, size_t(1) << 20, 8);
+
+        if(piece.empty() || (std::fwrite(piece.data(), 1, piece.size(), file) != piece.size()))
+        {
+            std::fprintf(stderr, "fagramm_bench: cannot write %s\n", path);
+            std::fclose(file);
+            return 1;
+        }
+    }
+    std::fclose(file);
+
+    return 0;
+}
+
+//
+// Formula grammar for the check benchmarks - set and scale operations over strings, like msvs/main.cpp
+//
+struct formula_grammar
+{
+    enum : int
+    {
+        P_LPAREN = 40, P_RPAREN, P_COMMA,
+
+        S_EXPRESSION = 100, S_SET_EXPRESSION, S_SET_OPERATION, S_SCALE_EXPRESSION, S_SCALE_OPERATION, S_ARGUMENT, S_MARGIN,
+    };
+
+    static constexpr unsigned tokenizer_flags = fagramm::tokenizer::Flag_Case_Sensitive_Keywords;
+
+    static constexpr const fagramm::token_info (&punctuations)[std::size(paren_punctuations)] = paren_punctuations;
+    static constexpr const fagramm::token_info (&keywords    )[std::size(bench_keywords    )] = bench_keywords;
+
+    static constexpr symbol_id start_symbol = symbol_id(S_EXPRESSION);
+
+    static void add_rules(fagramm::rules& rules)
+    {
+        rules.add(symbol_id(S_EXPRESSION)).symbol(symbol_id(S_SET_EXPRESSION));
+        rules.add(symbol_id(S_EXPRESSION)).symbol(symbol_id(S_SCALE_EXPRESSION));
+
+        rules.add(symbol_id(S_SET_EXPRESSION))
+            .symbol(symbol_id(S_SET_OPERATION))
+            .punctuation(symbol_id(P_LPAREN))
+            .symbol(symbol_id(S_ARGUMENT))
+            .loop(1)
+            .punctuation(symbol_id(P_COMMA))
+            .symbol(symbol_id(S_ARGUMENT))
+            .next()
+            .punctuation(symbol_id(P_RPAREN));
+
+        rules.add(symbol_id(S_SCALE_EXPRESSION))
+            .symbol(symbol_id(S_SCALE_OPERATION))
+            .punctuation(symbol_id(P_LPAREN))
+            .symbol(symbol_id(S_ARGUMENT))
+            .symbol(symbol_id(S_MARGIN))
+            .punctuation(symbol_id(P_RPAREN));
+
+        rules.add(symbol_id(S_MARGIN)).loop(6, 6).punctuation(symbol_id(P_COMMA)).number().next();
+        rules.add(symbol_id(S_MARGIN)).loop(3, 3).punctuation(symbol_id(P_COMMA)).number().next();
+        rules.add(symbol_id(S_MARGIN)).loop(1, 1).punctuation(symbol_id(P_COMMA)).number().next();
+
+        rules.add(symbol_id(S_SET_OPERATION)).keyword(symbol_id(1));
+        rules.add(symbol_id(S_SET_OPERATION)).keyword(symbol_id(2));
+        rules.add(symbol_id(S_SET_OPERATION)).keyword(symbol_id(3));
+        rules.add(symbol_id(S_SET_OPERATION)).keyword(symbol_id(4));
+
+        rules.add(symbol_id(S_SCALE_OPERATION)).keyword(symbol_id(5));
+        rules.add(symbol_id(S_SCALE_OPERATION)).keyword(symbol_id(6));
+
+        rules.add(symbol_id(S_ARGUMENT)).string();
+        rules.add(symbol_id(S_ARGUMENT)).symbol(symbol_id(S_EXPRESSION));
+    }
+};
+
+// a formula of nested operations with up to depth levels; the arguments of the operations may be strings
+static void append_formula(std::string& out, unsigned& seed, int depth, bool nested = false)
+{
+    seed = seed * 1103515245u + 12345u;
+
+    const unsigned pick = (seed >> 8);
+
+    if(nested && ((depth == 0) || ((pick % 4) == 0)))
+    {
+        out += "\"arg\"";
+        return;
+    }
+    if((pick % 3) == 0)
+    {
+        out += ((pick / 3) % 2 == 0) ? "EXPAND(" : "CONTRACT(";
+        append_formula(out, seed, depth - 1, true);
+        out += ((pick / 6) % 2 == 0) ? ", 1.5)" : ", 1, 2.5, 3)";
+        return;
+    }
+    out += bench_keywords[(pick / 3) % 4].str;
+    out += '(';
+    append_formula(out, seed, depth - 1, true);
+
+    for(unsigned count = 1 + (pick / 12) % 3; count != 0; --count)
+    {
+        out += ", ";
+        append_formula(out, seed, depth - 1, true);
+    }
+    out += ')';
+}
+
+// a call validates all the inputs
+static void bench_validate_many()
+{
+    const fagramm::tokenizer tokenizer(formula_grammar{});
+    const fagramm::grammar   grammar  (formula_grammar{});
+
+    // independent formulas of a few dozen to a few hundred bytes, every 8th of them invalid
+    constexpr size_t inputs_count = 200000;
+
+    std::vector<std::string> texts(inputs_count);
+
+    unsigned seed = 4321;
+
+    for(size_t index = 0; index < inputs_count; ++index)
+    {
+        append_formula(texts[index], seed, 1 + int(index % 5));
+
+        if((index % 8) == 7) texts[index].pop_back();
+    }
+
+    std::vector<std::string_view>  inputs (texts.begin(), texts.end());
+    std::vector<fagramm::result_t> results(inputs_count);
+
+    size_t bytes = 0;
+    for(const std::string& text : texts) bytes += text.size();
+
+    const size_t hardware_threads = std::max(1u, std::thread::hardware_concurrency());
+
+    char title[128];
+    std::snprintf(title, sizeof(title), "validate_many (%zu inputs, %.1f MB, %zu hardware threads, per input)", inputs_count, double(bytes) / 1e6, hardware_threads);
+
+    s_report.section("validate_many", title);
+
+    double single_thread_sec = 0;
+
+    for(size_t threads = 1; threads <= std::max<size_t>(hardware_threads, 4); threads *= 2)
+    {
+        fagramm::validation_pool pool(threads);
+
+        const measurement m = measure(5, [&] ()
+        {
+            pool.validate_many(tokenizer, grammar, inputs.data(), results.data(), inputs_count);
+        });
+
+        if(threads == 1) single_thread_sec = m.seconds;
+
+        const size_t passed = size_t(std::count_if(results.begin(), results.end(), [] (const fagramm::result_t& r) { return bool(r); }));
+
+        char name[64], note[64];
+        std::snprintf(name, sizeof(name), "%zu thread(s)", threads);
+        // more threads than hardware threads measure the overhead of the pool, not its scaling
+        std::snprintf(note, sizeof(note), "%6.2fx  (passed %zu)%s", single_thread_sec / m.seconds, passed, (threads > hardware_threads) ? "  oversubscribed" : "");
+
+        const double count = double(inputs_count);
+
+        s_report.add(name, {m.seconds / count, m.allocations / count}, 0, double(bytes) / count, note);
+    }
+}
+
+// heap allocations per validated input in the steady state - with a check_context there must be none, an allocation
+// there is reported as a failure
+static void bench_allocations()
+{
+    const fagramm::tokenizer tokenizer(formula_grammar{});
+    const fagramm::grammar   grammar  (formula_grammar{});
+
+    constexpr size_t inputs_count = 10000;
+
+    std::vector<std::string> texts(inputs_count);
+
+    unsigned seed = 2468;
+
+    for(size_t index = 0; index < inputs_count; ++index)
+    {
+        append_formula(texts[index], seed, 1 + int(index % 6));
+    }
+
+    struct mode
+    {
+        const char* name;
+        bool        packrat;
+        bool        parse;
+        bool        context;
+    };
+    static constexpr mode modes[] = {
+        {"tokenize + check"                   , false, false, false},
+        {"tokenize + check (check_context)"   , false, false, true },
+        {"tokenize + packrat (check_context)" , true , false, true },
+        {"tokenize + parse (check_context)"   , false, true , true },
+    };
+
+    s_report.section("allocations", "allocations (per input)");
+
+    for(const mode& m : modes)
+    {
+        fagramm::check_context ctx;
+        ctx.packrat = m.packrat;
+
+        size_t passed = 0;
+
+        // the warm up lets the buffers grow
+        const measurement all = measure(1, [&] ()
+        {
+            passed = 0;
+
+            for(const std::string& text : texts)
+            {
+                fagramm::result_t result;
+
+                if(m.context)
+                {
+                    result = tokenizer.tokenize(ctx, text.data(), text.size());
+
+                    if(result) result = m.parse ? grammar.parse(ctx) : grammar.check(ctx);
+                }
+                else
+                {
+                    fagramm::tokens_t tokens;
+
+                    result = tokenizer.tokenize(tokens, text.data(), text.size());
+
+                    if(result) result = grammar.check(tokens);
+                }
+                passed += bool(result);
+            }
+        });
+
+        char note[64];
+        std::snprintf(note, sizeof(note), "(passed %zu)", passed);
+
+        const double count = double(inputs_count);
+
+        s_report.add(m.name, {all.seconds / count, all.allocations / count}, 0, 0, note);
+
+        if(m.context && (all.allocations != 0))
+        {
+            std::fprintf(stderr, "fagramm_bench: %s allocates %.2f times per input in the steady state\n", m.name, all.allocations / count);
+            ++s_failures;
+        }
+    }
+}
+
+// a grammar with many symbols for measuring the start up - add_rules + prepare() against loading a saved image
+struct wide_grammar
+{
+    enum : int
+    {
+        P_LPAREN = 40, P_RPAREN, P_COMMA,
+
+        S_STATEMENT = 100, S_ARGUMENT, S_FIRST_COMMAND,
+    };
+    static constexpr int commands_count = 4000;
+
+    static constexpr symbol_id start_symbol = symbol_id(S_STATEMENT);
+
+    static void add_rules(fagramm::rules& rules)
+    {
+        rules.add(symbol_id(S_ARGUMENT)).string();
+        rules.add(symbol_id(S_ARGUMENT)).number();
+        rules.add(symbol_id(S_ARGUMENT)).symbol(symbol_id(S_STATEMENT));
+
+        // the commands are added in descending order to get the symbol table sorted the most
+        for(int index = commands_count - 1; index >= 0; --index)
+        {
+            const symbol_id command = symbol_id(S_FIRST_COMMAND + index);
+
+            rules.add(symbol_id(S_STATEMENT)).symbol(command);
+
+            rules.add(command)
+                .keyword(symbol_id(1 + index % int(std::size(bench_keywords))))
+                .ident()
+                .punctuation(symbol_id(P_LPAREN))
+                .loop(0)
+                .symbol(symbol_id(S_ARGUMENT))
+                .punctuation(symbol_id(P_COMMA))
+                .next()
+                .punctuation(symbol_id(P_RPAREN));
+        }
+    }
+};
+
+static void bench_load()
+{
+    const fagramm::tokenizer tokenizer(formula_grammar{});
+
+    const measurement prepare = measure(3, [] ()
+    {
+        const fagramm::grammar prepared(wide_grammar{});
+    });
+
+    const fagramm::grammar prepared(wide_grammar{});
+
+    std::vector<char> image;
+    fagramm::grammar_image::save(tokenizer, prepared, image);
+
+    fagramm::tokenizer loaded_tokenizer;
+    fagramm::grammar   loaded_grammar(wide_grammar{});
+    fagramm::result_t  result {};
+
+    const measurement load = measure(20, [&] ()
+    {
+        result = fagramm::grammar_image::load(loaded_tokenizer, loaded_grammar, image.data(), image.size());
+    });
+
+    // the image stands for a mapped file - the buffer of a vector is aligned, so only the descs and the symbols are copied
+    fagramm::tokenizer mapped_tokenizer;
+    fagramm::grammar   mapped_grammar(wide_grammar{});
+    fagramm::result_t  mapped_result {};
+
+    const measurement load_mapped = measure(20, [&] ()
+    {
+        mapped_result = fagramm::grammar_image::load_mapped(mapped_tokenizer, mapped_grammar, image.data(), image.size());
+    });
+
+    char title[64];
+    std::snprintf(title, sizeof(title), "start up (%d commands, image %zu KB)", wide_grammar::commands_count, image.size() / 1024);
+
+    s_report.section("start up", title);
+
+    // static traits - the tables are built at compile time and read in place
+    const measurement static_traits = measure(1000, [] ()
+    {
+        const fagramm::tokenizer static_tokenizer(structure_expression{});
+        const fagramm::grammar   static_grammar  (structure_expression{});
+    });
+
+    s_report.add("add_rules + prepare", prepare);
+    s_report.add("grammar_image::load", load   , 0, double(image.size()), result ? "(loaded)" : "(failed)");
+    s_report.add("grammar_image::load_mapped", load_mapped, 0, double(image.size()), mapped_result ? "(loaded)" : "(failed)");
+
+    s_report.add("static traits (structure_expression)", static_traits);
+
+    if(static_traits.allocations != 0)
+    {
+        std::fprintf(stderr, "fagramm_bench: static traits allocate %.2f times per tokenizer and grammar\n", static_traits.allocations);
+        ++s_failures;
+    }
+}
+
+static int usage()
+{
+    std::fprintf(stderr,
+        "usage: fagramm_bench [--json | --csv] [--output=FILE] [--filter=TEXT]\n"
+        "       fagramm_bench --corpus=FILE [--corpus-mb=N]\n"
+        "  --json, --csv    write the results as JSON or CSV (to stdout, or to FILE with the text to stdout)\n"
+        "  --output=FILE    write the JSON or CSV to FILE\n"
+        "  --filter=TEXT    run only the groups with TEXT in their name\n"
+        "  --corpus=FILE    write N MB (1024 by default) of generated structure_expression sentences to FILE,\n"
+        "                   one per line, every 8th of them a near miss\n"
+        "groups: find_keyword, tokenize, check_punct, remove_whitespace, extract, structure_expression,\n"
+        "        generated, validate_many, allocations, start up\n"
+        "exits with 1 when a check of a group fails, e.g. a check_context that allocates in the steady state\n"
+        );
+    return 2;
+}
+
+int main(int argc, char* argv[])
+{
+    std::string_view filter;
+    const char*      output = nullptr;
+    const char*      corpus = nullptr;
+    size_t           corpus_mb = 1024;
+
+    for(int index = 1; index < argc; ++index)
+    {
+        const std::string_view arg = argv[index];
+
+        if(arg == "--json")
+        {
+            s_report.format = report_format::json;
+        }
+        else if(arg == "--csv")
+        {
+            s_report.format = report_format::csv;
+        }
+        else if(arg.substr(0, 9) == "--output=")
+        {
+            output = argv[index] + 9;
+        }
+        else if(arg.substr(0, 9) == "--filter=")
+        {
+            filter = arg.substr(9);
+        }
+        else if(arg.substr(0, 9) == "--corpus=")
+        {
+            corpus = argv[index] + 9;
+        }
+        else if(arg.substr(0, 12) == "--corpus-mb=")
+        {
+            corpus_mb = size_t(std::strtoull(argv[index] + 12, nullptr, 10));
+        }
+        else
+        {
+            return usage();
+        }
+    }
+
+    if(corpus != nullptr)
+    {
+        return write_corpus(corpus, corpus_mb);
+    }
+
+    if((output != nullptr) && (s_report.format != report_format::text))
+    {
+        s_report.output = std::fopen(output, "w");
+
+        if(s_report.output == nullptr)
+        {
+            std::fprintf(stderr, "fagramm_bench: cannot open %s\n", output);
+            return 1;
+        }
+    }
+
+    struct bench
+    {
+        const char* group;
+        void      (*run)();
+    };
+    static constexpr bench benches[] = {
+        {"find_keyword"        , bench_find_keyword        },
+        {"tokenize"            , bench_tokenize            },
+        {"check_punct"         , bench_check_punct         },
+        {"remove_whitespace"   , bench_remove_whitespace   },
+        {"extract"             , bench_extract             },
+        {"structure_expression", bench_structure_expression},
+        {"generated"           , bench_generated           },
+        {"validate_many"       , bench_validate_many       },
+        {"allocations"         , bench_allocations         },
+        {"start up"            , bench_load                },
+    };
+
+    for(const bench& b : benches)
+    {
+        if(std::string_view(b.group).find(filter) != std::string_view::npos) b.run();
+    }
+
+    s_report.write();
+
+    if(s_report.output != stdout) std::fclose(s_report.output);
+
+    return (s_failures != 0) ? 1 : 0;
+}
@@ -6,8 +6,18 @@
 #define Check_ValidArg(  cond, ...) if(!(cond)) return __VA_ARGS__
 #define Check_ValidState(cond, ...) if(!(cond)) return __VA_ARGS__
 
+// 1 - grammar::check updates the counters of check_stats (0 - the counters are compiled out)
+#ifndef FAGRAMM_STATS
+#define FAGRAMM_STATS 0
+#endif
+
 #include <vector>
 #include <string>
+#include <string_view>
+#include <array>
+#include <type_traits>
+#include <utility>
+#include <cstdint>
 
 namespace fagramm
 {
@@ -32,6 +42,11 @@ struct token_info
     symbol_id   id;
     const char* str;
 };
+struct char_class_info
+{
+    unsigned    classes;
+    const char* chars;
+};
 struct token_data
 {
     token_type type;
@@ -42,6 +57,75 @@ struct token_data
 
 using tokens_t = std::vector<token_data>;
 
+// Compact token storage - the type and id of every token (all that grammar::check reads) in one array and 32 bit
+// positions and lengths in two others, 16 bytes per token instead of 24 and 8 of them read by a check.
+// The tokenized input must be shorter than 4 GB.
+struct token_kind
+{
+    token_type type;
+    symbol_id  id;
+};
+class compact_tokens
+{
+public:
+    std::vector<token_kind>    kinds;
+    std::vector<std::uint32_t> positions;
+    std::vector<std::uint32_t> lengths;
+
+public:
+    size_t size () const { return kinds.size (); }
+    bool   empty() const { return kinds.empty(); }
+
+    void clear()
+    {
+        kinds    .clear();
+        positions.clear();
+        lengths  .clear();
+    }
+    void reserve(size_t count)
+    {
+        kinds    .reserve(count);
+        positions.reserve(count);
+        lengths  .reserve(count);
+    }
+
+    void push_back(const token_data& token)
+    {
+        kinds    .push_back({token.type, token.id});
+        positions.push_back(std::uint32_t(token.pos));
+        lengths  .push_back(std::uint32_t(token.len));
+    }
+
+    token_data operator[](size_t index) const
+    {
+        return {kinds[index].type, kinds[index].id, positions[index], lengths[index]};
+    }
+};
+
+// An edit of a text - the removed characters at offset were replaced by the inserted ones
+struct text_edit
+{
+    size_t offset;
+    size_t removed;
+    size_t inserted;
+};
+
+// The tokens an edit replaced - removed tokens at index first of the tokens before the edit became inserted tokens
+struct token_edit
+{
+    size_t first;
+    size_t removed;
+    size_t inserted;
+};
+
+// A move of the tokens that is not applied yet - the tokens from index first on start delta characters further in the
+// text than their pos says. tokenizer::retokenize keeps it to the tokens behind the edit instead of moving them.
+struct token_shift
+{
+    size_t         first;
+    std::ptrdiff_t delta;
+};
+
 enum class parse_error : int
 {
     None,
@@ -61,6 +145,12 @@ enum class parse_error : int
     UnpreparedGramar,
     GrammarCheckFailed,
     WrongTokenType,
+    InvalidImage,
+    UnproductiveSymbol,
+    InvalidProfile,
+    InvalidCharClass,
+    GrammarNotLL1,
+    MaxDepthExceeded,
 };
 struct result_t
 {
@@ -70,8 +160,154 @@ struct result_t
     explicit operator bool() const { return (err == parse_error::None); }
 };
 
+class token_stream;
+class token_source;
+class check_context;
+class grammar_image;
+class sentence_generator;
+class incremental_check;
+
+// A prepared table of a tokenizer or grammar - its own vector, or an array read in place: one a static_tokens or
+// static_grammar built at compile time or one in an image grammar_image::load_mapped() loaded. Reads never copy; the
+// first change of such an array copies it to the vector.
+template<class T>
+class prepared_table
+{
+    prepared_table           (const prepared_table&) noexcept = delete;
+    prepared_table& operator=(const prepared_table&) noexcept = delete;
+
+public:
+    using value_type = T;
+
+    prepared_table() = default;
+   ~prepared_table() = default;
+
+    prepared_table(const T* data, size_t size) : m_data(data), m_size(size) {}
+
+    // the data of a moved vector stays where it was, so the pointer moves with it
+    prepared_table(prepared_table&& other) noexcept : m_vector(std::move(other.m_vector)), m_data(other.m_data), m_size(other.m_size)
+    {
+        other.update();
+    }
+    prepared_table& operator=(prepared_table&& other) noexcept
+    {
+        if(this == &other) return *this;
+
+        m_vector = std::move(other.m_vector);
+        m_data   = other.m_data;
+        m_size   = other.m_size;
+
+        other.m_vector.clear();
+        other.update();
+        return *this;
+    }
+
+public:
+    size_t size () const { return m_size; }
+    bool   empty() const { return (m_size == 0); }
+
+    const T* data () const { return m_data; }
+    const T* begin() const { return m_data; }
+    const T* end  () const { return m_data + m_size; }
+
+    const T& operator[](size_t index) const { return m_data[index]; }
+
+    const T& front() const { return m_data[0]; }
+    const T& back () const { return m_data[m_size - 1]; }
+
+    T* data () { return own(); }
+    T* begin() { return own(); }
+    T* end  () { return own() + m_size; }
+
+    T& operator[](size_t index) { return own()[index]; }
+
+    T& front() { return own()[0]; }
+    T& back () { return own()[m_size - 1]; }
+
+    // reads size elements at data in place, the vector is released
+    void bind(const T* data, size_t size)
+    {
+        std::vector<T>().swap(m_vector);
+
+        m_data = data;
+        m_size = size;
+    }
+
+    void clear()
+    {
+        m_vector.clear();
+        update();
+    }
+    void assign(size_t count, const T& value)
+    {
+        m_vector.assign(count, value);
+        update();
+    }
+    template<class It, class = std::enable_if_t<!std::is_integral_v<It>>>
+    void assign(It first, It last)
+    {
+        m_vector.assign(first, last);
+        update();
+    }
+    void resize(size_t count, const T& value = T())
+    {
+        own();
+        m_vector.resize(count, value);
+        update();
+    }
+    void push_back(const T& value)
+    {
+        own();
+        m_vector.push_back(value);
+        update();
+    }
+    template<class It>
+    void insert(const T* pos, It first, It last)
+    {
+        const size_t offset = size_t(pos - m_data);
+
+        own();
+        m_vector.insert(m_vector.begin() + std::ptrdiff_t(offset), first, last);
+        update();
+    }
+
+private:
+    T* own()
+    {
+        if(m_data != m_vector.data())
+        {
+            m_vector.assign(m_data, m_data + m_size);
+            update();
+        }
+        return m_vector.data();
+    }
+    void update()
+    {
+        m_data = m_vector.data();
+        m_size = m_vector.size();
+    }
+
+    std::vector<T> m_vector;
+    const T*       m_data = nullptr; // the data of m_vector or a static array
+    size_t         m_size = 0;
+};
+
+template<class T>
+class static_tokens;
+
+// static traits - traits whose add_rules is a constexpr template, see static_grammar
+template<class T, class = void>
+struct is_static_traits;
+
 class tokenizer
 {
+    friend class token_stream;
+    friend class token_source;
+    friend class grammar_image;
+    friend class sentence_generator;
+
+    template<class> friend class static_tokens;
+
     tokenizer           (const tokenizer&) noexcept = delete;
     tokenizer& operator=(const tokenizer&) noexcept = delete;
 
@@ -86,10 +322,32 @@ public:
     template<class T>
     tokenizer(T&& t)
     {
-    //  [[maybe_unused]]
-        result_t result = reset(t.punctuations, std::size(t.punctuations), t.keywords, std::size(t.keywords), t.tokenizer_flags);
+        using traits = std::remove_cv_t<std::remove_reference_t<T>>;
+
+        if constexpr(is_static_traits<traits>::value)
+        {
+            constexpr bool case_sensitive_keywords = ((traits::tokenizer_flags & Flag_Case_Sensitive_Keywords) != 0);
+
+            constexpr parse_error punctuations_error = check_static_tokens(traits::punctuations, std::size(traits::punctuations), true, false);
+            constexpr parse_error keywords_error     = check_static_tokens(traits::keywords, std::size(traits::keywords), case_sensitive_keywords, true);
+
+            static_assert(punctuations_error != parse_error::InvalidPunctuation   , "fagramm: empty punctuation");
+            static_assert(punctuations_error != parse_error::DuplicatePunctuations, "fagramm: duplicate punctuations");
+            static_assert(keywords_error     != parse_error::InvalidKeyword       , "fagramm: empty keyword");
+            static_assert(keywords_error     != parse_error::DuplicateKeywords    , "fagramm: duplicate keywords");
+
+            m_flags = traits::tokenizer_flags;
 
-        Check_ValidState(result,);
+            bind_static(m_punctuations, m_punctuation_index, static_tokens<traits>::punctuations);
+            bind_static(m_keywords    , m_keyword_index    , static_tokens<traits>::keywords    );
+        }
+        else
+        {
+        //  [[maybe_unused]]
+            result_t result = reset(t.punctuations, std::size(t.punctuations), t.keywords, std::size(t.keywords), t.tokenizer_flags);
+
+            Check_ValidState(result,);
+        }
     }
 
 public:
@@ -97,21 +355,41 @@ public:
     {
         Flag_Default                 = 0,
         Flag_Case_Sensitive_Keywords = (1 << 0),
+        Flag_Scalar_Scanning         = (1 << 1),
     };
     bool flag_is_set(unsigned flag) const
     {
         return ((m_flags & flag) != 0);
     }
 
+public:
+    enum : unsigned
+    {
+        Char_None  = 0,
+        Char_Space = (1 << 0),
+        Char_Digit = (1 << 1),
+        Char_Ident = (1 << 2),
+        Char_Punct = (1 << 3),
+
+        Char_All   = (Char_Space | Char_Digit | Char_Ident | Char_Punct),
+    };
+    bool char_is(char ch, unsigned classes) const
+    {
+        return ((m_char_classes[(unsigned char)ch] & classes) != 0);
+    }
+
 public:
     void clear();
 
+    // char_classes entries replace the classes of their characters, e.g. {Char_Ident, "_$"} allows '_' and '$' in identifiers
     result_t reset(
         const token_info* punctuations = nullptr,
         size_t punctuations_count = 0,
         const token_info* keywords = nullptr,
         size_t keywords_count = 0,
-        unsigned flags = Flag_Default
+        unsigned flags = Flag_Default,
+        const char_class_info* char_classes = nullptr,
+        size_t char_classes_count = 0
         );
 
     result_t tokenize(
@@ -121,17 +399,113 @@ public:
         )
         const;
 
+    // fails with InvalidArguments when the input is not shorter than 4 GB
+    result_t tokenize(
+        compact_tokens& tokens,
+        const char* str,
+        size_t len = size_t(-1)
+        )
+        const;
+
+    // replaces the tokens of the context, the trace_buffer of ctx.stack records the call
+    result_t tokenize(
+        check_context& ctx,
+        const char* str,
+        size_t len = size_t(-1)
+        )
+        const;
+
+    // tokenizes input that arrives in chunks - see token_stream
+    token_stream tokenize_stream(tokens_t& tokens) const;
+
+    // tokenizes str, the text after edit, again only around the edit - tokens must be the tokens tokenize() made of
+    // the text before the edit without an error. The tokens that end far enough before the edit are kept; from the
+    // last of them the text is tokenized until a token starts where a token of the old text started behind the edit,
+    // and the tokens from there on are kept with their positions shifted. changed tells which tokens were replaced.
+    // The result is the one tokenize() would return for str.
+    result_t retokenize(
+        tokens_t& tokens,
+        const char* str,
+        size_t len,
+        const text_edit& edit,
+        token_edit& changed
+        )
+        const;
+
+    // the same with the positions of the tokens behind the edit left to shift (see apply_shift) - they are not moved,
+    // only the tokens between shift.first and the edit are, so edits close to each other take time by their size
+    result_t retokenize(
+        tokens_t& tokens,
+        const char* str,
+        size_t len,
+        const text_edit& edit,
+        token_edit& changed,
+        token_shift& shift
+        )
+        const;
+
+    // moves the tokens by shift, which becomes empty
+    static void apply_shift(tokens_t& tokens, token_shift& shift);
+
+public:
+    bool find_punctuation(symbol_id& id, const char* str, size_t len) const;
+    bool find_keyword    (symbol_id& id, const char* str, size_t len) const;
+
 private:
-    static int compare_strings(
-        bool case_sensitive,
-        const char* str1,
-        size_t len1,
-        const char* str2,
-        size_t len2
-        );
     static bool is_valid_punctuation(const char* str);
     static bool is_valid_keyword(const char* str);
 
+    // the checks of reset_punctuations and reset_keywords, evaluated at compile time for static traits
+    static constexpr parse_error check_static_tokens(const token_info* tokens, size_t count, bool case_sensitive, bool keywords)
+    {
+        auto fold = [case_sensitive] (char ch) -> char
+        {
+            return ((ch >= 'a') && (ch <= 'z') && !case_sensitive) ? char(ch - 'a' + 'A') : ch;
+        };
+        for(size_t index = 0; index < count; ++index)
+        {
+            const char* str = tokens[index].str;
+
+            if((str == nullptr) || (*str == 0))
+            {
+                return keywords ? parse_error::InvalidKeyword : parse_error::InvalidPunctuation;
+            }
+            for(size_t other = 0; other < index; ++other)
+            {
+                const char* other_str = tokens[other].str;
+
+                size_t pos = 0;
+                while((str[pos] != 0) && (fold(str[pos]) == fold(other_str[pos]))) ++pos;
+
+                if((str[pos] == 0) && (other_str[pos] == 0))
+                {
+                    return keywords ? parse_error::DuplicateKeywords : parse_error::DuplicatePunctuations;
+                }
+            }
+        }
+        return parse_error::None;
+    }
+
+    using char_classes_t = std::array<unsigned char, 256>;
+
+    static char_classes_t default_char_classes();
+
+    // nibble lookup form of a character class for the vectorized scanners:
+    // character ch (< 0x80) belongs to the class when (lo_nibbles[ch & 15] & (1 << (ch >> 4))) != 0
+    struct scan_set
+    {
+        unsigned char lo_nibbles[16];
+        bool          vectorized;
+    };
+    static scan_set make_scan_set(const char_classes_t& char_classes, unsigned classes);
+
+    const char* skip_class(const char* str, const char* end, const scan_set& set, unsigned classes) const;
+
+    result_t reset_char_classes(
+        const char_class_info* char_classes,
+        size_t char_classes_count
+        );
+
     result_t reset_punctuations(
         const token_info* punctuations,
         size_t punctuations_count
@@ -141,9 +515,6 @@ private:
         size_t keywords_count
         );
 
-    bool find_punctuation(symbol_id& id, const char* str, size_t len) const;
-    bool find_keyword    (symbol_id& id, const char* str, size_t len) const;
-
 private:
     struct context
     {
@@ -151,8 +522,25 @@ private:
         const char* begin;
         const char* pos;
         parse_error err;
+        size_t      offset;     // position of begin in the whole input
+        bool        more_input; // the input continues after the end of the buffer
+        const char* partial;    // a token that may continue after the end of the buffer starts here
+        size_t      max_tokens; // tokenizing stops when tokens has that many
+
+        compact_tokens* compact = nullptr; // the tokens go here instead of to tokens
+
+        void add(const token_data& token)
+        {
+            if(compact != nullptr) compact->push_back(token); else tokens->push_back(token);
+        }
+        size_t count() const
+        {
+            return (compact != nullptr) ? compact->size() : tokens->size();
+        }
     };
 
+    const char* tokenize_range(const char* str, const char* end, context& ctx) const;
+
     void remove_whitespace(const char*& str, const char* end, context& ctx) const;
 
     bool check_string(const char*& str, const char* end, context& ctx) const;
@@ -167,11 +555,178 @@ private:
         const char* str;
         size_t      len;
     };
-    std::vector<token_desc> m_punctuations;
-    std::vector<token_desc> m_keywords;
+    using token_descs_t = prepared_table<token_desc>;
+
+    static constexpr unsigned char no_chars[256] = {};
+
+    // token index - a trie over the alphabet of a token table (case folded for case insensitive keywords)
+    struct token_index
+    {
+        prepared_table<unsigned char> chars {no_chars, 256}; // character -> alphabet index (0 - not a token character)
+        size_t                        alphabet = 0;
+        size_t                        max_len  = 0;
+        prepared_table<unsigned>      trie;                  // node * alphabet + alphabet index -> child node (0 - none)
+        prepared_table<unsigned>      leaf;                  // node -> index in the token table + 1 (0 - not a token)
+
+        void clear();
+
+        bool build(const token_descs_t& tokens, bool case_sensitive, size_t& duplicate_index);
+
+        unsigned find (const char* str, size_t len) const;
+        size_t   match(const char* str, const char* end, unsigned& found) const;
+    };
+
+    // the token table and token index of static traits, built at compile time the way reset() builds them
+    template<size_t Count, size_t Alphabet, size_t Nodes>
+    struct static_index
+    {
+        std::array<token_desc   , Count>            descs {};
+        std::array<unsigned char, 256>              chars {};
+        size_t                                      max_len = 0;
+        std::array<unsigned     , Nodes * Alphabet> trie {};
+        std::array<unsigned     , Nodes>            leaf {};
+    };
+
+    static constexpr unsigned char fold_char(char ch, bool case_sensitive)
+    {
+        const unsigned char uch = (unsigned char)ch;
+        return ((uch >= 'a') && (uch <= 'z') && !case_sensitive) ? (unsigned char)(uch - 'a' + 'A') : uch;
+    }
+    static constexpr size_t static_length(const char* str)
+    {
+        size_t len = 0;
+        for( ; (str != nullptr) && (str[len] != 0); ++len);
+        return len;
+    }
+
+    // the alphabet of the trie of tokens - the folded characters of the tokens and 0 for the others
+    static constexpr size_t static_alphabet(const token_info* tokens, size_t count, bool case_sensitive)
+    {
+        bool used[256] = {};
+
+        size_t alphabet = 1;
+
+        for(size_t index = 0; index < count; ++index)
+        {
+            const char* str = tokens[index].str;
+
+            for(size_t pos = 0, len = static_length(str); pos < len; ++pos)
+            {
+                bool& alpha = used[fold_char(str[pos], case_sensitive)];
+
+                if(!alpha) ++alphabet;
+                alpha = true;
+            }
+        }
+        return alphabet;
+    }
+
+    // the nodes of the trie of tokens - the root and every prefix of a token that no token before it starts with
+    static constexpr size_t static_nodes(const token_info* tokens, size_t count, bool case_sensitive)
+    {
+        size_t nodes = 1;
+
+        for(size_t index = 0; index < count; ++index)
+        {
+            const char*  str = tokens[index].str;
+            const size_t len = static_length(str);
+
+            size_t shared = 0;
+
+            for(size_t other = 0; other < index; ++other)
+            {
+                const char*  other_str = tokens[other].str;
+                const size_t other_len = static_length(other_str);
+
+                size_t pos = 0;
+                while((pos < len) && (pos < other_len) && (fold_char(str[pos], case_sensitive) == fold_char(other_str[pos], case_sensitive))) ++pos;
+
+                shared = (pos > shared) ? pos : shared;
+            }
+            nodes += len - shared;
+        }
+        return nodes;
+    }
+
+    // token_index::build at compile time, the nodes are numbered in the same order
+    template<size_t Count, size_t Alphabet, size_t Nodes>
+    static constexpr static_index<Count, Alphabet, Nodes> make_static_index(const token_info* tokens, bool case_sensitive)
+    {
+        static_index<Count, Alphabet, Nodes> index {};
+
+        size_t alphabet = 1;
+
+        for(size_t token = 0; token < Count; ++token)
+        {
+            const char*  str = tokens[token].str;
+            const size_t len = static_length(str);
+
+            index.descs[token] = {tokens[token].id, str, len};
+
+            for(size_t pos = 0; pos < len; ++pos)
+            {
+                unsigned char& alpha = index.chars[fold_char(str[pos], case_sensitive)];
+
+                if(alpha == 0) alpha = (unsigned char)alphabet++;
+            }
+            index.max_len = (len > index.max_len) ? len : index.max_len;
+        }
+        if(!case_sensitive)
+        {
+            for(unsigned ch = 'a'; ch <= 'z'; ++ch)
+            {
+                index.chars[ch] = index.chars[ch - 'a' + 'A'];
+            }
+        }
+
+        size_t nodes = 1;
+
+        for(size_t token = 0; token < Count; ++token)
+        {
+            const token_desc& desc = index.descs[token];
+
+            size_t node = 0;
+
+            for(size_t pos = 0; pos < desc.len; ++pos)
+            {
+                unsigned& child = index.trie[node * Alphabet + index.chars[(unsigned char)desc.str[pos]]];
+
+                if(child == 0) child = unsigned(nodes++);
+
+                node = child;
+            }
+            if(index.leaf[node] == 0) index.leaf[node] = unsigned(token + 1);
+        }
+        return index;
+    }
+
+    template<size_t Count, size_t Alphabet, size_t Nodes>
+    static void bind_static(token_descs_t& descs, token_index& index, const static_index<Count, Alphabet, Nodes>& tables)
+    {
+        descs.bind(tables.descs.data(), Count);
+
+        index.chars.bind(tables.chars.data(), tables.chars.size());
+        index.trie .bind(tables.trie .data(), tables.trie .size());
+        index.leaf .bind(tables.leaf .data(), tables.leaf .size());
+
+        index.alphabet = Alphabet;
+        index.max_len  = tables.max_len;
+    }
+
+    token_descs_t m_punctuations;
+    token_descs_t m_keywords;
+
+    token_index m_punctuation_index;
+    token_index m_keyword_index;
+
+    std::vector<char> m_strings; // the token strings grammar_image::load copied, the others are owned by the caller or the image
+
+    char_classes_t m_char_classes = default_char_classes();
+
+    scan_set m_space_set = make_scan_set(m_char_classes, Char_Space);
+    scan_set m_ident_set = make_scan_set(m_char_classes, Char_Ident);
 
-    size_t   m_max_punct_len = 0;
-    unsigned m_flags         = Flag_Default;
+    unsigned m_flags = Flag_Default;
 
 public:
     static parse_error extract_token_number(const char* str, const token_data& token,  float& number);
@@ -190,37 +745,179 @@ public:
         const token_data* token_begin,
         const token_data* token_end
         );
-};
 
-class rules;
+    // the same for token index of compact tokens
+    static parse_error extract_token_number(const char* str, const compact_tokens& tokens, size_t index,  float& number);
+    static parse_error extract_token_number(const char* str, const compact_tokens& tokens, size_t index, double& number);
 
-class rule
-{
-    friend class rules;
+    static parse_error extract_token_string(
+        const char* str,
+        const compact_tokens& tokens,
+        size_t index,
+        std::string& out,
+        bool unescape  = false,
+        bool addQuotes = false
+        );
 
-    rules* m_rules;
+    static std::string stringize_tokens(
+        const char* str,
+        const compact_tokens& tokens,
+        size_t first_index,
+        size_t last_index
+        );
+};
 
-    rule(rules& r) : m_rules(&r) {}
+// Keyword and punctuation tables of a tokenizer with static traits, built at compile time from T::punctuations,
+// T::keywords and T::tokenizer_flags - the token tables and tries reset() builds, tokenizer(T&&) reads them in place
+template<class T>
+class static_tokens
+{
+    static constexpr bool case_sensitive_keywords = ((T::tokenizer_flags & tokenizer::Flag_Case_Sensitive_Keywords) != 0);
 
-public:
-    rule loop(size_t min_repeats, size_t max_repeats = size_t(-1));
-    rule next();
-    rule symbol(symbol_id id);
+    static constexpr size_t punctuations_count = std::size(T::punctuations);
+    static constexpr size_t keywords_count     = std::size(T::keywords);
 
-    rule ident();
-    rule string();
-    rule number();
+public:
+    static constexpr auto punctuations = tokenizer::make_static_index<
+        punctuations_count,
+        tokenizer::static_alphabet(T::punctuations, punctuations_count, true),
+        tokenizer::static_nodes   (T::punctuations, punctuations_count, true)>(T::punctuations, true);
 
-    rule keyword(symbol_id id);
-    rule punctuation(symbol_id id);
+    static constexpr auto keywords = tokenizer::make_static_index<
+        keywords_count,
+        tokenizer::static_alphabet(T::keywords, keywords_count, case_sensitive_keywords),
+        tokenizer::static_nodes   (T::keywords, keywords_count, case_sensitive_keywords)>(T::keywords, case_sensitive_keywords);
 };
 
-class rules
+// Stateful tokenization of chunked input - feed() tokenizes each chunk as it arrives and carries a token that may
+// continue in the next chunk (an identifier, number, string or punctuation that reaches the end of the chunk) over
+// to it; finish() tokenizes the rest. Tokens are appended to the vector given to tokenizer::tokenize_stream and
+// their positions and error positions count from the start of the whole input, so the vector may be consumed
+// and cleared between the calls. Only the unfinished token is buffered, never the whole input - the carried token is
+// finished with as much of the next chunk as it takes and the rest of that chunk is tokenized in place.
+class token_stream
 {
-    friend class rule;
+    friend class tokenizer;
 
-    rules           (const rules&) noexcept = delete;
-    rules& operator=(const rules&) noexcept = delete;
+    token_stream           (const token_stream&) noexcept = delete;
+    token_stream& operator=(const token_stream&) noexcept = delete;
+
+    token_stream(const tokenizer& t, tokens_t& tokens) : m_tokenizer(&t), m_tokens(&tokens) {}
+
+public:
+    token_stream           (token_stream&&) noexcept = default;
+    token_stream& operator=(token_stream&&) noexcept = default;
+
+   ~token_stream() = default;
+
+public:
+    result_t feed(const char* chunk, size_t len);
+    result_t finish();
+
+    // position in the whole input of the first character that is not tokenized yet
+    size_t get_position() const { return m_offset; }
+
+private:
+    result_t tokenize(const char* str, size_t len, bool more_input);
+
+private:
+    const tokenizer* m_tokenizer;
+    tokens_t*        m_tokens;
+
+    std::string m_pending;          // the input from the start of an unfinished token on
+    size_t      m_offset      = 0;  // position of m_pending in the whole input
+    size_t      m_rescan_size = 0;  // m_pending is tokenized again once it grows to this size
+    bool        m_ended       = false;
+
+    result_t m_result {parse_error::None, symbol_id(0), 0};
+};
+
+// Pull based tokens for grammar::check - the input is tokenized lazily, window_size tokens at a time, when the check
+// reaches the end of the tokens pulled so far, and the tokens the check can no longer return to are dropped. A check
+// that fails stops tokenizing at once; tokenizer errors are reported only when the check reaches them or passes.
+// The source is consumed by a single check; reset() starts it over with new input and keeps its buffer.
+class token_source
+{
+    friend class grammar;
+
+    token_source           (const token_source&) noexcept = delete;
+    token_source& operator=(const token_source&) noexcept = delete;
+
+public:
+    token_source           (token_source&&) noexcept = default;
+    token_source& operator=(token_source&&) noexcept = default;
+
+    static constexpr size_t default_window_size = 64;
+
+    token_source(const tokenizer& t, const char* str, size_t len = size_t(-1), size_t window_size = default_window_size)
+        : m_tokenizer(&t), m_window_size((window_size != 0) ? window_size : 1)
+    {
+        reset(str, len);
+    }
+   ~token_source() = default;
+
+public:
+    void reset(const char* str, size_t len = size_t(-1));
+
+    // the tokenizer result of the input pulled so far
+    result_t get_result() const { return m_result; }
+
+private:
+    void pull(size_t keep_index, size_t min_count);
+    void drain();
+
+private:
+    const tokenizer* m_tokenizer;
+
+    const char* m_begin = nullptr;
+    const char* m_str   = nullptr;  // where tokenizing continues
+    const char* m_end   = nullptr;
+
+    tokens_t m_tokens;              // the window - tokens from m_dropped on
+    size_t   m_window_size;
+    size_t   m_dropped   = 0;
+    bool     m_exhausted = false;
+
+    result_t m_result {parse_error::None, symbol_id(0), 0};
+};
+
+class rules;
+
+class rule
+{
+    friend class rules;
+
+    rules* m_rules;
+
+    rule(rules& r) : m_rules(&r) {}
+
+public:
+    rule loop(size_t min_repeats, size_t max_repeats = size_t(-1));
+    rule next();
+    rule symbol(symbol_id id);
+
+    rule ident();
+    rule string();
+    rule number();
+
+    rule keyword(symbol_id id);
+    rule punctuation(symbol_id id);
+};
+
+template<size_t Capacity>
+class static_rules;
+template<class T>
+class static_grammar;
+
+class rules
+{
+    friend class rule;
+
+    template<size_t> friend class static_rules;
+    template<class>  friend class static_grammar;
+
+    rules           (const rules&) noexcept = delete;
+    rules& operator=(const rules&) noexcept = delete;
 
 protected:
     rules           (rules&&) noexcept = default;
@@ -263,7 +960,7 @@ protected:
         size_t     arg1;
         size_t     arg2;
     };
-    std::vector<chunk_data> m_chunks;
+    prepared_table<chunk_data> m_chunks;
 };
 
 inline rule rule::loop(size_t min_repeats, size_t max_repeats)
@@ -307,84 +1004,2028 @@ inline rule rule::punctuation(symbol_id id)
     return *this;
 }
 
-class grammar : protected rules
+// Compile-time counterpart of rules - the add_rules of static traits adds the rules into it while compiling:
+//
+//     template<class Rules>
+//     static constexpr void add_rules(Rules& rules) { rules.add(S_LIST).loop(1).symbol(S_ITEM).next(); ... }
+//
+// The same function still works with a rules object. static_rules<0> only counts the chunks.
+template<size_t Capacity>
+class static_rules
 {
-    grammar           (const grammar&) noexcept = delete;
-    grammar& operator=(const grammar&) noexcept = delete;
+    template<class> friend class static_grammar;
 
-public:
-    grammar           (grammar&&) noexcept = default;
-    grammar& operator=(grammar&&) noexcept = default;
+    using chunk_type = rules::chunk_type;
+    using chunk_data = rules::chunk_data;
 
 public:
-    template<typename T>
-    grammar(T&& t)
+    class rule
     {
-        t.add_rules(*this);
+        friend class static_rules;
+
+        static_rules* m_rules;
+
+        constexpr rule(static_rules& r) : m_rules(&r) {}
+
+    public:
+        constexpr rule loop(size_t min_repeats, size_t max_repeats = size_t(-1))
+        {
+            m_rules->push({chunk_type::loop, symbol_id(0), min_repeats, max_repeats});
+            return *this;
+        }
+        constexpr rule next()
+        {
+            m_rules->push({chunk_type::next, symbol_id(0), 0, 0});
+            return *this;
+        }
+        constexpr rule symbol(symbol_id id)
+        {
+            m_rules->push({chunk_type::symbol, id, 0, 0});
+            return *this;
+        }
+        constexpr rule ident()
+        {
+            m_rules->push({chunk_type::ident, symbol_id(0), 0, 0});
+            return *this;
+        }
+        constexpr rule string()
+        {
+            m_rules->push({chunk_type::string, symbol_id(0), 0, 0});
+            return *this;
+        }
+        constexpr rule number()
+        {
+            m_rules->push({chunk_type::number, symbol_id(0), 0, 0});
+            return *this;
+        }
+        constexpr rule keyword(symbol_id id)
+        {
+            m_rules->push({chunk_type::keyword, id, 0, 0});
+            return *this;
+        }
+        constexpr rule punctuation(symbol_id id)
+        {
+            m_rules->push({chunk_type::punctuation, id, 0, 0});
+            return *this;
+        }
+    };
 
-    //  [[maybe_unused]]
-        result_t result = prepare(t.start_symbol);
+    constexpr rule add(symbol_id id)
+    {
+        push({chunk_type::start, id, 0, 0});
+        return rule(*this);
+    }
 
-        Check_ValidState(result,);
+private:
+    constexpr void push(const chunk_data& chunk)
+    {
+        if constexpr(Capacity != 0)
+        {
+            m_chunks[m_count] = chunk;
+        }
+        ++m_count;
     }
 
+    std::array<chunk_data, Capacity> m_chunks {};
+    size_t                           m_count = 0;
+};
+
+template<class T, class>
+struct is_static_traits : std::false_type {};
+
+template<class T>
+struct is_static_traits<T, std::void_t<decltype(T::add_rules(std::declval<static_rules<0>&>()))>> : std::true_type {};
+
+// Packrat memoization storage for grammar::check - remembers the outcome of every (symbol, token position) pair.
+// The table is reused across checks and never grows beyond max_entries; when a check needs more entries than
+// that, the table works as a direct-mapped cache instead and only the latest outcome per slot is kept.
+class memo_table
+{
+    friend class grammar;
+
+    memo_table           (const memo_table&) noexcept = delete;
+    memo_table& operator=(const memo_table&) noexcept = delete;
+
+public:
+    memo_table           (memo_table&&) noexcept = default;
+    memo_table& operator=(memo_table&&) noexcept = default;
+
+    static constexpr size_t default_max_entries = size_t(1) << 18;
+
+    explicit memo_table(size_t max_entries = default_max_entries) : m_max_entries(max_entries) {}
+   ~memo_table() = default;
+
 public:
     void clear();
-    rule add_rule(symbol_id id);
+
+    void   set_max_entries(size_t max_entries) { m_max_entries = max_entries; }
+    size_t get_max_entries() const { return m_max_entries; }
+
+private:
+    struct entry
+    {
+        std::uint32_t stamp;
+        std::uint32_t symbol;
+        std::uint32_t pos;
+        std::uint32_t result; // 0 - failed, otherwise end position + 1
+    };
+
+    // Token is token_data or token_kind, the one the check runs on
+    template<class Token>
+    bool start(const Token* begin, const Token* end, size_t symbols_count);
+
+    template<class Token>
+    const Token* base() const { return static_cast<const Token*>(m_base); }
+
+    template<class Token>
+    entry& slot(size_t symbol_index, const Token* token)
+    {
+        const size_t pos   = size_t(token - base<Token>());
+        const size_t index = pos * m_symbols + symbol_index;
+
+        return m_entries[m_hashed ? ((index * 0x9E3779B1u) & (m_entries.size() - 1)) : index];
+    }
+    template<class Token>
+    bool is_set(const entry& e, size_t symbol_index, const Token* token) const
+    {
+        return (e.stamp == m_stamp) && (e.symbol == symbol_index) && (e.pos == size_t(token - base<Token>()));
+    }
+    template<class Token>
+    void set(entry& e, size_t symbol_index, const Token* token, bool passed, const Token* end_token) const
+    {
+        e = {m_stamp, std::uint32_t(symbol_index), std::uint32_t(token - base<Token>()), passed ? std::uint32_t(end_token - base<Token>() + 1) : 0};
+    }
+
+private:
+    std::vector<entry> m_entries;
+
+    const void*   m_base    = nullptr;
+    size_t        m_symbols = 0;
+    bool          m_hashed  = false;
+    std::uint32_t m_stamp   = 0;
+
+    size_t m_max_entries;
+};
+
+// A node of the parse tree built by grammar::parse - the tree is a flat array, tree[0] is the start symbol and the
+// children of every node are stored one after another at [first_child, first_child + children_count).
+// Token positions are indexes in the token vector given to parse().
+struct parse_node
+{
+    symbol_id id;
+    unsigned  alternative;     // index of the rule of the symbol that passed, in the order the rules were added
+    size_t    first_token;
+    size_t    tokens_count;
+    size_t    first_child;
+    size_t    children_count;
+};
+
+using parse_tree_t = std::vector<parse_node>;
+
+// Counters of grammar::check for finding the rules that cause rework. They are kept by the check_stack of the checks
+// and updated only when the library is built with FAGRAMM_STATS=1; otherwise the checks do not touch them and they
+// stay zero. The counters add up over the checks of one grammar until reset_stats(); the counters of several stacks,
+// e.g. of one per thread, add up with +=. A check of an earley grammar counts the rules it predicts as tried, it does
+// not backtrack, loop or nest.
+struct check_stats
+{
+    static constexpr bool enabled = (FAGRAMM_STATS != 0);
+
+    struct rule_counters
+    {
+        symbol_id     id;                  // symbol of the rule
+        unsigned      alternative;         // index of the rule of the symbol, in the order the rules were added
+        std::uint64_t tried;               // verifications of the rule
+        std::uint64_t failed;              // verifications that failed, each followed by a backtrack
+        std::uint64_t tokens_reverified;   // tokens matched by the failed verifications
+    };
+
+    std::uint64_t checks            = 0;
+    std::uint64_t alternatives      = 0; // rules tried, over all symbols
+    std::uint64_t backtracks        = 0; // failed rules - the check goes back to the first token of their symbol
+    std::uint64_t tokens_reverified = 0; // tokens matched by failed rules and failed loop iterations, to be matched again
+    std::uint64_t loop_iterations   = 0; // loop iterations that passed
+    std::uint64_t memo_hits         = 0; // symbols whose outcome came from the memo table
+    size_t        max_depth         = 0; // greatest nesting of symbols
+
+    std::vector<rule_counters> rules;    // rule index -> counters, the rules sorted by symbol id
+
+    void clear();
+
+    check_stats& operator+=(const check_stats& other);
+};
+
+enum class trace_event : unsigned char
+{
+    tokenize_begin,
+    tokenize_end,       // count - tokens, err - result of the tokenizer
+    check_begin,        // pos - first token
+    check_end,          // count - tokens passed, err - result of the check
+    rule_enter,         // an alternative of a symbol is verified from token pos
+    rule_exit,          // the alternative passed with count tokens
+    rule_fail,          // the alternative failed after count tokens, the check goes back to token pos
+    loop_iteration,     // an iteration passed, count - iterations so far
+};
+
+// Recorder of the events of grammar::check and tokenizer::tokenize(check_context&) on the check_stack it is set to,
+// e.g. for finding where one slow input spends its time. The events go to a ring buffer allocated up front - when it
+// is full the oldest events are overwritten. A trace_buffer is not thread safe, every thread needs its own.
+class trace_buffer
+{
+    trace_buffer           (const trace_buffer&) noexcept = delete;
+    trace_buffer& operator=(const trace_buffer&) noexcept = delete;
 
 public:
-    result_t prepare(symbol_id start_id);
+    trace_buffer           (trace_buffer&&) noexcept = default;
+    trace_buffer& operator=(trace_buffer&&) noexcept = default;
 
-    result_t check(
-        const tokens_t& tokens,
-        size_t index = 0,
-        size_t count = npos
-        ) const;
+    static constexpr size_t default_capacity = size_t(1) << 16;
+
+    explicit trace_buffer(size_t capacity = default_capacity);
+   ~trace_buffer() = default;
+
+public:
+    struct event
+    {
+        std::uint64_t time;         // nanoseconds since the trace_buffer was created
+        size_t        pos;          // token index, 0 for the tokenizer events
+        size_t        count;
+        symbol_id     id;           // symbol of the rule events
+        unsigned      alternative;  // index of the rule of the symbol, in the order the rules were added
+        parse_error   err;
+        trace_event   type;
+    };
+
+    // names of the symbols in the exported trace, symbol ids are written when it returns nullptr
+    using symbol_name_fn = const char* (*)(symbol_id id);
+
+public:
+    void clear();
+
+    void record(trace_event type, size_t pos, size_t count, symbol_id id = symbol_id(0), unsigned alternative = 0, parse_error err = parse_error::None);
+
+    size_t get_capacity() const { return m_events.size(); }
+    size_t size        () const { return (m_written < m_events.size()) ? size_t(m_written) : m_events.size(); }
+    size_t get_dropped () const { return size_t(m_written) - size(); }
+
+    // index 0 is the oldest event kept
+    const event& operator[](size_t index) const
+    {
+        return m_events[(m_written < m_events.size()) ? index : ((m_next + index) % m_events.size())];
+    }
+
+    // appends the events as JSON of the Chrome trace event format (chrome://tracing, Perfetto) - rules and checks are
+    // complete events, a rule that failed is named "<symbol>/<alternative> failed", loop iterations are instant events
+    void write_chrome_trace(std::string& json, symbol_name_fn symbol_name = nullptr, unsigned thread_id = 0) const;
 
 private:
-    struct loop_data
+    std::vector<event> m_events;
+
+    size_t        m_next    = 0;
+    std::uint64_t m_written = 0;
+    std::int64_t  m_origin  = 0;   // steady clock time of the creation, in nanoseconds
+};
+
+// Counts of the rule alternatives that passed, recorded by the checks on the check_stacks it is set to, for
+// grammar::reoptimize. The counts of one grammar are kept in the order of its rules; several profiles (e.g. one per
+// thread) add up with +=. save() writes them as text lines "<symbol id> <alternative> <count>", so a profile collected
+// by one deployment can be load()ed by another one with the same grammar.
+class grammar_profile
+{
+    friend class grammar;
+
+public:
+    struct rule_count
     {
-        size_t cur_repeats;
-        size_t min_repeats;
-        size_t max_repeats;
-        size_t first_index;
-        const token_data* token;
+        symbol_id     id;
+        unsigned      alternative;  // index of the rule of the symbol, in the order the rules were added
+        std::uint64_t passed;
     };
-    using loop_stack_t = std::vector<loop_data>;
+
+public:
+    void clear() { m_rules.clear(); }
+
+    grammar_profile& operator+=(const grammar_profile& other);
+
+    const std::vector<rule_count>& get_rules() const { return m_rules; }
+
+    std::uint64_t get_passed(symbol_id id, unsigned alternative) const;
+
+    void save(std::string& out) const;
+
+    // fails with InvalidProfile and the offset of the line that is not valid
+    result_t load(std::string_view text);
 
 private:
-    size_t find_symbol_with_id(symbol_id id) const;
-    size_t find_or_add_symbol(symbol_id id);
+    std::vector<rule_count> m_rules; // sorted by id and alternative
+};
+
+// Explicit stacks of grammar::check - the checker does not recurse, it keeps the symbols being verified and the open
+// loops here instead. The nesting depth of symbols is bounded by max_depth, deeper input fails with MaxDepthExceeded.
+// The earley engine keeps its chart here as well. The storage is reused across checks, so a check_stack kept by the
+// caller makes repeated checks allocation free.
+class check_stack
+{
+    friend class grammar;
+
+    check_stack           (const check_stack&) noexcept = delete;
+    check_stack& operator=(const check_stack&) noexcept = delete;
 
-    bool verify_rule(const token_data*& token, const token_data* end, size_t symbol_index, loop_stack_t& loop_stack) const;
+public:
+    check_stack           (check_stack&&) noexcept = default;
+    check_stack& operator=(check_stack&&) noexcept = default;
+
+    static constexpr size_t default_max_depth = size_t(1) << 16;
+
+    explicit check_stack(size_t max_depth = default_max_depth) : m_max_depth(max_depth) {}
+   ~check_stack() = default;
+
+public:
+    void clear();
+
+    void   set_max_depth(size_t max_depth) { m_max_depth = max_depth; }
+    size_t get_max_depth() const { return m_max_depth; }
+
+    // the counters of the checks on this stack (clear() keeps them)
+    const check_stats& get_stats() const { return m_stats; }
+    void             reset_stats() { m_stats.clear(); }
 
-    bool verify_token(const token_data*& token, const token_data* end, token_type type) const;
-    bool verify_token(const token_data*& token, const token_data* end, token_type type, symbol_id id) const;
+    // the events of the checks on this stack go to trace (nullptr - no tracing), trace must outlive the checks
+    void          set_trace(trace_buffer* trace) { m_trace = trace; }
+    trace_buffer* get_trace() const { return m_trace; }
+
+    // the checks on this stack count the alternatives that pass in profile (nullptr - no counting)
+    void             set_profile(grammar_profile* profile) { m_profile = profile; }
+    grammar_profile* get_profile() const { return m_profile; }
 
 private:
-    struct rule_data
+    // token positions point to token_data or token_kind, whichever the check runs on
+    struct frame
     {
-        bool operator<(const rule_data& other) const
-        {
-            return (id != other.id) ? (id < other.id) : (order < other.order);
-        }
-        symbol_id id;
-        unsigned  order;
-        size_t    first_chunk;
-        size_t    last_chunk;
+        size_t        symbol_index;
+        size_t        return_pc;
+        size_t        loops_base;     // loops opened by the caller
+        const void*   start_token;
+        const size_t* dispatch;       // the alternative being verified
+        const size_t* dispatch_end;
     };
-    struct symbol_data
+    struct loop
     {
-        bool operator<(const symbol_data& other) const
-        {
-            return (id < other.id);
-        }
-        symbol_id id;
-        size_t    first_rule;
-        size_t    last_rule;
+        size_t      repeats;
+        size_t      loop_index;
+        const void* token;            // where the current iteration started
+    };
+
+    // sizes of m_nodes and the tree when a symbol or a loop iteration started - kept by grammar::parse only
+    struct nodes_mark
+    {
+        size_t nodes;
+        size_t tree;
+        size_t reach;  // the furthest token examined when a symbol started, for incremental_check
+    };
+
+    std::vector<frame>      m_frames;
+    std::vector<loop>       m_loops;
+    std::vector<parse_node> m_nodes;        // completed nodes whose parent is not completed yet
+    std::vector<size_t>     m_node_reach;   // nodes_mark::reach of m_nodes, for incremental_check
+    std::vector<nodes_mark> m_frame_marks;  // one per frame
+    std::vector<nodes_mark> m_loop_marks;   // one per loop
+
+    // the chart of the earley engine - an item is a production with the part of it matched so far
+    struct earley_item
+    {
+        size_t slot;    // instruction of the production to match next
+        size_t links;   // entry of m_earley_links of its nonterminal in the set where the production started
+    };
+    struct earley_key
+    {
+        size_t slot;
+        size_t links;
+        size_t stamp;   // m_earley_stamp of the set the item is in
+    };
+
+    // a nonterminal predicted in a set - the items of the set that call it, so a completion visits only the callers,
+    // and the Leo item of the completions: the topmost complete item they lead to while every set on the way has a
+    // single caller that ends with the call. The entries of a set are in a row.
+    enum class earley_leo : unsigned char
+    {
+        unknown,
+        none,
+        item,
+        pending,    // being resolved
+    };
+    struct earley_links
+    {
+        size_t     origin;      // the set
+        size_t     nonterminal;
+        size_t     caller;      // first item that calls the nonterminal (npos - none)
+        size_t     callers;     // first of the callers chained in m_earley_callers (npos - not chained)
+        size_t     leo_slot;
+        size_t     leo_links;
+        earley_leo leo;
+        bool       several;     // more than one caller
+    };
+    struct earley_prediction
+    {
+        size_t stamp;   // m_earley_stamp of the last set that predicted the nonterminal
+        size_t links;   // its entry there
+    };
+    struct earley_origin
+    {
+        size_t links;   // first entry of the set (npos - the callers of the entries are chained)
+        size_t scans;   // completions that scanned the set for the callers
+    };
+    struct earley_caller
+    {
+        size_t item;
+        size_t next;    // npos - the last caller
+    };
+    // the items of all the sets by set, slot and origin and the first complete item of every nonterminal of a set
+    // (origin npos) - the parse tree is read back with it
+    struct earley_entry
+    {
+        size_t set;
+        size_t slot;
+        size_t origin;
+        size_t item;    // npos - a free entry
     };
-    std::vector<rule_data>   m_rules;
-    std::vector<symbol_data> m_symbols;
+
+    // the parse tree is read back from the chart - the children of an item are expanded before its node is finished
+    enum class earley_walk : unsigned char
+    {
+        item,   // arg - completed item, end - its set
+        empty,  // arg - nullable nonterminal that matched no tokens at end
+        node,   // arg - rule whose children are complete, start - end its tokens, nodes - first child in m_nodes
+    };
+    struct earley_step
+    {
+        earley_walk type;
+        size_t      arg;
+        size_t      start;
+        size_t      end;
+        size_t      nodes;
+    };
+
+    std::vector<earley_item>       m_earley_items;           // the sets one after another
+    std::vector<size_t>            m_earley_sets;            // set -> first item
+    std::vector<earley_item>       m_earley_scanned;         // the items of the next set
+    std::vector<earley_key>        m_earley_index;           // open addressing hash of the items of the current set
+    std::vector<earley_prediction> m_earley_predicted;       // by nonterminal
+    std::vector<earley_links>      m_earley_links;           // one entry per predicted nonterminal and set
+    std::vector<earley_origin>     m_earley_origins;         // one per set
+    std::vector<size_t>            m_earley_callees;         // nonterminal -> its entry in the set being chained
+    std::vector<earley_caller>     m_earley_callers;
+    std::vector<size_t>            m_earley_path;            // entries of m_earley_links whose Leo items are being resolved
+    std::vector<earley_step>       m_earley_steps;
+    std::vector<size_t>            m_earley_next;            // item -> next complete item of its nonterminal (npos - last)
+    std::vector<earley_entry>      m_earley_entries;         // open addressing hash by set, slot and origin
+    size_t                         m_earley_stamp = 0;
+
+    size_t m_max_depth;
+
+    check_stats m_stats;
+
+    trace_buffer*    m_trace   = nullptr;
+    grammar_profile* m_profile = nullptr;
+};
+
+// Reusable storage of tokenizer::tokenize + grammar::check/parse - the buffers keep their capacity between calls,
+// so once they have grown to the size of the inputs, validating with a context does not allocate memory.
+class check_context
+{
+    check_context           (const check_context&) noexcept = delete;
+    check_context& operator=(const check_context&) noexcept = delete;
+
+public:
+    check_context           (check_context&&) noexcept = default;
+    check_context& operator=(check_context&&) noexcept = default;
+
+    check_context() = default;
+   ~check_context() = default;
+
+public:
+    // releases the memory of the buffers
+    void clear();
+
+public:
+    tokens_t     tokens;
+    check_stack  stack;
+    memo_table   memo;
+    parse_tree_t tree;
+
+    bool packrat = false; // grammar::check uses memo
+};
+
+enum class grammar_engine : int
+{
+    automatic,      // prepare() picks ll1 when the grammar allows it, backtracking otherwise
+    backtracking,   // top-down checking with ordered choice of the rule alternatives
+    ll1,            // table-driven predictive parsing without backtracking
+    earley,         // general context-free checking, only on request - see grammar::verify_earley
+};
+
+class grammar : protected rules
+{
+    friend class grammar_image;
+    friend class sentence_generator;
+    friend class incremental_check;
+
+    template<class> friend class static_grammar;
+
+    grammar           (const grammar&) noexcept = delete;
+    grammar& operator=(const grammar&) noexcept = delete;
+
+public:
+    grammar           (grammar&&) noexcept = default;
+    grammar& operator=(grammar&&) noexcept = default;
+
+public:
+    template<typename T>
+    grammar([[maybe_unused]] T&& t)
+    {
+        using traits = std::remove_cv_t<std::remove_reference_t<T>>;
+
+        if constexpr(is_static_traits<traits>::value)
+        {
+            using tables = static_grammar<traits>;
+
+            static_assert(tables::data.err != parse_error::InvalidLoopArguments , "fagramm: loop with invalid repeat counts");
+            static_assert(tables::data.err != parse_error::NextWithoutLoop      , "fagramm: next without loop");
+            static_assert(tables::data.err != parse_error::MismatchLoopNextPairs, "fagramm: loop without next");
+            static_assert(tables::data.err != parse_error::SymbolWithoutRule    , "fagramm: symbol without rules");
+
+            prepare_static(tables::prepared);
+        }
+        else
+        {
+            t.add_rules(*this);
+
+        //  [[maybe_unused]]
+            result_t result = prepare(t.start_symbol);
+
+            Check_ValidState(result,);
+        }
+    }
+
+public:
+    void clear();
+    rule add_rule(symbol_id id);
+
+public:
+    // rewrites of the rules by prepare() - the grammar accepts the same tokens, but the parse trees of the rewritten rules
+    // differ: inlined symbols have no nodes and factored alternatives get nodes of new symbols (ids above the others)
+    enum : unsigned
+    {
+        Optimize_None           = 0,
+        Optimize_Unit_Rules     = (1 << 0), // symbols that only call another symbol are inlined
+        Optimize_Left_Factoring = (1 << 1), // neighbour alternatives with a common prefix share one match of it
+        Optimize_Loops          = (1 << 2), // loop(1,1) is unwrapped, repeats of the same loop body are merged
+        Optimize_All            = Optimize_Unit_Rules | Optimize_Left_Factoring | Optimize_Loops,
+    };
+    struct optimization_report
+    {
+        size_t chunks_before;
+        size_t chunks_after;
+        size_t rules_before;
+        size_t rules_after;
+        size_t inlined_symbols;
+        size_t factored_alternatives;
+        size_t merged_loops;
+    };
+
+    result_t prepare(symbol_id start_id, grammar_engine engine = grammar_engine::automatic, unsigned optimizations = Optimize_None);
+
+    // what the optimizations of the last prepare() did
+    const optimization_report& get_optimization_report() const { return m_optimization_report; }
+
+    grammar_engine get_engine() const { return m_engine; }
+
+    // reorders the alternatives tried for every terminal class, the ones that passed more often in profile first - two
+    // alternatives are swapped only when no input can pass both of them (neither matches zero or one token and their
+    // second tokens differ), so the outcome of checks stays the same; prepare() restores the order the rules were added
+    result_t reoptimize(const grammar_profile& profile);
+
+    result_t check(
+        const tokens_t& tokens,
+        size_t index = 0,
+        size_t count = npos
+        ) const;
+
+    // packrat mode - every (symbol, token position) pair is verified at most once per check
+    result_t check(
+        const tokens_t& tokens,
+        memo_table& memo,
+        size_t index = 0,
+        size_t count = npos
+        ) const;
+
+    // the stacks of the check are kept in caller storage; memo may be null
+    result_t check(
+        const tokens_t& tokens,
+        check_stack& stack,
+        memo_table* memo = nullptr,
+        size_t index = 0,
+        size_t count = npos
+        ) const;
+
+    // checks the tokens and fills tree with the parse tree of the accepted tokens in the same pass
+    result_t parse(
+        const tokens_t& tokens,
+        parse_tree_t& tree,
+        size_t index = 0,
+        size_t count = npos
+        ) const;
+
+    result_t parse(
+        const tokens_t& tokens,
+        parse_tree_t& tree,
+        check_stack& stack,
+        size_t index = 0,
+        size_t count = npos
+        ) const;
+
+    // the same for compact tokens
+    result_t check(
+        const compact_tokens& tokens,
+        size_t index = 0,
+        size_t count = npos
+        ) const;
+
+    result_t check(
+        const compact_tokens& tokens,
+        memo_table& memo,
+        size_t index = 0,
+        size_t count = npos
+        ) const;
+
+    result_t check(
+        const compact_tokens& tokens,
+        check_stack& stack,
+        memo_table* memo = nullptr,
+        size_t index = 0,
+        size_t count = npos
+        ) const;
+
+    result_t parse(
+        const compact_tokens& tokens,
+        parse_tree_t& tree,
+        size_t index = 0,
+        size_t count = npos
+        ) const;
+
+    result_t parse(
+        const compact_tokens& tokens,
+        parse_tree_t& tree,
+        check_stack& stack,
+        size_t index = 0,
+        size_t count = npos
+        ) const;
+
+    // checks ctx.tokens with the stack and (when ctx.packrat is set) the memo table of the context
+    result_t check(
+        check_context& ctx,
+        size_t index = 0,
+        size_t count = npos
+        ) const;
+
+    // parses ctx.tokens into ctx.tree
+    result_t parse(
+        check_context& ctx,
+        size_t index = 0,
+        size_t count = npos
+        ) const;
+
+    // tokenizes and checks in one pass, see token_source
+    result_t check(token_source& source) const;
+    result_t check(token_source& source, check_stack& stack) const;
+
+private:
+    // the checks run on token_data or on the token_kind array of compact tokens
+    template<class Token>
+    struct verify_context
+    {
+        const Token*  begin;
+        const Token*  end;
+        check_stack&  stack;
+        memo_table*   memo;
+        parse_tree_t* tree;
+        token_source* source;
+        size_t        start_index;
+
+        std::vector<size_t>* reach    = nullptr; // with tree - nodes_mark::reach of every node of the tree
+        size_t               furthest = 0;       // with reach - the furthest token examined by a check that passed
+    };
+
+private:
+    size_t find_symbol_with_id(symbol_id id) const;
+
+    result_t prepare_rules();
+
+    // the rules of a symbol while prepare() optimizes them - the symbol chunks refer to symbols by id
+    using chunks_t = std::vector<chunk_data>;
+
+    struct symbol_rules
+    {
+        symbol_id             id;
+        std::vector<chunks_t> rules;
+        bool                  nullable;
+    };
+
+    void optimize_rules(symbol_id start_id, unsigned optimizations);
+    void inline_unit_rules(std::vector<symbol_rules>& symbols, symbol_id start_id);
+    void factor_rules(std::vector<symbol_rules>& symbols);
+    void merge_loops(chunks_t& chunks, const std::vector<symbol_rules>& symbols);
+
+    static size_t find_rules(const std::vector<symbol_rules>& symbols, symbol_id id);
+    static void   update_nullable(std::vector<symbol_rules>& symbols);
+    static bool   items_nullable(const std::vector<symbol_rules>& symbols, const chunks_t& chunks, size_t first, size_t last);
+    static size_t item_end(const chunks_t& chunks, size_t index);
+    static bool   same_chunks(const chunk_data* a, const chunk_data* b, size_t count);
+
+    template<class Token>
+    result_t check_range(const Token* tokens, size_t size, size_t index, size_t count, check_stack& stack, memo_table* memo, parse_tree_t* tree) const;
+
+    // parses the symbol at tokens[index] like check_range() parses the start symbol and keeps the tokens the check
+    // examined in reach (parallel to tree) and furthest - see incremental_check; not for the earley engine
+    result_t parse_reach(const tokens_t& tokens, size_t symbol_index, size_t index, check_stack& stack, parse_tree_t& tree, std::vector<size_t>& reach, size_t& furthest) const;
+
+    void pull_tokens(const token_data*& token, verify_context<token_data>& ctx) const;
+
+    result_t prepare_engine(symbol_id start_id, grammar_engine engine);
+
+    bool prepare_loops();
+    void prepare_terminal_classes();
+    void prepare_first_sets();
+    void prepare_dispatch();
+
+    bool prepare_ll1();
+    void prepare_code();
+
+    bool sequence_second(size_t first_chunk, size_t last_chunk, const std::vector<std::uint64_t>& rule_second, const std::vector<char>& rule_one, std::uint64_t* second) const;
+
+    void prepare_second_sets(std::vector<std::uint64_t>& rule_second, std::vector<char>& rule_one) const;
+
+    static constexpr bool has_class(const std::uint64_t* set, size_t cls)
+    {
+        return ((set[cls / 64] & (std::uint64_t(1) << (cls % 64))) != 0);
+    }
+
+    template<class Token>
+    size_t terminal_class(const Token* token, const Token* end) const;
+    size_t terminal_class(const chunk_data& chunk) const;
+
+    template<class Token>
+    void add_node     (verify_context<Token>& ctx, const check_stack::frame& frame, const Token* token) const;
+    template<class Token>
+    void add_leaf_node(verify_context<Token>& ctx, size_t symbol_index, const Token* token) const;
+
+    template<class Token>
+    static check_stack::nodes_mark current_mark(const verify_context<Token>& ctx, size_t reach = npos)
+    {
+        return {ctx.stack.m_nodes.size(), ctx.tree->size(), reach};
+    }
+    template<class Token>
+    static void rollback_nodes(verify_context<Token>& ctx, const check_stack::nodes_mark& mark)
+    {
+        ctx.stack.m_nodes.resize(mark.nodes);
+        ctx.tree->resize(mark.tree);
+
+        if(ctx.reach != nullptr)
+        {
+            ctx.stack.m_node_reach.resize(mark.nodes);
+            ctx.reach->resize(mark.tree);
+        }
+    }
+
+    void start_stats(check_stats& stats) const;
+    void start_profile(grammar_profile& profile) const;
+
+    // pos_token is a Token pointer, the symbol and alternative of the event are taken from rule_index unless it is npos
+    template<class Token>
+    void record_trace(const verify_context<Token>& ctx, trace_event type, const void* pos_token, size_t count, size_t rule_index = npos) const;
+
+    template<class Token>
+    parse_error verify       (const Token*& token, verify_context<Token>& ctx) const;
+    template<class Token>
+    parse_error verify_rules (const Token*& token, verify_context<Token>& ctx) const;
+    template<class Token>
+    parse_error verify_ll1   (const Token*& token, verify_context<Token>& ctx) const;
+    template<class Token>
+    parse_error verify_earley(const Token*& token, verify_context<Token>& ctx) const;
+    template<class Token>
+    void        earley_tree  (size_t root_item, size_t end, size_t first_token, verify_context<Token>& ctx) const;
+
+private:
+    struct rule_data
+    {
+        bool operator<(const rule_data& other) const
+        {
+            return (id != other.id) ? (id < other.id) : (order < other.order);
+        }
+        symbol_id id;
+        unsigned  order;
+        size_t    first_chunk;
+        size_t    last_chunk;
+    };
+    struct symbol_data
+    {
+        bool operator<(const symbol_data& other) const
+        {
+            return (id < other.id);
+        }
+        symbol_id id;
+        size_t    first_rule;
+        size_t    last_rule;
+    };
+    prepared_table<rule_data>   m_rules;
+    prepared_table<symbol_data> m_symbols;
+
+
+    grammar_engine m_engine = grammar_engine::backtracking;
+
+    optimization_report m_optimization_report {};
+
+    prepared_table<size_t> m_loop_ends; // chunk index of a loop -> chunk index of its matching next and vice versa
+
+    // terminal classes - end of tokens, ident, string, number, unknown terminal, then each keyword and punctuation used in rules
+    enum : size_t
+    {
+        Class_End,
+        Class_Ident,
+        Class_String,
+        Class_Number,
+        Class_Other,
+
+        Class_Fixed_Count
+    };
+    static constexpr size_t max_terminal_id = 0x10000;
+
+    size_t                   m_classes_count = 0;
+    size_t                   m_class_words   = 0; // 64 bit words per set of terminal classes
+    prepared_table<unsigned> m_keyword_classes;
+    prepared_table<unsigned> m_punctuation_classes;
+
+    prepared_table<std::uint64_t> m_rule_first;    // rule index * m_class_words -> FIRST set of the rule
+    prepared_table<char>          m_rule_nullable;
+
+    // predictive dispatch - the rules of a symbol that may pass with the current terminal class
+    prepared_table<size_t> m_dispatch;       // symbol index * m_classes_count + class -> first index in m_dispatch_rules
+    prepared_table<size_t> m_dispatch_rules;
+
+    // LL(1) parse table - symbol index * m_classes_count + class -> the only rule that may pass (npos - none)
+    prepared_table<size_t>        m_ll1_table;
+    prepared_table<std::uint64_t> m_ll1_loop_first; // loop index * m_class_words -> FIRST set of the loop body
+
+    // bytecode - the rules lowered by prepare() into 8 byte instructions; check() runs on it instead of the chunks.
+    // The alternatives of every symbol are laid out one after another, each of them ends with op_code::ret.
+    enum class op_code : std::uint8_t
+    {
+        match_type, // token of type 'type'
+        match_id,   // token of type 'type' with id 'arg'
+        match_set,  // token of any terminal class of inlined symbol 'arg' (a symbol with single terminal alternatives)
+        call,       // symbol 'arg'
+        loop,       // loop 'arg' starts
+        next,       // loop 'arg' iteration ends
+        ret,        // the alternative passed
+    };
+    struct instruction
+    {
+        op_code       op;
+        std::uint8_t  type;
+        std::uint16_t reserved;
+        std::uint32_t arg;
+    };
+    static_assert(sizeof(instruction) == 8, "instruction size");
+
+    struct loop_code
+    {
+        size_t min_repeats;
+        size_t max_repeats;
+        size_t body; // first instruction of the loop body
+        size_t exit; // first instruction after the loop
+    };
+
+    prepared_table<instruction>   m_code;
+    prepared_table<size_t>        m_rule_code;    // rule index -> first instruction
+    prepared_table<loop_code>     m_loop_code;
+    prepared_table<std::uint64_t> m_inline_sets;  // symbol index * m_class_words -> classes matched by an inlined symbol
+
+    // Earley productions - the rules lowered for grammar_engine::earley. The nonterminals are the symbols (by symbol
+    // index) and then helpers for the loops; a production is a run of match_type, match_id and call (nonterminal 'arg')
+    // instructions ending with ret (production 'arg'). The productions of the rules come first, by rule index.
+    struct earley_production
+    {
+        size_t nonterminal;
+        size_t code; // first instruction
+    };
+    using earley_rules_t = std::vector<std::vector<instruction>>;
+
+    prepared_table<instruction>       m_earley_code;
+    prepared_table<earley_production> m_earley_productions;
+    prepared_table<size_t>            m_earley_nonterminals; // nonterminal -> first production, one more entry at the end
+    prepared_table<size_t>            m_earley_empty;        // nonterminal -> production it matches no tokens with (npos - none)
+
+    void   prepare_earley();
+    void   prepare_earley_empty();
+    void   lower_earley     (size_t first_chunk, size_t end_chunk, std::vector<instruction>& slots, std::vector<earley_rules_t>& helpers) const;
+    void   lower_earley_loop(const chunk_data& loop, const std::vector<instruction>& body, std::vector<instruction>& slots, std::vector<earley_rules_t>& helpers) const;
+    size_t add_earley_helper(earley_rules_t&& rules, std::vector<earley_rules_t>& helpers) const;
+
+private:
+    // The tables of prepare_engine() built by the same code for prepare() and, at compile time, for static_grammar -
+    // Tables is the grammar or the tables of a static_grammar, which have the members used here under the same names.
+    // The tables are sized and initialized by the caller: the loop ends to npos, the classes of the terminal ids to
+    // Class_Other, the LL(1) table to npos and the other tables to 0.
+
+    // one more than the largest id of the keywords or punctuations in the chunks (0 - none)
+    static constexpr size_t terminal_ids(const chunk_data* chunks, size_t count, chunk_type type)
+    {
+        size_t ids = 0;
+
+        for(size_t index = 0; index < count; ++index)
+        {
+            const chunk_data& chunk = chunks[index];
+
+            if((chunk.type != type) || (int(chunk.id) < 0) || (size_t(chunk.id) >= max_terminal_id)) continue;
+
+            ids = (size_t(chunk.id) >= ids) ? (size_t(chunk.id) + 1) : ids;
+        }
+        return ids;
+    }
+    static constexpr size_t loops_count(const chunk_data* chunks, size_t count)
+    {
+        size_t loops = 0;
+
+        for(size_t index = 0; index < count; ++index) loops += (chunks[index].type == chunk_type::loop) ? 1 : 0;
+
+        return loops;
+    }
+    // an instruction for every chunk of a rule after its start and a ret
+    static constexpr size_t code_size(const rule_data* rules, size_t count)
+    {
+        size_t size = 0;
+
+        for(size_t index = 0; index < count; ++index) size += rules[index].last_chunk + 2 - rules[index].first_chunk;
+
+        return size;
+    }
+
+    template<class Tables>
+    static constexpr size_t find_symbol(const Tables& t, symbol_id id)
+    {
+        size_t first = 0;
+        size_t last  = t.m_symbols.size();
+
+        while(first < last)
+        {
+            const size_t middle = first + (last - first) / 2;
+
+            if(t.m_symbols[middle].id < id) first = middle + 1; else last = middle;
+        }
+        return ((first < t.m_symbols.size()) && (t.m_symbols[first].id == id)) ? first : npos;
+    }
+
+    // the open loops are chained through their entries until their next is found
+    template<class Tables>
+    static constexpr bool build_loops(Tables& t)
+    {
+        size_t open_loop = npos;
+
+        for(size_t index = 0; index < t.m_chunks.size(); ++index)
+        {
+            switch(t.m_chunks[index].type)
+            {
+                case chunk_type::start:
+                    if(open_loop != npos) return false;
+                    break;
+
+                case chunk_type::loop:
+                    t.m_loop_ends[index] = open_loop;
+                    open_loop = index;
+                    break;
+
+                case chunk_type::next:
+                    if(open_loop == npos) return false;
+                    {
+                        const size_t outer_loop = t.m_loop_ends[open_loop];
+
+                        t.m_loop_ends[open_loop] = index;
+                        t.m_loop_ends[index] = open_loop;
+                        open_loop = outer_loop;
+                    }
+                    break;
+
+                default: break;
+            }
+        }
+        return (open_loop == npos);
+    }
+
+    template<class Tables>
+    static constexpr void build_terminal_classes(Tables& t)
+    {
+        t.m_classes_count = Class_Fixed_Count;
+
+        for(size_t index = 0; index < t.m_chunks.size(); ++index)
+        {
+            const chunk_data chunk = t.m_chunks[index];
+
+            if((int(chunk.id) < 0) || (size_t(chunk.id) >= max_terminal_id)) continue;
+
+            const size_t id = size_t(chunk.id);
+
+            switch(chunk.type)
+            {
+                case chunk_type::keyword:
+                    if(t.m_keyword_classes[id] == Class_Other) t.m_keyword_classes[id] = unsigned(t.m_classes_count++);
+                    break;
+
+                case chunk_type::punctuation:
+                    if(t.m_punctuation_classes[id] == Class_Other) t.m_punctuation_classes[id] = unsigned(t.m_classes_count++);
+                    break;
+
+                default: break;
+            }
+        }
+        t.m_class_words = (t.m_classes_count + 63) / 64;
+    }
+
+    template<class Tables>
+    static constexpr size_t chunk_class(const Tables& t, const chunk_data& chunk)
+    {
+        const size_t id = size_t(unsigned(chunk.id));
+
+        switch(chunk.type)
+        {
+            case chunk_type::ident : return Class_Ident;
+            case chunk_type::string: return Class_String;
+            case chunk_type::number: return Class_Number;
+
+            case chunk_type::keyword    : return (id < t.m_keyword_classes    .size()) ? size_t(t.m_keyword_classes    [id]) : size_t(Class_Other);
+            case chunk_type::punctuation: return (id < t.m_punctuation_classes.size()) ? size_t(t.m_punctuation_classes[id]) : size_t(Class_Other);
+
+            default: return Class_Other;
+        }
+    }
+
+    // accumulates the FIRST set of chunks [first_chunk, last_chunk] and returns whether they may pass without consuming tokens
+    template<class Tables>
+    static constexpr bool sequence_first(const Tables& t, size_t first_chunk, size_t last_chunk, std::uint64_t* first)
+    {
+        for(size_t index = first_chunk; index <= last_chunk; ++index)
+        {
+            const chunk_data& chunk = t.m_chunks[index];
+
+            switch(chunk.type)
+            {
+                case chunk_type::rule:
+                    {
+                        const symbol_data& symbol = t.m_symbols[chunk.arg1];
+
+                        bool nullable = false;
+
+                        for(size_t rule_index = symbol.first_rule; rule_index <= symbol.last_rule; ++rule_index)
+                        {
+                            const std::uint64_t* rule_first = &t.m_rule_first[rule_index * t.m_class_words];
+
+                            for(size_t word = 0; word < t.m_class_words; ++word) first[word] |= rule_first[word];
+
+                            nullable = nullable || (t.m_rule_nullable[rule_index] != 0);
+                        }
+                        if(!nullable) return false;
+                    }
+                    continue;
+
+                case chunk_type::loop:
+                    {
+                        const size_t next_index = t.m_loop_ends[index];
+
+                        const bool nullable = sequence_first(t, index + 1, next_index - 1, first);
+
+                        if(!nullable && (chunk.arg1 != 0)) return false;
+
+                        index = next_index;
+                    }
+                    continue;
+
+                case chunk_type::next: continue;
+
+                default:
+                    {
+                        const size_t cls = chunk_class(t, chunk);
+
+                        first[cls / 64] |= (std::uint64_t(1) << (cls % 64));
+                    }
+                    return false;
+            }
+        }
+        return true;
+    }
+
+    // like sequence_first but [first_chunk, last_chunk] may start inside loops - at their next the loop may repeat or be left
+    template<class Tables>
+    static constexpr bool tail_first(const Tables& t, size_t first_chunk, size_t last_chunk, std::uint64_t* first)
+    {
+        size_t depth = 0;
+
+        for(size_t index = first_chunk; index <= last_chunk; ++index)
+        {
+            switch(t.m_chunks[index].type)
+            {
+                case chunk_type::loop: ++depth; continue;
+
+                case chunk_type::next:
+                    if(depth > 0)
+                    {
+                        --depth;
+                        continue;
+                    }
+                    break;
+
+                default: continue;
+            }
+            if(!sequence_first(t, first_chunk, index - 1, first)) return false;
+
+            sequence_first(t, t.m_loop_ends[index] + 1, index - 1, first);
+
+            first_chunk = index + 1;
+        }
+        return sequence_first(t, first_chunk, last_chunk, first);
+    }
+
+    // first - m_class_words words
+    template<class Tables>
+    static constexpr void build_first_sets(Tables& t, std::uint64_t* first)
+    {
+        const size_t words = t.m_class_words;
+
+        for(bool changed = true; changed; )
+        {
+            changed = false;
+
+            for(size_t rule_index = 0; rule_index < t.m_rules.size(); ++rule_index)
+            {
+                const rule_data rule = t.m_rules[rule_index];
+
+                std::uint64_t* rule_first = &t.m_rule_first[rule_index * words];
+
+                for(size_t word = 0; word < words; ++word) first[word] = rule_first[word];
+
+                const bool nullable = sequence_first(t, rule.first_chunk, rule.last_chunk, first);
+
+                bool same = (nullable == (t.m_rule_nullable[rule_index] != 0));
+
+                for(size_t word = 0; word < words; ++word) same = same && (first[word] == rule_first[word]);
+
+                if(!same)
+                {
+                    for(size_t word = 0; word < words; ++word) rule_first[word] = first[word];
+
+                    t.m_rule_nullable[rule_index] = char(nullable || (t.m_rule_nullable[rule_index] != 0));
+
+                    changed = true;
+                }
+            }
+        }
+    }
+
+    // fills the dispatch lists as far as m_dispatch_rules holds them and returns how many entries they take
+    template<class Tables>
+    static constexpr size_t build_dispatch(Tables& t)
+    {
+        size_t count = 0;
+
+        for(size_t symbol_index = 0; symbol_index < t.m_symbols.size(); ++symbol_index)
+        {
+            const symbol_data symbol = t.m_symbols[symbol_index];
+
+            for(size_t cls = 0; cls < t.m_classes_count; ++cls)
+            {
+                t.m_dispatch[symbol_index * t.m_classes_count + cls] = count;
+
+                for(size_t rule_index = symbol.first_rule; rule_index <= symbol.last_rule; ++rule_index)
+                {
+                    const bool viable = (t.m_rule_nullable[rule_index] != 0) || has_class(&t.m_rule_first[rule_index * t.m_class_words], cls);
+
+                    if(!viable) continue;
+
+                    if(count < t.m_dispatch_rules.size()) t.m_dispatch_rules[count] = rule_index;
+                    ++count;
+                }
+            }
+        }
+        t.m_dispatch[t.m_symbols.size() * t.m_classes_count] = count;
+
+        return count;
+    }
+
+    // follow - m_symbols.size() * m_class_words words, first - m_class_words words
+    template<class Tables>
+    static constexpr bool build_ll1(Tables& t, std::uint64_t* follow, std::uint64_t* first)
+    {
+        const size_t words = t.m_class_words;
+
+        for(size_t word = 0; word < t.m_symbols.size() * words; ++word) follow[word] = 0;
+        for(size_t word = 0; word < words; ++word) follow[t.m_start_index * words + word] = ~std::uint64_t(0);
+
+        for(bool changed = true; changed; )
+        {
+            changed = false;
+
+            for(size_t rule_index = 0; rule_index < t.m_rules.size(); ++rule_index)
+            {
+                const rule_data rule = t.m_rules[rule_index];
+
+                const std::uint64_t* rule_follow = &follow[find_symbol(t, rule.id) * words];
+
+                for(size_t index = rule.first_chunk; index <= rule.last_chunk; ++index)
+                {
+                    const chunk_data chunk = t.m_chunks[index];
+
+                    if(chunk.type != chunk_type::rule) continue;
+
+                    for(size_t word = 0; word < words; ++word) first[word] = 0;
+
+                    if(tail_first(t, index + 1, rule.last_chunk, first))
+                    {
+                        for(size_t word = 0; word < words; ++word) first[word] |= rule_follow[word];
+                    }
+
+                    std::uint64_t* symbol_follow = &follow[chunk.arg1 * words];
+
+                    for(size_t word = 0; word < words; ++word)
+                    {
+                        if((symbol_follow[word] | first[word]) == symbol_follow[word]) continue;
+
+                        symbol_follow[word] |= first[word];
+                        changed = true;
+                    }
+                }
+            }
+        }
+
+        auto intersects = [words] (const std::uint64_t* set1, const std::uint64_t* set2)
+        {
+            for(size_t word = 0; word < words; ++word)
+            {
+                if((set1[word] & set2[word]) != 0) return true;
+            }
+            return false;
+        };
+
+        for(size_t symbol_index = 0; symbol_index < t.m_symbols.size(); ++symbol_index)
+        {
+            const symbol_data symbol = t.m_symbols[symbol_index];
+
+            const std::uint64_t* symbol_follow = &follow[symbol_index * words];
+
+            const bool nullable_last = (t.m_rule_nullable[symbol.last_rule] != 0);
+
+            for(size_t rule_index = symbol.first_rule; rule_index <= symbol.last_rule; ++rule_index)
+            {
+                const std::uint64_t* rule_first = &t.m_rule_first[rule_index * words];
+
+                if((rule_index != symbol.last_rule) && (t.m_rule_nullable[rule_index] != 0)) return false;
+
+                if((rule_index != symbol.last_rule) && nullable_last && intersects(rule_first, symbol_follow)) return false;
+
+                for(size_t other_index = rule_index + 1; other_index <= symbol.last_rule; ++other_index)
+                {
+                    if(intersects(rule_first, &t.m_rule_first[other_index * words])) return false;
+                }
+            }
+        }
+
+        // the loops are numbered in the order build_code() lays them out
+        size_t loop_index = 0;
+
+        for(size_t rule_index = 0; rule_index < t.m_rules.size(); ++rule_index)
+        {
+            const rule_data rule = t.m_rules[rule_index];
+
+            const std::uint64_t* rule_follow = &follow[find_symbol(t, rule.id) * words];
+
+            for(size_t index = rule.first_chunk; index <= rule.last_chunk; ++index)
+            {
+                const chunk_data chunk = t.m_chunks[index];
+
+                if(chunk.type != chunk_type::loop) continue;
+
+                const size_t next_index = t.m_loop_ends[index];
+
+                std::uint64_t* body_first = &t.m_ll1_loop_first[(loop_index++) * words];
+
+                if(sequence_first(t, index + 1, next_index - 1, body_first)) return false;
+
+                if(chunk.arg1 == chunk.arg2) continue;
+
+                for(size_t word = 0; word < words; ++word) first[word] = 0;
+
+                if(tail_first(t, next_index + 1, rule.last_chunk, first))
+                {
+                    for(size_t word = 0; word < words; ++word) first[word] |= rule_follow[word];
+                }
+                if(intersects(body_first, first)) return false;
+            }
+        }
+
+        for(size_t symbol_index = 0; symbol_index < t.m_symbols.size(); ++symbol_index)
+        {
+            const symbol_data symbol = t.m_symbols[symbol_index];
+
+            for(size_t cls = 0; cls < t.m_classes_count; ++cls)
+            {
+                for(size_t rule_index = symbol.first_rule; rule_index <= symbol.last_rule; ++rule_index)
+                {
+                    if(has_class(&t.m_rule_first[rule_index * words], cls) || (t.m_rule_nullable[rule_index] != 0))
+                    {
+                        t.m_ll1_table[symbol_index * t.m_classes_count + cls] = rule_index;
+                        break;
+                    }
+                }
+            }
+        }
+        return true;
+    }
+
+    // symbols with single terminal alternatives are matched in place by a single match_set instruction. Single chunk
+    // rules that call a symbol keep their call - the symbol still needs its frame for its parse node and the ordered
+    // choice of its alternatives, so unit rules are inlined only by the optimizer (Optimize_Unit_Rules), which changes
+    // the parse trees on request
+    template<class Tables>
+    static constexpr void build_code(Tables& t)
+    {
+        const size_t words = t.m_class_words;
+
+        for(size_t symbol_index = 0; symbol_index < t.m_symbols.size(); ++symbol_index)
+        {
+            const symbol_data symbol = t.m_symbols[symbol_index];
+
+            bool terminals_only = true;
+
+            for(size_t rule_index = symbol.first_rule; terminals_only && (rule_index <= symbol.last_rule); ++rule_index)
+            {
+                const rule_data rule = t.m_rules[rule_index];
+
+                if(rule.first_chunk != rule.last_chunk)
+                {
+                    terminals_only = false;
+                    break;
+                }
+                switch(t.m_chunks[rule.first_chunk].type)
+                {
+                    case chunk_type::ident      :
+                    case chunk_type::string     :
+                    case chunk_type::number     :
+                    case chunk_type::keyword    :
+                    case chunk_type::punctuation: terminals_only = (chunk_class(t, t.m_chunks[rule.first_chunk]) != Class_Other); break;
+
+                    default: terminals_only = false; break;
+                }
+            }
+            if(!terminals_only) continue;
+
+            for(size_t rule_index = symbol.first_rule; rule_index <= symbol.last_rule; ++rule_index)
+            {
+                const size_t cls = chunk_class(t, t.m_chunks[t.m_rules[rule_index].first_chunk]);
+
+                t.m_inline_sets[symbol_index * words + cls / 64] |= (std::uint64_t(1) << (cls % 64));
+            }
+        }
+
+        // a symbol is inlined when its set has classes
+        auto inlined = [&t, words] (size_t symbol_index)
+        {
+            for(size_t word = 0; word < words; ++word)
+            {
+                if(t.m_inline_sets[symbol_index * words + word] != 0) return true;
+            }
+            return false;
+        };
+
+        size_t code  = 0;
+        size_t loops = 0;
+
+        for(size_t rule_index = 0; rule_index < t.m_rules.size(); ++rule_index)
+        {
+            const rule_data rule = t.m_rules[rule_index];
+
+            t.m_rule_code[rule_index] = code;
+
+            for(size_t index = rule.first_chunk; index <= rule.last_chunk; ++index)
+            {
+                const chunk_data chunk = t.m_chunks[index];
+
+                switch(chunk.type)
+                {
+                    case chunk_type::ident      :
+                    case chunk_type::string     :
+                    case chunk_type::number     : t.m_code[code++] = {op_code::match_type, std::uint8_t(chunk.type), 0, 0}; break;
+
+                    case chunk_type::keyword    :
+                    case chunk_type::punctuation: t.m_code[code++] = {op_code::match_id, std::uint8_t(chunk.type), 0, std::uint32_t(chunk.id)}; break;
+
+                    case chunk_type::rule:
+                        t.m_code[code++] = {inlined(chunk.arg1) ? op_code::match_set : op_code::call, 0, 0, std::uint32_t(chunk.arg1)};
+                        break;
+
+                    case chunk_type::loop:
+                        t.m_code[code++] = {op_code::loop, 0, 0, std::uint32_t(loops)};
+                        t.m_loop_code[loops++] = {chunk.arg1, chunk.arg2, code, npos};
+                        break;
+
+                    // every chunk of the rule is one instruction, the one of the loop is as far from the start
+                    case chunk_type::next:
+                        {
+                            const size_t loop_index = t.m_code[t.m_rule_code[rule_index] + t.m_loop_ends[index] - rule.first_chunk].arg;
+
+                            t.m_code[code++] = {op_code::next, 0, 0, std::uint32_t(loop_index)};
+                            t.m_loop_code[loop_index].exit = code;
+                        }
+                        break;
+
+                    default: Assert_Fail(); break;
+                }
+            }
+            t.m_code[code++] = {op_code::ret, 0, 0, 0};
+        }
+    }
+
+    // reads the tables a static_grammar built at compile time in place
+    template<class Tables>
+    void prepare_static(const Tables& t)
+    {
+        m_chunks .bind(t.m_chunks .data(), t.m_chunks .size());
+        m_rules  .bind(t.m_rules  .data(), t.m_rules  .size());
+        m_symbols.bind(t.m_symbols.data(), t.m_symbols.size());
+
+        m_loop_ends          .bind(t.m_loop_ends          .data(), t.m_loop_ends          .size());
+        m_keyword_classes    .bind(t.m_keyword_classes    .data(), t.m_keyword_classes    .size());
+        m_punctuation_classes.bind(t.m_punctuation_classes.data(), t.m_punctuation_classes.size());
+        m_rule_first         .bind(t.m_rule_first         .data(), t.m_rule_first         .size());
+        m_rule_nullable      .bind(t.m_rule_nullable      .data(), t.m_rule_nullable      .size());
+        m_dispatch           .bind(t.m_dispatch           .data(), t.m_dispatch           .size());
+        m_dispatch_rules     .bind(t.m_dispatch_rules     .data(), t.m_dispatch_rules     .size());
+        m_ll1_table          .bind(t.m_ll1_table          .data(), t.m_ll1_table          .size());
+        m_ll1_loop_first     .bind(t.m_ll1_loop_first     .data(), t.m_ll1_loop_first     .size());
+        m_code               .bind(t.m_code               .data(), t.m_code               .size());
+        m_rule_code          .bind(t.m_rule_code          .data(), t.m_rule_code          .size());
+        m_loop_code          .bind(t.m_loop_code          .data(), t.m_loop_code          .size());
+        m_inline_sets        .bind(t.m_inline_sets        .data(), t.m_inline_sets        .size());
+
+        m_start_index   = t.m_start_index;
+        m_engine        = t.m_engine;
+        m_classes_count = t.m_classes_count;
+        m_class_words   = t.m_class_words;
+
+        m_optimization_report = {m_chunks.size(), m_chunks.size(), m_rules.size(), m_rules.size(), 0, 0, 0};
+    }
+};
+
+// Tables of a grammar with static traits, built at compile time from T::add_rules and T::start_symbol - the chunks
+// with their symbols resolved, the rules sorted by symbol and the symbols sorted by id, the same as prepare() makes
+// them. data.err holds the first grammar error; grammar(T&&) turns it into a compile error.
+template<class T>
+class static_grammar
+{
+    using chunk_type  = rules::chunk_type;
+    using chunk_data  = rules::chunk_data;
+    using rule_data   = grammar::rule_data;
+    using symbol_data = grammar::symbol_data;
+
+    static constexpr size_t npos = size_t(-1);
+
+    static constexpr size_t chunks_count = []
+    {
+        static_rules<0> rules;
+        T::add_rules(rules);
+        return rules.m_count;
+    }();
+
+    struct tables
+    {
+        std::array<chunk_data , chunks_count> chunks {};
+        std::array<rule_data  , chunks_count> rules {};
+        std::array<symbol_data, chunks_count> symbols {};
+
+        size_t      rules_count   = 0;
+        size_t      symbols_count = 0;
+        size_t      start_index   = npos;
+        parse_error err           = parse_error::None;
+        symbol_id   err_id        = symbol_id(0);
+    };
+
+    static constexpr size_t find_symbol(const tables& t, symbol_id id)
+    {
+        for(size_t index = 0; index < t.symbols_count; ++index)
+        {
+            if(t.symbols[index].id == id) return index;
+        }
+        return npos;
+    }
+
+    static constexpr tables build()
+    {
+        tables t {};
+
+        static_rules<chunks_count> rules;
+        T::add_rules(rules);
+
+        auto fail = [&t] (parse_error err, symbol_id id) -> tables&
+        {
+            t.err    = err;
+            t.err_id = id;
+            return t;
+        };
+
+        size_t prev_rule_index = npos;
+        size_t loops_count     = 0;
+
+        for(size_t index = 0; index < chunks_count; ++index)
+        {
+            const chunk_data& chunk = t.chunks[index] = rules.m_chunks[index];
+
+            switch(chunk.type)
+            {
+                default: continue;
+
+                case chunk_type::start: break;
+
+                case chunk_type::loop:
+                    if((chunk.arg2 == 0) || (chunk.arg2 < chunk.arg1)) return fail(parse_error::InvalidLoopArguments, chunk.id);
+                    ++loops_count;
+                    continue;
+
+                case chunk_type::next:
+                    if(loops_count == 0) return fail(parse_error::NextWithoutLoop, chunk.id);
+                    --loops_count;
+                    continue;
+            }
+            if(prev_rule_index != npos)
+            {
+                t.rules[prev_rule_index].last_chunk = (index - 1);
+            }
+            if(loops_count != 0) return fail(parse_error::MismatchLoopNextPairs, chunk.id);
+
+            size_t symbol_index = find_symbol(t, chunk.id);
+
+            if(symbol_index == npos)
+            {
+                symbol_index = t.symbols_count++;
+                t.symbols[symbol_index] = {chunk.id, 0, 0};
+            }
+            prev_rule_index = t.rules_count;
+
+            t.rules[t.rules_count++] = {chunk.id, unsigned(t.symbols[symbol_index].first_rule++), index + 1, npos};
+        }
+        if(loops_count != 0) return fail(parse_error::MismatchLoopNextPairs, symbol_id(0));
+
+        if(prev_rule_index != npos)
+        {
+            t.rules[prev_rule_index].last_chunk = (chunks_count - 1);
+        }
+
+        // insertion sorts - std::sort is not constexpr before C++20
+        for(size_t index = 1; index < t.symbols_count; ++index)
+        {
+            const symbol_data symbol = t.symbols[index];
+
+            size_t pos = index;
+            for(; (pos > 0) && (symbol.id < t.symbols[pos - 1].id); --pos) t.symbols[pos] = t.symbols[pos - 1];
+
+            t.symbols[pos] = symbol;
+        }
+        for(size_t index = 0; index < t.symbols_count; ++index)
+        {
+            t.symbols[index].first_rule = npos;
+        }
+
+        for(size_t index = 1; index < t.rules_count; ++index)
+        {
+            const rule_data rule = t.rules[index];
+
+            size_t pos = index;
+            for(; (pos > 0) && ((rule.id != t.rules[pos - 1].id) ? (rule.id < t.rules[pos - 1].id) : (rule.order < t.rules[pos - 1].order)); --pos)
+            {
+                t.rules[pos] = t.rules[pos - 1];
+            }
+            t.rules[pos] = rule;
+        }
+
+        for(size_t index = 0; index < t.rules_count; ++index)
+        {
+            symbol_data& symbol = t.symbols[find_symbol(t, t.rules[index].id)];
+
+            if(symbol.first_rule == npos)
+            {
+                symbol.first_rule = index;
+            }
+            symbol.last_rule = index;
+        }
+
+        for(size_t index = 0; index < chunks_count; ++index)
+        {
+            chunk_data& chunk = t.chunks[index];
+
+            if(chunk.type != chunk_type::symbol) continue;
+
+            const size_t symbol_index = find_symbol(t, chunk.id);
+
+            if(symbol_index == npos) return fail(parse_error::SymbolWithoutRule, chunk.id);
+
+            chunk.type = chunk_type::rule;
+            chunk.arg1 = symbol_index;
+        }
+
+        t.start_index = find_symbol(t, T::start_symbol);
+
+        if(t.start_index == npos) return fail(parse_error::SymbolWithoutRule, T::start_symbol);
+
+        return t;
+    }
+
+public:
+    static const tables data;
+
+private:
+    using instruction = grammar::instruction;
+    using loop_code   = grammar::loop_code;
+
+    // the tables of data prepared by the code of prepare_engine() (see grammar::build_loops and the functions after it),
+    // under the names of the grammar members that read them in place
+    template<size_t KeywordIds, size_t PunctuationIds, size_t Classes, size_t DispatchRules>
+    struct prepared_tables
+    {
+        static constexpr size_t rules_count   = data.rules_count;
+        static constexpr size_t symbols_count = data.symbols_count;
+        static constexpr size_t loops_count   = grammar::loops_count(data.chunks.data(), chunks_count);
+        static constexpr size_t code_size     = grammar::code_size(data.rules.data(), rules_count);
+        static constexpr size_t words         = (Classes + 63) / 64;
+
+        std::array<chunk_data   , chunks_count>              m_chunks {};
+        std::array<rule_data    , rules_count>               m_rules {};
+        std::array<symbol_data  , symbols_count>             m_symbols {};
+        size_t                                               m_start_index = npos;
+        grammar_engine                                       m_engine      = grammar_engine::backtracking;
+        std::array<size_t       , chunks_count>              m_loop_ends {};
+        size_t                                               m_classes_count = 0;
+        size_t                                               m_class_words   = 0;
+        std::array<unsigned     , KeywordIds>                m_keyword_classes {};
+        std::array<unsigned     , PunctuationIds>            m_punctuation_classes {};
+        std::array<std::uint64_t, rules_count * words>       m_rule_first {};
+        std::array<char         , rules_count>               m_rule_nullable {};
+        std::array<size_t       , symbols_count * Classes + 1> m_dispatch {};
+        std::array<size_t       , DispatchRules>             m_dispatch_rules {};
+        std::array<size_t       , symbols_count * Classes>   m_ll1_table {};
+        std::array<std::uint64_t, loops_count * words>       m_ll1_loop_first {};
+        std::array<instruction  , code_size>                 m_code {};
+        std::array<size_t       , rules_count>               m_rule_code {};
+        std::array<loop_code    , loops_count>               m_loop_code {};
+        std::array<std::uint64_t, symbols_count * words>     m_inline_sets {};
+    };
+
+    // copies data and sets the initial values of the tables prepare_engine() assigns
+    template<class Tables>
+    static constexpr void load(Tables& t)
+    {
+        for(size_t index = 0; index < chunks_count; ++index)
+        {
+            t.m_chunks   [index] = data.chunks[index];
+            t.m_loop_ends[index] = npos;
+        }
+        for(size_t index = 0; index < data.rules_count  ; ++index) t.m_rules  [index] = data.rules  [index];
+        for(size_t index = 0; index < data.symbols_count; ++index) t.m_symbols[index] = data.symbols[index];
+
+        for(unsigned& cls : t.m_keyword_classes    ) cls = unsigned(grammar::Class_Other);
+        for(unsigned& cls : t.m_punctuation_classes) cls = unsigned(grammar::Class_Other);
+        for(size_t& entry : t.m_ll1_table          ) entry = npos;
+        for(loop_code& loop : t.m_loop_code        ) loop.exit = npos;
+
+        t.m_start_index = data.start_index;
+    }
+
+    // the sizes of the tables that depend on the preparation - the terminal classes and the dispatch lists
+    struct layout
+    {
+        size_t keyword_ids;
+        size_t punctuation_ids;
+        size_t classes;
+        size_t dispatch_rules;
+    };
+    static constexpr layout measure()
+    {
+        if(data.err != parse_error::None) return {0, 0, grammar::Class_Fixed_Count, 0};
+
+        constexpr size_t keyword_ids     = grammar::terminal_ids(data.chunks.data(), chunks_count, chunk_type::keyword);
+        constexpr size_t punctuation_ids = grammar::terminal_ids(data.chunks.data(), chunks_count, chunk_type::punctuation);
+
+        constexpr size_t classes = []
+        {
+            prepared_tables<keyword_ids, punctuation_ids, 0, 0> t {};
+
+            load(t);
+            grammar::build_terminal_classes(t);
+
+            return t.m_classes_count;
+        }();
+
+        constexpr size_t dispatch_rules = []
+        {
+            prepared_tables<keyword_ids, punctuation_ids, classes, 0> t {};
+            std::array<std::uint64_t, (classes + 63) / 64> first {};
+
+            load(t);
+            grammar::build_loops(t);
+            grammar::build_terminal_classes(t);
+            grammar::build_first_sets(t, first.data());
+
+            return grammar::build_dispatch(t);
+        }();
+
+        return {keyword_ids, punctuation_ids, classes, dispatch_rules};
+    }
+
+    static const layout sizes;
+
+    struct prepared_t : prepared_tables<sizes.keyword_ids, sizes.punctuation_ids, sizes.classes, sizes.dispatch_rules> {};
+
+    // prepare_engine() with grammar_engine::automatic
+    static constexpr prepared_t prepare()
+    {
+        prepared_t t {};
+
+        if(data.err != parse_error::None) return t;
+
+        std::array<std::uint64_t, prepared_t::words> first {};
+        std::array<std::uint64_t, prepared_t::symbols_count * prepared_t::words> follow {};
+
+        load(t);
+        grammar::build_loops(t);
+        grammar::build_terminal_classes(t);
+        grammar::build_first_sets(t, first.data());
+        grammar::build_dispatch(t);
+
+        t.m_engine = grammar::build_ll1(t, follow.data(), first.data()) ? grammar_engine::ll1 : grammar_engine::backtracking;
+
+        grammar::build_code(t);
+
+        return t;
+    }
+
+public:
+    static const prepared_t prepared;
+};
+
+template<class T>
+constexpr typename static_grammar<T>::tables static_grammar<T>::data = static_grammar<T>::build();
+
+template<class T>
+constexpr typename static_grammar<T>::layout static_grammar<T>::sizes = static_grammar<T>::measure();
+
+template<class T>
+constexpr typename static_grammar<T>::prepared_t static_grammar<T>::prepared = static_grammar<T>::prepare();
+
+// Binary image of a prepared tokenizer + grammar pair, for loading them without add_rules and prepare(). The image
+// holds indices only, so it may be mapped at any address; its header carries a format version, the size_t width,
+// the byte order and a checksum, and the loads reject images that do not match the build with InvalidImage.
+// Nothing is sorted or prepared again. load() copies the tables and the keyword and punctuation strings into the
+// tokenizer and the grammar, so the image may be released or unmapped once it returns. load_mapped() is zero-copy:
+// the tables and the strings are read in place in the image (e.g. an mmapped file), so the mapping must outlive the
+// tokenizer and the grammar - only the token descs and the symbols, which are stored field by field, are copied,
+// and so is a table at an address not aligned for its elements (an image at an 8 byte aligned address has none).
+class grammar_image
+{
+public:
+    static constexpr std::uint32_t version = 3;
+
+    static result_t save(const tokenizer& tk, const grammar& g, std::vector<char>& out);
+
+    static result_t load       (tokenizer& tk, grammar& g, const void* data, size_t size);
+    static result_t load_mapped(tokenizer& tk, grammar& g, const void* data, size_t size);
+
+private:
+    class writer;
+    class reader;
+
+    static void save_tokenizer(writer& out, const tokenizer& tk);
+    static void save_grammar  (writer& out, const grammar& g);
+
+    static result_t load_image(tokenizer& tk, grammar& g, const void* data, size_t size, bool mapped);
+
+    static bool load_tokenizer(reader& in, tokenizer& tk);
+    static bool load_grammar  (reader& in, grammar& g);
+};
+
+struct sentence_options
+{
+    size_t        min_depth   = 0;    // nesting of symbols above which the shortest alternatives are avoided
+    size_t        max_depth   = 16;   // nesting of symbols (depth)
+    size_t        max_repeats = 4;    // loop repeats over the loop minimum (breadth)
+    size_t        max_tokens  = 1024; // tokens before the sentence is closed (length)
+    bool          verify      = true; // keep only sentences the grammar accepts (near misses - rejects)
+    std::uint64_t seed        = 1;
+};
+
+// Random sentences of a prepared grammar for load and scaling tests. The rules are walked from the start symbol with
+// random alternatives and loop repeats between the loop minimum and maximum; keywords and punctuations are printed
+// with the strings of the tokenizer, identifiers, strings and numbers are made up, and tokens are separated by single
+// spaces. Up to min_depth, symbols take alternatives other than the one with the shortest way to terminals where
+// they have them; past max_depth or max_tokens, every symbol takes that one and every loop its minimum, so the
+// sentences stay bounded. The checks take ordered choice and greedy loops, which
+// reject some sentences the rules derive; with verify set such sentences are made again (up to max_attempts times).
+// A near miss is a valid sentence with one token dropped, duplicated, swapped with the next one, replaced, inserted
+// or with the sentence cut short there. The same seed gives the same sentences. The tokenizer and the grammar must
+// outlive the generator.
+class sentence_generator
+{
+    sentence_generator           (const sentence_generator&) noexcept = delete;
+    sentence_generator& operator=(const sentence_generator&) noexcept = delete;
+
+public:
+    sentence_generator           (sentence_generator&&) noexcept = default;
+    sentence_generator& operator=(sentence_generator&&) noexcept = default;
+
+    sentence_generator(const tokenizer& t, const grammar& g, const sentence_options& options = sentence_options());
+   ~sentence_generator() = default;
+
+public:
+    static constexpr size_t max_attempts = 16;
+
+    // UnpreparedGramar, InvalidKeyword / InvalidPunctuation with the id of a terminal the tokenizer does not have,
+    // or UnproductiveSymbol when the start symbol has no finite sentence
+    result_t get_result() const { return m_result; }
+
+    // append a sentence to out; GrammarCheckFailed when no sentence passed the verification in max_attempts
+    result_t generate          (std::string& out);
+    result_t generate_near_miss(std::string& out);
+
+private:
+    using chunk_data = grammar::chunk_data;
+
+    static constexpr size_t npos = size_t(-1);
+
+    struct frame
+    {
+        size_t first;   // first chunk of the rule or loop body
+        size_t chunk;   // next chunk
+        size_t end;     // end of the rule or loop body
+        size_t depth;   // nesting of symbols
+        size_t repeats; // runs of the loop body left after the current one
+    };
+    struct span
+    {
+        size_t begin;
+        size_t end;
+    };
+
+    result_t prepare();
+
+    size_t sequence_height(size_t first_chunk, size_t end_chunk) const;
+
+    void walk();
+    void push_symbol(size_t symbol_index, size_t depth);
+    void mutate();
+
+    bool closing(size_t depth) const
+    {
+        return (depth >= m_options.max_depth) || (m_spans.size() >= m_options.max_tokens);
+    }
+    void append_terminal(std::string& out, size_t chunk_index);
+    bool is_valid(const std::string& sentence);
+
+    std::uint64_t random();
+    size_t        random(size_t count) { return size_t(random() % count); }
+
+private:
+    const tokenizer* m_tokenizer;
+    const grammar*   m_grammar;
+    sentence_options m_options;
+    std::uint64_t    m_state;
+
+    result_t m_result {parse_error::None, symbol_id(0), 0};
+
+    std::vector<size_t>      m_heights;      // symbol index -> nesting of its shortest way to terminals (npos - none)
+    std::vector<size_t>      m_rule_heights; // rule index -> the same for the rule
+    std::vector<size_t>      m_loop_heights; // chunk index of a loop -> the same for the loop body
+    std::vector<const char*> m_strings;      // chunk index -> keyword or punctuation string of the chunk
+    std::vector<size_t>      m_terminals;    // chunk indices of the terminals, for replacing and inserting tokens
+
+    std::vector<frame> m_frames;
+    std::string        m_text;    // the sentence
+    std::vector<span>  m_spans;   // the tokens of the sentence
+    std::string        m_mutated; // the near miss
+
+    tokens_t    m_tokens;
+    check_stack m_stack;
+};
+
+// Thread pool for validating many independent inputs (tokenize + check) with one tokenizer and grammar, which are
+// only read. The inputs are split evenly among the threads, a thread that runs out of work steals half of what
+// another one has left. Every thread keeps its check_context across batches. validate_many is not reentrant - one
+// pool validates one batch at a time, so it must not be called on the same pool from several threads at once.
+class validation_pool
+{
+    validation_pool           (const validation_pool&) noexcept = delete;
+    validation_pool& operator=(const validation_pool&) noexcept = delete;
+
+public:
+    // threads_count includes the thread that calls validate_many (0 - one per hardware thread)
+    explicit validation_pool(size_t threads_count = 0);
+   ~validation_pool();
+
+public:
+    size_t get_threads_count() const;
+
+    // the check_stats of all the threads added up - between the calls of validate_many only
+    check_stats get_stats() const;
+    void      reset_stats();
+
+    // results[i] is the tokenizer error of inputs[i] or, when it tokenizes, the result of the check
+    void validate_many(
+        const tokenizer& t,
+        const grammar& g,
+        const std::string_view* inputs,
+        result_t* results,
+        size_t count
+        );
+
+private:
+    struct state; // the workers, the threads and the current batch - kept out of the header with <thread> and <mutex>
+
+    state* m_state;
+};
+
+// Validation of a text that is edited in small steps, e.g. in an editor. reset() tokenizes and parses the whole text;
+// edit() changes the text, tokenizes it again only around the edit (see tokenizer::retokenize) and parses again only
+// the deepest node of the parse tree that covers the replaced tokens and that the check entered having examined only
+// tokens before them - the check runs as before up to that node and, when the node parses to the same end again, after
+// it as well. A node that parses to another end is parsed again by its parent and so on, up to the start symbol (a
+// whole check). The tree, the tokens and the results are the ones of tokenize() and parse() on the whole text.
+// Tokenizing and parsing take time by the size of the edit and of the node parsed again and finding the node by the
+// depth of the tree. The positions of the tokens behind an edit are moved by get_tokens(), an edit moves only the
+// tokens between it and the last edit (see token_shift); an edit that changes the number of tokens or of nodes still
+// moves the nodes behind it in the tree (one pass) and the tokens and nodes in memory as the text is. After a tokenizer
+// error the next edit tokenizes the whole text and after a failed check it parses all the tokens; the earley engine
+// always parses all of them. The tokenizer and the grammar must outlive the object.
+class incremental_check
+{
+    incremental_check           (const incremental_check&) noexcept = delete;
+    incremental_check& operator=(const incremental_check&) noexcept = delete;
+
+public:
+    incremental_check           (incremental_check&&) noexcept = default;
+    incremental_check& operator=(incremental_check&&) noexcept = default;
+
+    incremental_check(const tokenizer& t, const grammar& g) : m_tokenizer(&t), m_grammar(&g) {}
+   ~incremental_check() = default;
+
+public:
+    result_t reset(const char* str, size_t len = size_t(-1));
+
+    // replaces removed characters at offset with the inserted ones
+    result_t edit(size_t offset, size_t removed, const char* inserted, size_t inserted_len = size_t(-1));
+
+    // the tokenizer error or, when the text tokenizes, the result of the check
+    result_t get_result() const { return m_result; }
+
+    const std::string&  get_text  () const { return m_text; }
+    const parse_tree_t& get_tree  () const { return m_tree; } // empty when the check failed
+
+    // not const - moves the tokens behind the last edits first
+    const tokens_t& get_tokens();
+
+    // the tokens of the nodes the last reset() or edit() parsed again (all the tokens for a whole check)
+    size_t get_parsed_tokens() const { return m_parsed; }
+
+private:
+    static constexpr size_t npos = size_t(-1);
+
+    result_t tokenize_all();
+    result_t parse_all();
+    result_t parse_edit(const token_edit& changed);
+
+    void splice(size_t level, std::ptrdiff_t delta, size_t furthest);
+
+private:
+    const tokenizer* m_tokenizer;
+    const grammar*   m_grammar;
+
+    std::string         m_text;
+    tokens_t            m_tokens;
+    token_shift         m_shift {0, 0}; // the move of m_tokens behind the last edits, applied by get_tokens()
+    bool                m_tokenized = false; // m_tokens are all the tokens of m_text
+
+    parse_tree_t        m_tree;
+    std::vector<size_t> m_reach;        // node -> the furthest token the check examined when the node started
+    size_t              m_furthest = 0; // the furthest token the check examined
+    size_t              m_parsed   = 0;
+
+    result_t m_result {parse_error::None, symbol_id(0), 0};
+
+    check_stack         m_stack;
+    parse_tree_t        m_subtree;
+    std::vector<size_t> m_subreach;
+    std::vector<size_t> m_path;         // the nodes from the root down that cover the replaced tokens
 };
 
 }
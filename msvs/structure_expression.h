@@ -0,0 +1,108 @@
+#pragma once
+
+#include "fagramm.h"
+
+namespace fagramm
+{
+namespace id
+{
+enum symbol : int
+{
+    NON_SYMBOL,
+
+    //Terminal symbols - punctuations
+    P_LPAREN,
+    P_RPAREN,
+    P_COMMA,
+
+    //Terminal symbols - keywords
+    K_ADD,
+    K_INTERSECT,
+    K_XOR,
+    K_SUBTRACT,
+    K_EXPAND,
+    K_CONTRACT,
+
+    //Non-terminal symbols
+    S_EXPRESSION,
+    S_SET_EXPRESSION,
+    S_SET_OPERATION,
+    S_SCALE_EXPRESSION,
+    S_SCALE_OPERATION,
+    S_ARGUMENT,
+    S_MARGIN,
+};
+}
+}
+
+struct structure_expression
+{
+    //
+    // Tokenizer data
+    //
+    static constexpr unsigned tokenizer_flags = (0 |
+        fagramm::tokenizer::Flag_Case_Sensitive_Keywords
+        );
+
+    static constexpr fagramm::token_info punctuations[] = {
+        {fagramm::id::P_LPAREN, "("},
+        {fagramm::id::P_RPAREN, ")"},
+        {fagramm::id::P_COMMA , ","},
+    };
+    static constexpr fagramm::token_info keywords[] = {
+        {fagramm::id::K_ADD      , "ADD"      },
+        {fagramm::id::K_INTERSECT, "INTERSECT"},
+        {fagramm::id::K_XOR      , "XOR"      },
+        {fagramm::id::K_SUBTRACT , "SUBTRACT" },
+        {fagramm::id::K_EXPAND   , "EXPAND"   },
+        {fagramm::id::K_CONTRACT , "CONTRACT" },
+    };
+
+    //
+    // Grammar data
+    //
+    static constexpr fagramm::symbol_id start_symbol = fagramm::id::S_EXPRESSION;
+
+    // a constexpr template - the grammar tables are built and checked at compile time (see fagramm::static_grammar)
+    template<class Rules>
+    static constexpr void add_rules(Rules& rules)
+    {
+        using namespace fagramm::id;
+
+        rules.add(S_EXPRESSION).symbol(S_SET_EXPRESSION);
+        rules.add(S_EXPRESSION).symbol(S_SCALE_EXPRESSION);
+
+        rules.add(S_SET_EXPRESSION)
+            .symbol(S_SET_OPERATION)
+            .punctuation(P_LPAREN)
+            .symbol(S_ARGUMENT)
+        //  .loop(1) - uncomment this loop(...) and below next() will allow to operation to have arbitrary number of arguments
+            .punctuation(P_COMMA)
+            .symbol(S_ARGUMENT)
+        //  .next()
+            .punctuation(P_RPAREN)
+            ;
+        rules.add(S_SCALE_EXPRESSION)
+            .symbol(S_SCALE_OPERATION)
+            .punctuation(P_LPAREN)
+            .symbol(S_ARGUMENT)
+            .symbol(S_MARGIN)
+            .punctuation(P_RPAREN)
+            ;
+
+        rules.add(S_MARGIN).loop(6,6).punctuation(P_COMMA).number().next();
+        rules.add(S_MARGIN).loop(3,3).punctuation(P_COMMA).number().next();
+        rules.add(S_MARGIN).loop(1,1).punctuation(P_COMMA).number().next();
+
+        rules.add(S_SET_OPERATION).keyword(K_ADD);
+        rules.add(S_SET_OPERATION).keyword(K_INTERSECT);
+        rules.add(S_SET_OPERATION).keyword(K_XOR);
+        rules.add(S_SET_OPERATION).keyword(K_SUBTRACT);
+
+        rules.add(S_SCALE_OPERATION).keyword(K_EXPAND);
+        rules.add(S_SCALE_OPERATION).keyword(K_CONTRACT);
+
+        rules.add(S_ARGUMENT).string();
+        rules.add(S_ARGUMENT).symbol(S_EXPRESSION);
+    }
+};
@@ -2,17 +2,275 @@
 
 #include <algorithm>
 #include <cstring>
-#include <cctype>
+#include <cstdlib>
+#include <cstdint>
+#include <chrono>
+#include <limits>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define FAGRAMM_X86_SCANNING
+#include <immintrin.h>
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#endif
+#endif
+
+// FAGRAMM_STATS=1 compiles the counters of check_stats into the checks
+#if FAGRAMM_STATS
+#define Stats_Update(...) __VA_ARGS__
+#else
+#define Stats_Update(...)
+#endif
 
 namespace fagramm
 {
 
+//
+// Scanning kernels - find the end of a character class run or the next string body stop ('"', '\\' or 0).
+// The vectorized kernels read whole aligned blocks only, so they never cross a page boundary past the end
+// of the input (which may be a zero terminated string with unknown length).
+//
+struct scan_kernels
+{
+    const char* (*skip_set   )(const char* str, const char* end, const unsigned char* lo_nibbles);
+    const char* (*find_string)(const char* str, const char* end);
+};
+
+static const char* skip_set_scalar(const char* str, const char* end, const unsigned char* lo_nibbles)
+{
+    for( ; str < end; ++str)
+    {
+        const unsigned ch = (unsigned char)*str;
+
+        if((ch >= 0x80) || ((lo_nibbles[ch & 15] & (1u << (ch >> 4))) == 0)) break;
+    }
+    return str;
+}
+
+static const char* find_string_scalar(const char* str, const char* end)
+{
+    for( ; (str < end) && (*str != '"') && (*str != '\\') && (*str != 0); ++str);
+
+    return str;
+}
+
+#if defined(FAGRAMM_X86_SCANNING)
+
+// The vector kernels load the aligned block that holds str, so they read up to 15 (31) bytes before str, and the
+// aligned blocks up to the one that holds end - 1 or the stop character, so they read up to 15 (31) bytes past them.
+// An aligned load never crosses a page boundary and the block holds at least one byte of the input, so these reads
+// never fault; the bytes outside [str, end) are masked off (skip) or cut by scan_result. They are still outside
+// the objects to AddressSanitizer, which is why the kernels are exempt from it.
+#if defined(__GNUC__) || defined(__clang__)
+#define FAGRAMM_TARGET(isa) __attribute__((target(isa), no_sanitize_address))
+#else
+#define FAGRAMM_TARGET(isa)
+#endif
+
+static unsigned count_trailing_zeros(unsigned mask)
+{
+#if defined(_MSC_VER) && !defined(__clang__)
+    unsigned long index;
+    _BitScanForward(&index, mask);
+    return unsigned(index);
+#else
+    return unsigned(__builtin_ctz(mask));
+#endif
+}
+
+static const char* scan_result(const char* block, unsigned mask, const char* end)
+{
+    const char* pos = block + count_trailing_zeros(mask);
+
+    return (pos < end) ? pos : end;
+}
+
+FAGRAMM_TARGET("ssse3")
+static const char* skip_set_ssse3(const char* str, const char* end, const unsigned char* lo_nibbles)
+{
+    const __m128i lo    = _mm_loadu_si128(reinterpret_cast<const __m128i*>(lo_nibbles));
+    const __m128i hi    = _mm_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128, 0, 0, 0, 0, 0, 0, 0, 0);
+    const __m128i low4  = _mm_set1_epi8(0x0F);
+    const __m128i zero  = _mm_setzero_si128();
+
+    unsigned    skip  = unsigned(reinterpret_cast<std::uintptr_t>(str) & 15);
+    const char* block = str - skip;
+
+    for( ; block < end; block += 16, skip = 0)
+    {
+        const __m128i data = _mm_load_si128(reinterpret_cast<const __m128i*>(block));
+
+        const __m128i lo_bits = _mm_shuffle_epi8(lo, _mm_and_si128(data, low4));
+        const __m128i hi_bits = _mm_shuffle_epi8(hi, _mm_and_si128(_mm_srli_epi16(data, 4), low4));
+
+        const unsigned mask = unsigned(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(lo_bits, hi_bits), zero))) & (0xFFFFu << skip);
+
+        if(mask != 0) return scan_result(block, mask, end);
+    }
+    return end;
+}
+
+FAGRAMM_TARGET("sse2")
+static const char* find_string_sse2(const char* str, const char* end)
+{
+    const __m128i quote     = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    const __m128i zero      = _mm_setzero_si128();
+
+    unsigned    skip  = unsigned(reinterpret_cast<std::uintptr_t>(str) & 15);
+    const char* block = str - skip;
+
+    for( ; block < end; block += 16, skip = 0)
+    {
+        const __m128i data = _mm_load_si128(reinterpret_cast<const __m128i*>(block));
+
+        const __m128i stop = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(data, quote), _mm_cmpeq_epi8(data, backslash)), _mm_cmpeq_epi8(data, zero));
+
+        const unsigned mask = unsigned(_mm_movemask_epi8(stop)) & (0xFFFFu << skip);
+
+        if(mask != 0) return scan_result(block, mask, end);
+    }
+    return end;
+}
+
+FAGRAMM_TARGET("avx2")
+static const char* skip_set_avx2(const char* str, const char* end, const unsigned char* lo_nibbles)
+{
+    const __m256i lo    = _mm256_broadcastsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i*>(lo_nibbles)));
+    const __m256i hi    = _mm256_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128, 0, 0, 0, 0, 0, 0, 0, 0, 1, 2, 4, 8, 16, 32, 64, -128, 0, 0, 0, 0, 0, 0, 0, 0);
+    const __m256i low4  = _mm256_set1_epi8(0x0F);
+    const __m256i zero  = _mm256_setzero_si256();
+
+    unsigned    skip  = unsigned(reinterpret_cast<std::uintptr_t>(str) & 31);
+    const char* block = str - skip;
+
+    for( ; block < end; block += 32, skip = 0)
+    {
+        const __m256i data = _mm256_load_si256(reinterpret_cast<const __m256i*>(block));
+
+        const __m256i lo_bits = _mm256_shuffle_epi8(lo, _mm256_and_si256(data, low4));
+        const __m256i hi_bits = _mm256_shuffle_epi8(hi, _mm256_and_si256(_mm256_srli_epi16(data, 4), low4));
+
+        const unsigned mask = unsigned(_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_and_si256(lo_bits, hi_bits), zero))) & (0xFFFFFFFFu << skip);
+
+        if(mask != 0) return scan_result(block, mask, end);
+    }
+    return end;
+}
+
+FAGRAMM_TARGET("avx2")
+static const char* find_string_avx2(const char* str, const char* end)
+{
+    const __m256i quote     = _mm256_set1_epi8('"');
+    const __m256i backslash = _mm256_set1_epi8('\\');
+    const __m256i zero      = _mm256_setzero_si256();
+
+    unsigned    skip  = unsigned(reinterpret_cast<std::uintptr_t>(str) & 31);
+    const char* block = str - skip;
+
+    for( ; block < end; block += 32, skip = 0)
+    {
+        const __m256i data = _mm256_load_si256(reinterpret_cast<const __m256i*>(block));
+
+        const __m256i stop = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(data, quote), _mm256_cmpeq_epi8(data, backslash)), _mm256_cmpeq_epi8(data, zero));
+
+        const unsigned mask = unsigned(_mm256_movemask_epi8(stop)) & (0xFFFFFFFFu << skip);
+
+        if(mask != 0) return scan_result(block, mask, end);
+    }
+    return end;
+}
+
+enum class cpu_feature
+{
+    sse2,
+    ssse3,
+    avx2,
+};
+
+static bool cpu_supports(cpu_feature feature)
+{
+#if defined(_MSC_VER) && !defined(__clang__)
+    int regs[4];
+    __cpuid(regs, 0);
+    const int max_leaf = regs[0];
+
+    __cpuid(regs, 1);
+    const bool sse2    = (regs[3] & (1 << 26)) != 0;
+    const bool ssse3   = (regs[2] & (1 <<  9)) != 0;
+    const bool osxsave = (regs[2] & (1 << 27)) != 0;
+    const bool avx     = (regs[2] & (1 << 28)) != 0;
+
+    if(feature == cpu_feature::sse2 ) return sse2;
+    if(feature == cpu_feature::ssse3) return ssse3;
+
+    if(!osxsave || !avx || (max_leaf < 7) || ((_xgetbv(0) & 6) != 6)) return false;
+
+    __cpuidex(regs, 7, 0);
+    return (regs[1] & (1 << 5)) != 0;
+#else
+    __builtin_cpu_init();
+
+    switch(feature)
+    {
+        case cpu_feature::sse2:  return (__builtin_cpu_supports("sse2" ) != 0);
+        case cpu_feature::ssse3: return (__builtin_cpu_supports("ssse3") != 0);
+        case cpu_feature::avx2:  return (__builtin_cpu_supports("avx2" ) != 0);
+    }
+    return false;
+#endif
+}
+
+// x86-64 always has SSE2, a 32-bit x86 CPU may not
+static scan_kernels select_scan_kernels()
+{
+    if(cpu_supports(cpu_feature::avx2 )) return {skip_set_avx2 , find_string_avx2};
+    if(cpu_supports(cpu_feature::ssse3)) return {skip_set_ssse3, find_string_sse2};
+    if(cpu_supports(cpu_feature::sse2 )) return {skip_set_scalar, find_string_sse2};
+
+    return {skip_set_scalar, find_string_scalar};
+}
+
+#else
+
+static scan_kernels select_scan_kernels()
+{
+    return {skip_set_scalar, find_string_scalar};
+}
+
+#endif
+
+static constexpr size_t scalar_scan_prefix = 8;
+
+static const scan_kernels& get_scan_kernels(bool scalar)
+{
+    static const scan_kernels scalar_kernels {skip_set_scalar, find_string_scalar};
+    static const scan_kernels kernels = select_scan_kernels();
+
+    return scalar ? scalar_kernels : kernels;
+}
+
 void tokenizer::clear()
 {
     m_flags = Flag_Default;
 
+    m_char_classes = default_char_classes();
+
+    m_space_set = make_scan_set(m_char_classes, Char_Space);
+    m_ident_set = make_scan_set(m_char_classes, Char_Ident);
+
     m_punctuations.clear();
     m_keywords    .clear();
+
+    m_punctuation_index.clear();
+    m_keyword_index    .clear();
+
+    m_strings.clear();
 }
 
 result_t tokenizer::reset(
@@ -20,7 +278,9 @@ result_t tokenizer::reset(
     size_t punctuations_count,
     const token_info* keywords,
     size_t keywords_count,
-    unsigned flags
+    unsigned flags,
+    const char_class_info* char_classes,
+    size_t char_classes_count
     )
 {
     clear();
@@ -29,7 +289,8 @@ result_t tokenizer::reset(
 
     result_t result;
 
-    if( !bool(result = reset_punctuations(punctuations, punctuations_count)) ||
+    if( !bool(result = reset_char_classes(char_classes, char_classes_count)) ||
+        !bool(result = reset_punctuations(punctuations, punctuations_count)) ||
         !bool(result = reset_keywords    (keywords    , keywords_count    ))
         )
     {
@@ -47,663 +308,5402 @@ result_t tokenizer::tokenize(
 {
     Check_ValidArg(str != nullptr, {parse_error::InvalidArguments, symbol_id(0), 0});
 
-    context ctx {&tokens, str, str, parse_error::None};
+    context ctx {&tokens, str, str, parse_error::None, 0, false, nullptr, size_t(-1)};
 
     const char* end = ((str + len) < str)
         ? decltype(end)(std::size_t(-1))
         : (str + len);
 
-    while((str < end) && (ctx.err == parse_error::None))
-    {
-        remove_whitespace(str, end, ctx);
-
-        if(check_string(str, end, ctx)) continue;
-        if(check_number(str, end, ctx)) continue;
-        if(check_ident (str, end, ctx)) continue;
-        if(check_punct (str, end, ctx)) continue;
-
-        if(*str != 0)
-        {
-            ctx.err = parse_error::UnknownCharacter;
-            ctx.pos = str;
-        }
-        break;
-    }
+    tokenize_range(str, end, ctx);
 
     result_t result {ctx.err, symbol_id(0), size_t(ctx.pos - ctx.begin)};
 
     return result;
 }
 
-int tokenizer::compare_strings(
-    bool case_sensitive,
-    const char* str1,
-    size_t len1,
-    const char* str2,
-    size_t len2
+result_t tokenizer::tokenize(
+    compact_tokens& tokens,
+    const char* str,
+    size_t len
     )
+    const
 {
-    size_t len = std::min(len1, len2);
-
-    int dif;
-
-    if(case_sensitive)
-    {
-        dif = std::strncmp(str1, str2, len);
+    Check_ValidArg(str != nullptr, {parse_error::InvalidArguments, symbol_id(0), 0});
 
-        if(dif != 0) return dif;
-    }
-    else while(len-- == 0)
-    {
-        dif = std::toupper(*str1++) - std::toupper(*str2++);
+    context ctx {nullptr, str, str, parse_error::None, 0, false, nullptr, size_t(-1), &tokens};
 
-        if(dif != 0) return dif;
-    }
-    return int(len1 - len2);
-}
+    const char* end = ((str + len) < str)
+        ? decltype(end)(std::size_t(-1))
+        : (str + len);
 
-bool tokenizer::is_valid_punctuation(const char* str)
-{
-    return (str != nullptr) && (*str != 0);
-}
+    // positions and lengths are 32 bit - the tokenizing stops at 4 GB and fails when the input goes on
+    constexpr size_t max_len = UINT32_MAX;
 
-bool tokenizer::is_valid_keyword(const char* str)
-{
-    return (str != nullptr) && (*str != 0);
-}
+    const char* limit = ((size_t(end - str) > max_len) && ((str + max_len) > str)) ? (str + max_len) : end;
 
-result_t tokenizer::reset_punctuations(
-    const token_info* punctuations,
-    size_t punctuations_count
-    )
-{
-    if((punctuations == nullptr) || (punctuations_count == 0)) return {parse_error::None, symbol_id(0), 0};
+    const char* stop = tokenize_range(str, limit, ctx);
 
-    for(size_t index = 0; index < punctuations_count; ++index)
+    if((ctx.err == parse_error::None) && (stop == limit) && (limit != end) && (*stop != 0))
     {
-        if(!is_valid_punctuation(punctuations[index].str)) return {parse_error::InvalidPunctuation, symbol_id(0), index};
-
-        m_punctuations.push_back({punctuations[index].id, punctuations[index].str, std::strlen(punctuations[index].str)});
+        return {parse_error::InvalidArguments, symbol_id(0), max_len};
     }
 
-    bool has_duplicates = false;
-    std::sort(m_punctuations.begin(), m_punctuations.end(), [&has_duplicates] (const token_desc& punctuation1, const token_desc& punctuation2)
-    {
-        const int res = compare_strings(true, punctuation1.str, punctuation1.len, punctuation2.str, punctuation2.len);
-        has_duplicates = has_duplicates || (res == 0);
-        return (res < 0);
-    });
-    if(has_duplicates) return {parse_error::DuplicatePunctuations, symbol_id(0), 0};
-
-    auto it = std::max_element(m_punctuations.begin(), m_punctuations.end(), [] (const token_desc& punctuation1, const token_desc& punctuation2)
-    {
-        return (punctuation1.len < punctuation2.len);
-    });
-    Assert_Check(it != m_punctuations.end());
-
-    m_max_punct_len = it->len;
+    result_t result {ctx.err, symbol_id(0), size_t(ctx.pos - ctx.begin)};
 
-    return {parse_error::None, symbol_id(0), 0};
+    return result;
 }
 
-result_t tokenizer::reset_keywords(
-    const token_info* keywords,
-    size_t keywords_count
+result_t tokenizer::tokenize(
+    check_context& ctx,
+    const char* str,
+    size_t len
     )
+    const
 {
-    if((keywords == nullptr) || (keywords_count == 0)) return {parse_error::None, symbol_id(0), 0};
+    ctx.tokens.clear();
 
-    for(size_t index = 0; index < keywords_count; ++index)
-    {
-        if(!is_valid_keyword(keywords[index].str)) return {parse_error::InvalidKeyword, symbol_id(0), index};
+    trace_buffer* trace = ctx.stack.get_trace();
 
-        m_keywords.push_back({keywords[index].id, keywords[index].str, std::strlen(keywords[index].str)});
-    }
+    if(trace == nullptr) return tokenize(ctx.tokens, str, len);
 
-    const bool case_sensitive_keywords = flag_is_set(Flag_Case_Sensitive_Keywords);
+    trace->record(trace_event::tokenize_begin, 0, 0);
 
-    bool has_duplicates = false;
+    const result_t result = tokenize(ctx.tokens, str, len);
 
-    std::sort(m_keywords.begin(), m_keywords.end(), [case_sensitive_keywords, &has_duplicates] (const token_desc& keyword1, const token_desc& keyword2)
-    {
-        const int res = compare_strings(case_sensitive_keywords, keyword1.str, keyword1.len, keyword2.str, keyword2.len);
-        has_duplicates = has_duplicates || (res == 0);
-        return (res < 0);
-    });
-    if(has_duplicates) return {parse_error::DuplicateKeywords, symbol_id(0), 0};
+    trace->record(trace_event::tokenize_end, 0, ctx.tokens.size(), symbol_id(0), 0, result.err);
 
-    return {parse_error::None, symbol_id(0), 0};
+    return result;
 }
 
-bool tokenizer::find_punctuation(symbol_id& id, const char* str, size_t len) const
+token_stream tokenizer::tokenize_stream(tokens_t& tokens) const
 {
-    const token_desc punctuation {symbol_id(0), str, len};
+    return token_stream(*this, tokens);
+}
 
-    const bool found = std::binary_search(m_punctuations.begin(), m_punctuations.end(), punctuation, [&id] (const token_desc& punctuation1, const token_desc& punctuation2)
+// replaces [first, last) of v with [begin, end)
+template<class T, class Iterator>
+static void replace_range(std::vector<T>& v, size_t first, size_t last, Iterator begin, Iterator end)
+{
+    if(size_t(end - begin) != (last - first))
     {
-        const int res = compare_strings(true, punctuation1.str, punctuation1.len, punctuation2.str, punctuation2.len);
-        if(res == 0) id = symbol_id(int(punctuation1.id) + int(punctuation2.id));
-        return (res < 0);
-    });
-    return found;
+        v.erase (v.begin() + std::ptrdiff_t(first), v.begin() + std::ptrdiff_t(last));
+        v.insert(v.begin() + std::ptrdiff_t(first), begin, end);
+    }
+    else
+    {
+        std::copy(begin, end, v.begin() + std::ptrdiff_t(first));
+    }
 }
 
-bool tokenizer::find_keyword(symbol_id& id, const char* str, size_t len) const
+result_t tokenizer::retokenize(
+    tokens_t& tokens,
+    const char* str,
+    size_t len,
+    const text_edit& edit,
+    token_edit& changed
+    )
+    const
 {
-    const bool case_sensitive_keywords = flag_is_set(Flag_Case_Sensitive_Keywords);
+    token_shift shift {tokens.size(), 0};
 
-    const token_desc keyword {symbol_id(0), str, len};
+    const result_t result = retokenize(tokens, str, len, edit, changed, shift);
 
-    const bool found = std::binary_search(m_keywords.begin(), m_keywords.end(), keyword, [&id, case_sensitive_keywords] (const token_desc& keyword1, const token_desc& keyword2)
-    {
-        const int res = compare_strings(case_sensitive_keywords, keyword1.str, keyword1.len, keyword2.str, keyword2.len);
-        if(res == 0) id = symbol_id(int(keyword1.id) + int(keyword2.id));
-        return (res < 0);
-    });
-    return found;
-}
+    apply_shift(tokens, shift);
 
-void tokenizer::remove_whitespace(const char*& str, const char* end, context&/* ctx*/) const
-{
-    for( ; (str < end) && std::isspace(*str); ++str);
+    return result;
 }
 
-bool tokenizer::check_string(const char*& str, const char* end, context& ctx) const
+result_t tokenizer::retokenize(
+    tokens_t& tokens,
+    const char* str,
+    size_t len,
+    const text_edit& edit,
+    token_edit& changed,
+    token_shift& shift
+    )
+    const
 {
-    if(*str != '"') return false;
+    Check_ValidArg(str != nullptr, {parse_error::InvalidArguments, symbol_id(0), 0});
+    Check_ValidArg(shift.first <= tokens.size(), {parse_error::InvalidArguments, symbol_id(0), 0});
 
-    const char* start = str++;
+    const char* end = ((str + len) < str)
+        ? decltype(end)(std::size_t(-1))
+        : (str + len);
 
-    for( ; (str < end); ++str)
+    Check_ValidArg(edit.offset + edit.inserted <= size_t(end - str), {parse_error::InvalidArguments, symbol_id(0), 0});
+
+    // the position of a token in the text before the edit
+    auto position = [&tokens, &shift] (size_t index)
+    {
+        return size_t(std::ptrdiff_t(tokens[index].pos) + ((index >= shift.first) ? shift.delta : 0));
+    };
+    // the first token from index on that is not before
+    auto find_token = [&tokens] (size_t index, const auto& before)
     {
-        switch(*str)
+        for(size_t count = tokens.size() - index; count != 0; )
         {
-            case 0:
-                ctx.err = parse_error::MissingStringCloseQuote;
-                ctx.pos = str;
-                return true;
-
-            case '\"': ++str; break;
-            case '\\': ++str; continue;
+            const size_t half = count / 2;
 
-            default: continue;
+            if(before(index + half))
+            {
+                index += half + 1;
+                count -= half + 1;
+            }
+            else
+            {
+                count = half;
+            }
         }
-        break;
-    }
-    if(str == end)
-    {
-        ctx.err = parse_error::MissingStringCloseQuote;
-        ctx.pos = str;
-        return true;
-    }
-
-    const size_t pos = size_t(start - ctx.begin);
-    const size_t len = size_t(str   - start);
-
-    ctx.tokens->push_back({token_type::string, symbol_id(0), pos, len});
-
-    return true;
-}
+        return index;
+    };
 
-bool tokenizer::check_number(const char*& str, const char* end, context& ctx) const
-{
-    if(!std::isdigit(*str)) return false;
+    // the tokenizer looks past the end of a token to end it - two characters after a number ("1.5"), one after an
+    // identifier and up to the longest punctuation from the start of a punctuation
+    const size_t offset = edit.offset;
+    const size_t reach  = m_punctuation_index.max_len;
 
-    const char* start = str++;
+    const size_t first = find_token(0, [&] (size_t index)
+    {
+        return (position(index) + std::max(tokens[index].len + 2, reach) <= offset);
+    });
 
-    if((*start == '0') && (str < end) && std::isdigit(*str))
+    // the shift moves to the first token tokenized again - only the tokens between it and the one of the last edit
+    // are moved for it
+    if(shift.delta == 0)
     {
-        ctx.err = parse_error::InvalidLeadingZero;
-        ctx.pos = str;
-        return true;
+        shift.first = first;
     }
+    for( ; shift.first < first; ++shift.first) tokens[shift.first].pos = size_t(std::ptrdiff_t(tokens[shift.first].pos) + shift.delta);
+    for( ; shift.first > first; --shift.first) tokens[shift.first - 1].pos = size_t(std::ptrdiff_t(tokens[shift.first - 1].pos) - shift.delta);
 
-    for( ; (str < end) && std::isdigit(*str); ++str);
+    const size_t restart = (first != 0) ? (tokens[first - 1].pos + tokens[first - 1].len) : 0;
 
-    if((*str == '.') && ((str + 1) < end) && std::isdigit(str[1]))
+    // a token of the new text that starts behind the edit where a token of the old text started is that token again,
+    // and so are the tokens after it
+    const size_t new_tail = edit.offset + edit.inserted;
+    const size_t old_tail = edit.offset + edit.removed;
+
+    size_t old_index = find_token(first, [&] (size_t index)
     {
-        for(++str; (str < end) && std::isdigit(*str); ++str);
-    }
+        return (position(index) < old_tail);
+    });
 
-    const size_t pos = size_t(start - ctx.begin);
-    const size_t len = size_t(str   - start);
+    tokens_t fresh;
 
-    ctx.tokens->push_back({token_type::number, symbol_id(0), pos, len});
+    context ctx {&fresh, str, str, parse_error::None, 0, false, nullptr, 0};
 
-    return true;
-}
+    const char* pos = str + restart;
 
-bool tokenizer::check_ident(const char*& str, const char* end, context& ctx) const
-{
-    if(!std::isalnum(*str)) return false;
+    bool synced = false;
 
-    const char* start = str++;
+    for(size_t checked = 0; !synced; )
+    {
+        ctx.max_tokens = fresh.size() + std::max<size_t>(4, fresh.size());
 
-    for( ; (str < end) && std::isalnum(*str); ++str);
+        pos = tokenize_range(pos, end, ctx);
 
-    const size_t pos = size_t(start - ctx.begin);
-    const size_t len = size_t(str   - start);
+        for( ; checked < fresh.size(); ++checked)
+        {
+            if(fresh[checked].pos < new_tail) continue;
 
-    symbol_id id;
+            const size_t old_pos = fresh[checked].pos - new_tail + old_tail;
 
-    if(find_keyword(id, start, len))
-    {
-        ctx.tokens->push_back({token_type::keyword, id, pos, len});
-    }
-    else
-    {
-        ctx.tokens->push_back({token_type::ident, symbol_id(0), pos, len});
+            while((old_index < tokens.size()) && (position(old_index) < old_pos)) ++old_index;
+
+            if((old_index < tokens.size()) && (position(old_index) == old_pos))
+            {
+                fresh.resize(checked);
+                synced = true;
+                break;
+            }
+        }
+        // tokenizing stops before max_tokens only at the end of the text, a NUL character or an error
+        if(!synced && ((ctx.err != parse_error::None) || (fresh.size() < ctx.max_tokens))) break;
     }
-    return true;
-}
 
-bool tokenizer::check_punct(const char*& str, const char* end, context& ctx) const
-{
-    if(!(std::ispunct(*str) && (*str != '"'))) return false;
+    const size_t last = synced ? old_index : tokens.size();
 
-    const char* start = str++;
+    replace_range(tokens, first, last, fresh.begin(), fresh.end());
+    changed = {first, last - first, fresh.size()};
+
+    // the tokens behind the fresh ones keep the shift and the move of the edit
+    shift.first = first + fresh.size();
+    shift.delta = (shift.first < tokens.size()) ? (shift.delta + std::ptrdiff_t(new_tail) - std::ptrdiff_t(old_tail)) : 0;
 
-    size_t len = 1;
+    if(synced) return {parse_error::None, symbol_id(0), 0};
 
-    for( ; (len < m_max_punct_len) && (str < end) && std::ispunct(*str) && (*str != '"'); ++str, ++len);
+    return {ctx.err, symbol_id(0), size_t(ctx.pos - ctx.begin)};
+}
 
-    for(symbol_id id; len > 0; --str, --len)
+void tokenizer::apply_shift(tokens_t& tokens, token_shift& shift)
+{
+    if(shift.delta != 0)
     {
-        if(find_punctuation(id, start, len))
+        for(size_t index = shift.first; index < tokens.size(); ++index)
         {
-            const size_t pos = size_t(start - ctx.begin);
-
-            ctx.tokens->push_back({token_type::punctuation, id, pos, len});
-            break;
+            tokens[index].pos = size_t(std::ptrdiff_t(tokens[index].pos) + shift.delta);
         }
     }
+    shift = {tokens.size(), 0};
+}
+
+// returns where tokenizing stopped - end, a NUL character, an error, a partial token (ctx.partial) or max_tokens
+const char* tokenizer::tokenize_range(const char* str, const char* end, context& ctx) const
+{
+    while((str < end) && (ctx.err == parse_error::None) && (ctx.partial == nullptr) && (ctx.count() < ctx.max_tokens))
+    {
+        remove_whitespace(str, end, ctx);
+
+        if(str == end) break;
+
+        if(check_string(str, end, ctx)) continue;
+        if(check_number(str, end, ctx)) continue;
+        if(check_ident (str, end, ctx)) continue;
+        if(check_punct (str, end, ctx)) continue;
+
+        if(*str != 0)
+        {
+            ctx.err = parse_error::UnknownCharacter;
+            ctx.pos = str;
+        }
+        break;
+    }
+    return (ctx.partial != nullptr) ? ctx.partial : str;
+}
+
+// the first prefix of a chunk that finishes a carried token is at least this long
+static constexpr size_t carry_step = 64;
+
+result_t token_stream::feed(const char* chunk, size_t len)
+{
+    Check_ValidArg((chunk != nullptr) || (len == 0), {parse_error::InvalidArguments, symbol_id(0), 0});
+
+    if(!m_result || m_ended) return m_result;
+
+    // without a carried token the chunk is tokenized in place and only its unfinished tail is copied
+    if(m_pending.empty()) return tokenize(chunk, len, true);
+
+    // a long token (e.g. a string literal) that spans many chunks is scanned again only when its size doubles
+    if((m_pending.size() + len) < m_rescan_size)
+    {
+        m_pending.append(chunk, len);
+        return m_result;
+    }
+
+    // the carried token is finished from a prefix of the chunk that doubles until the token ends in it - only that
+    // prefix is copied, the chunk after the token is tokenized in place
+    size_t carried = m_pending.size(); // m_pending is the carried input and then the chunk from first to taken
+    size_t first   = 0;
+    size_t taken   = 0;
+    size_t step    = std::max(m_pending.size(), carry_step);
+
+    for(;;)
+    {
+        const size_t grow = std::min(step, len - taken);
+
+        m_pending.append(chunk + taken, grow);
+        taken += grow;
+        step  *= 2;
+
+        const char* str = m_pending.data();
+        const char* end = str + m_pending.size();
+
+        // one token at most - the carried one
+        tokenizer::context ctx {m_tokens, str, str, parse_error::None, m_offset, true, nullptr, m_tokens->size() + 1};
+
+        const char*  stop = m_tokenizer->tokenize_range(str, end, ctx);
+        const size_t used = size_t(stop - str);
+
+        if(ctx.err != parse_error::None)
+        {
+            m_result = {ctx.err, symbol_id(0), m_offset + size_t(ctx.pos - str)};
+            m_ended  = true;
+
+            return m_result;
+        }
+        m_offset += used;
+
+        if(ctx.partial != nullptr)
+        {
+            m_pending.erase(0, used);
+
+            if(used < carried)
+            {
+                carried -= used;
+            }
+            else
+            {
+                first  += (used - carried);
+                carried = 0;
+            }
+
+            if(taken < len) continue;
+
+            m_rescan_size = m_pending.size() * 2;
+
+            return m_result;
+        }
+        if((stop != end) && (ctx.count() < ctx.max_tokens))
+        {
+            // the input ends with a NUL character like in tokenizer::tokenize
+            m_pending.clear();
+            m_ended = true;
+
+            return m_result;
+        }
+        if(used < carried)
+        {
+            // the token ended in the carried input - the rest of it is carried on, the chunk is taken again
+            m_pending.erase(carried);
+            m_pending.erase(0, used);
+            carried -= used;
+            taken    = first;
+            continue;
+        }
+        m_pending.clear();
+
+        const size_t chunk_pos = first + (used - carried);
+
+        return tokenize(chunk + chunk_pos, len - chunk_pos, true);
+    }
+}
+
+result_t token_stream::finish()
+{
+    if(m_result && !m_ended && !m_pending.empty())
+    {
+        tokenize(m_pending.data(), m_pending.size(), false);
+    }
+    m_ended = true;
+
+    return m_result;
+}
+
+void token_source::reset(const char* str, size_t len)
+{
+    m_begin = str;
+    m_str   = str;
+    m_end   = ((str == nullptr) || ((str + len) < str))
+        ? decltype(m_end)(std::size_t(-1))
+        : (str + len);
+
+    m_tokens.clear();
+
+    m_dropped   = 0;
+    m_exhausted = (str == nullptr);
+    m_result    = {(str == nullptr) ? parse_error::InvalidArguments : parse_error::None, symbol_id(0), 0};
+}
+
+// drops the tokens before keep_index and tokenizes up to window_size more - or as many as are kept, so a check that
+// keeps all tokens (e.g. a start symbol with alternatives left) pulls a logarithmic number of times, or min_count
+void token_source::pull(size_t keep_index, size_t min_count)
+{
+    m_tokens.erase(m_tokens.begin(), m_tokens.begin() + std::ptrdiff_t(keep_index));
+    m_dropped += keep_index;
+
+    if(m_exhausted) return;
+
+    const size_t count = std::max({m_window_size, m_tokens.size(), min_count});
+
+    tokenizer::context ctx {&m_tokens, m_begin, m_begin, parse_error::None, 0, false, nullptr, m_tokens.size() + count};
+
+    const char* stop = m_tokenizer->tokenize_range(m_str, m_end, ctx);
+
+    // tokenizing stops before max_tokens only at the end of the input, a NUL character or an error
+    m_exhausted = (ctx.err != parse_error::None) || (m_tokens.size() < ctx.max_tokens) || (stop == m_end);
+    m_result    = {ctx.err, symbol_id(0), size_t(ctx.pos - ctx.begin)};
+    m_str       = stop;
+}
+
+// tokenizes the rest of the input only to find tokenizer errors
+void token_source::drain()
+{
+    while(!m_exhausted) pull(m_tokens.size(), 0);
+}
+
+result_t token_stream::tokenize(const char* str, size_t len, bool more_input)
+{
+    tokenizer::context ctx {m_tokens, str, str, parse_error::None, m_offset, more_input, nullptr, size_t(-1)};
+
+    const char* end  = str + len;
+    const char* stop = m_tokenizer->tokenize_range(str, end, ctx);
+
+    if(ctx.err != parse_error::None)
+    {
+        m_result = {ctx.err, symbol_id(0), m_offset + size_t(ctx.pos - str)};
+        m_ended  = true;
+    }
+    else if(ctx.partial != nullptr)
+    {
+        if(str == m_pending.data())
+        {
+            m_pending.erase(0, size_t(stop - str));
+        }
+        else
+        {
+            m_pending.assign(stop, end);
+        }
+        m_rescan_size = m_pending.size() * 2;
+    }
+    else
+    {
+        // the input ends with a NUL character like in tokenizer::tokenize
+        if(stop != end) m_ended = true;
+
+        m_pending.clear();
+    }
+    m_offset += size_t(stop - str);
+
+    return m_result;
+}
+
+void tokenizer::token_index::clear()
+{
+    chars.bind(no_chars, sizeof(no_chars));
+
+    alphabet = 0;
+    max_len  = 0;
+
+    trie.clear();
+    leaf.clear();
+}
+
+bool tokenizer::token_index::build(const token_descs_t& tokens, bool case_sensitive, size_t& duplicate_index)
+{
+    clear();
+
+    // the alphabet is folded to upper case when case insensitive so both cases share one trie edge
+    auto fold = [case_sensitive] (char ch) -> unsigned char
+    {
+        const unsigned char uch = (unsigned char)ch;
+        return ((uch >= 'a') && (uch <= 'z') && !case_sensitive) ? (unsigned char)(uch - 'a' + 'A') : uch;
+    };
+
+    alphabet = 1;
+
+    for(const token_desc& token : tokens)
+    {
+        for(size_t pos = 0; pos < token.len; ++pos)
+        {
+            unsigned char& alpha = chars[fold(token.str[pos])];
+
+            if(alpha == 0) alpha = (unsigned char)alphabet++;
+        }
+        max_len = std::max(max_len, token.len);
+    }
+    if(!case_sensitive)
+    {
+        for(unsigned ch = 'a'; ch <= 'z'; ++ch)
+        {
+            chars[ch] = chars[ch - 'a' + 'A'];
+        }
+    }
+
+    trie.assign(alphabet, 0);
+    leaf.assign(1, 0);
+
+    for(size_t index = 0; index < tokens.size(); ++index)
+    {
+        const token_desc& token = tokens[index];
+
+        size_t node = 0;
+
+        for(size_t pos = 0; pos < token.len; ++pos)
+        {
+            const size_t edge = node * alphabet + chars[(unsigned char)token.str[pos]];
+
+            if(trie[edge] == 0)
+            {
+                trie[edge] = unsigned(leaf.size());
+
+                trie.resize(trie.size() + alphabet, 0);
+                leaf.push_back(0);
+            }
+            node = trie[edge];
+        }
+        if(leaf[node] != 0)
+        {
+            duplicate_index = index;
+            return false;
+        }
+        leaf[node] = unsigned(index + 1);
+    }
+    return true;
+}
+
+unsigned tokenizer::token_index::find(const char* str, size_t len) const
+{
+    if((len == 0) || (len > max_len)) return 0;
+
+    const unsigned* edges = trie.data();
+
+    size_t node = 0;
+
+    for(const char* end = str + len; str < end; ++str)
+    {
+        node = edges[node * alphabet + chars[(unsigned char)*str]];
+
+        if(node == 0) return 0;
+    }
+    return leaf[node];
+}
+
+size_t tokenizer::token_index::match(const char* str, const char* end, unsigned& found) const
+{
+    found = 0;
+
+    if(max_len == 0) return 0;
+
+    const unsigned* edges = trie.data();
+
+    size_t node = 0;
+    size_t len  = 0;
+
+    for(const char* pos = str; pos < end; )
+    {
+        node = edges[node * alphabet + chars[(unsigned char)*pos++]];
+
+        if(node == 0) break;
+
+        if(leaf[node] != 0)
+        {
+            found = leaf[node];
+            len   = size_t(pos - str);
+        }
+    }
+    return len;
+}
+
+bool tokenizer::is_valid_punctuation(const char* str)
+{
+    return (str != nullptr) && (*str != 0);
+}
+
+bool tokenizer::is_valid_keyword(const char* str)
+{
+    return (str != nullptr) && (*str != 0);
+}
+
+tokenizer::char_classes_t tokenizer::default_char_classes()
+{
+    char_classes_t classes {};
+
+    for(unsigned ch = 1; ch < 128; ++ch)
+    {
+        unsigned char& cls = classes[ch];
+
+        if(((ch >= '\t') && (ch <= '\r')) || (ch == ' '))
+        {
+            cls = Char_Space;
+        }
+        else if((ch >= '0') && (ch <= '9'))
+        {
+            cls = Char_Digit | Char_Ident;
+        }
+        else if(((ch >= 'A') && (ch <= 'Z')) || ((ch >= 'a') && (ch <= 'z')))
+        {
+            cls = Char_Ident;
+        }
+        else if((ch > ' ') && (ch < 127) && (ch != '"'))
+        {
+            cls = Char_Punct;
+        }
+    }
+    return classes;
+}
+
+result_t tokenizer::reset_char_classes(
+    const char_class_info* char_classes,
+    size_t char_classes_count
+    )
+{
+    if((char_classes == nullptr) || (char_classes_count == 0)) return {parse_error::None, symbol_id(0), 0};
+
+    for(size_t index = 0; index < char_classes_count; ++index)
+    {
+        const char_class_info& info = char_classes[index];
+
+        if((info.chars == nullptr) || ((info.classes & ~unsigned(Char_All)) != 0))
+        {
+            return {parse_error::InvalidCharClass, symbol_id(0), index};
+        }
+        for(const char* ch = info.chars; *ch != 0; ++ch)
+        {
+            m_char_classes[(unsigned char)*ch] = (unsigned char)info.classes;
+        }
+    }
+
+    m_space_set = make_scan_set(m_char_classes, Char_Space);
+    m_ident_set = make_scan_set(m_char_classes, Char_Ident);
+
+    return {parse_error::None, symbol_id(0), 0};
+}
+
+tokenizer::scan_set tokenizer::make_scan_set(const char_classes_t& char_classes, unsigned classes)
+{
+    scan_set set {{}, true};
+
+    for(unsigned ch = 0; ch < 256; ++ch)
+    {
+        if((char_classes[ch] & classes) == 0) continue;
+
+        if(ch >= 0x80)
+        {
+            set.vectorized = false;
+            continue;
+        }
+        set.lo_nibbles[ch & 15] = (unsigned char)(set.lo_nibbles[ch & 15] | (1u << (ch >> 4)));
+    }
+    return set;
+}
+
+const char* tokenizer::skip_class(const char* str, const char* end, const scan_set& set, unsigned classes) const
+{
+    // most runs are short - the kernels pay off only after a few characters
+    for(size_t count = 0; count < scalar_scan_prefix; ++count, ++str)
+    {
+        if((str == end) || !char_is(*str, classes)) return str;
+    }
+    if(set.vectorized)
+    {
+        return get_scan_kernels(flag_is_set(Flag_Scalar_Scanning)).skip_set(str, end, set.lo_nibbles);
+    }
+    for( ; (str < end) && char_is(*str, classes); ++str);
+
+    return str;
+}
+
+result_t tokenizer::reset_punctuations(
+    const token_info* punctuations,
+    size_t punctuations_count
+    )
+{
+    if((punctuations == nullptr) || (punctuations_count == 0)) return {parse_error::None, symbol_id(0), 0};
+
+    for(size_t index = 0; index < punctuations_count; ++index)
+    {
+        if(!is_valid_punctuation(punctuations[index].str)) return {parse_error::InvalidPunctuation, symbol_id(0), index};
+
+        m_punctuations.push_back({punctuations[index].id, punctuations[index].str, std::strlen(punctuations[index].str)});
+    }
+
+    size_t duplicate_index;
+
+    if(!m_punctuation_index.build(m_punctuations, true, duplicate_index))
+    {
+        return {parse_error::DuplicatePunctuations, symbol_id(0), duplicate_index};
+    }
+    return {parse_error::None, symbol_id(0), 0};
+}
+
+result_t tokenizer::reset_keywords(
+    const token_info* keywords,
+    size_t keywords_count
+    )
+{
+    if((keywords == nullptr) || (keywords_count == 0)) return {parse_error::None, symbol_id(0), 0};
+
+    for(size_t index = 0; index < keywords_count; ++index)
+    {
+        if(!is_valid_keyword(keywords[index].str)) return {parse_error::InvalidKeyword, symbol_id(0), index};
+
+        m_keywords.push_back({keywords[index].id, keywords[index].str, std::strlen(keywords[index].str)});
+    }
+
+    const bool case_sensitive_keywords = flag_is_set(Flag_Case_Sensitive_Keywords);
+
+    size_t duplicate_index;
+
+    if(!m_keyword_index.build(m_keywords, case_sensitive_keywords, duplicate_index))
+    {
+        return {parse_error::DuplicateKeywords, symbol_id(0), duplicate_index};
+    }
+    return {parse_error::None, symbol_id(0), 0};
+}
+
+bool tokenizer::find_punctuation(symbol_id& id, const char* str, size_t len) const
+{
+    const unsigned found = m_punctuation_index.find(str, len);
+
+    if(found == 0) return false;
+
+    id = m_punctuations[found - 1].id;
+
+    return true;
+}
+
+bool tokenizer::find_keyword(symbol_id& id, const char* str, size_t len) const
+{
+    const unsigned found = m_keyword_index.find(str, len);
+
+    if(found == 0) return false;
+
+    id = m_keywords[found - 1].id;
+
+    return true;
+}
+
+void tokenizer::remove_whitespace(const char*& str, const char* end, context&/* ctx*/) const
+{
+    str = skip_class(str, end, m_space_set, Char_Space);
+}
+
+bool tokenizer::check_string(const char*& str, const char* end, context& ctx) const
+{
+    if(*str != '"') return false;
+
+    const scan_kernels& kernels = get_scan_kernels(flag_is_set(Flag_Scalar_Scanning));
+
+    const char* start = str++;
+
+    for(;;)
+    {
+        for(size_t count = 0; (count < scalar_scan_prefix) && (str < end) && (*str != '"') && (*str != '\\') && (*str != 0); ++count, ++str);
+
+        if((str < end) && (*str != '"') && (*str != '\\') && (*str != 0))
+        {
+            str = kernels.find_string(str, end);
+        }
+
+        if((str == end) && ctx.more_input)
+        {
+            ctx.partial = start;
+            return true;
+        }
+        if((str == end) || (*str == 0))
+        {
+            ctx.err = parse_error::MissingStringCloseQuote;
+            ctx.pos = str;
+            return true;
+        }
+        if(*str++ == '"') break;
+
+        if((str < end) && (*str != 0)) ++str;
+    }
+
+    const size_t pos = ctx.offset + size_t(start - ctx.begin);
+    const size_t len = size_t(str - start);
+
+    ctx.add({token_type::string, symbol_id(0), pos, len});
+
+    return true;
+}
+
+bool tokenizer::check_number(const char*& str, const char* end, context& ctx) const
+{
+    if(!char_is(*str, Char_Digit)) return false;
+
+    const char* start = str++;
+
+    if((*start == '0') && (str < end) && char_is(*str, Char_Digit))
+    {
+        ctx.err = parse_error::InvalidLeadingZero;
+        ctx.pos = str;
+        return true;
+    }
+
+    for( ; (str < end) && char_is(*str, Char_Digit); ++str);
+
+    if(((str + 1) < end) && (*str == '.') && char_is(str[1], Char_Digit))
+    {
+        for(++str; (str < end) && char_is(*str, Char_Digit); ++str);
+    }
+
+    // more digits or the fraction may follow in the next chunk
+    if(ctx.more_input && ((str == end) || (((str + 1) == end) && (*str == '.'))))
+    {
+        ctx.partial = start;
+        return true;
+    }
+
+    const size_t pos = ctx.offset + size_t(start - ctx.begin);
+    const size_t len = size_t(str - start);
+
+    ctx.add({token_type::number, symbol_id(0), pos, len});
+
+    return true;
+}
+
+bool tokenizer::check_ident(const char*& str, const char* end, context& ctx) const
+{
+    if(!char_is(*str, Char_Ident)) return false;
+
+    const char* start = str++;
+
+    str = skip_class(str, end, m_ident_set, Char_Ident);
+
+    if((str == end) && ctx.more_input)
+    {
+        ctx.partial = start;
+        return true;
+    }
+
+    const size_t pos = ctx.offset + size_t(start - ctx.begin);
+    const size_t len = size_t(str - start);
+
+    symbol_id id;
+
+    if(find_keyword(id, start, len))
+    {
+        ctx.add({token_type::keyword, id, pos, len});
+    }
+    else
+    {
+        ctx.add({token_type::ident, symbol_id(0), pos, len});
+    }
+    return true;
+}
+
+bool tokenizer::check_punct(const char*& str, const char* end, context& ctx) const
+{
+    if(!char_is(*str, Char_Punct)) return false;
+
+    // a longer punctuation may be completed by the next chunk
+    if(ctx.more_input && (size_t(end - str) < m_punctuation_index.max_len))
+    {
+        ctx.partial = str;
+        return true;
+    }
+
+    unsigned found;
+
+    const size_t len = m_punctuation_index.match(str, end, found);
+
     if(len == 0)
     {
-        ctx.err = parse_error::UnknownPunctuation;
-        ctx.pos = str;
-        return true;
+        ctx.err = parse_error::UnknownPunctuation;
+        ctx.pos = str;
+        return true;
+    }
+
+    const size_t pos = ctx.offset + size_t(str - ctx.begin);
+
+    ctx.add({token_type::punctuation, m_punctuations[found - 1].id, pos, len});
+
+    str += len;
+
+    return true;
+}
+
+parse_error tokenizer::extract_token_number(const char* str, const token_data& token, float& number)
+{
+    Check_ValidArg(str != nullptr, parse_error::InvalidArguments);
+
+    if(token.type != token_type::number) return parse_error::WrongTokenType;
+
+    const char* start = str + token.pos;
+    char* end;
+    number = std::strtof(start, &end);
+
+    Assert_Check(size_t(end - start) == token.len);
+
+    return parse_error::None;
+}
+parse_error tokenizer::extract_token_number(const char* str, const token_data& token, double& number)
+{
+    Check_ValidArg(str != nullptr, parse_error::InvalidArguments);
+
+    if(token.type != token_type::number) return parse_error::WrongTokenType;
+
+    const char* start = str + token.pos;
+    char* end;
+    number = std::strtod(start, &end);
+
+    Assert_Check(size_t(end - start) == token.len);
+
+    return parse_error::None;
+}
+parse_error tokenizer::extract_token_string(
+    const char* str,
+    const token_data& token,
+    std::string& out,
+    bool unescape,
+    bool addQuotes
+    )
+{
+    Check_ValidArg(str != nullptr, parse_error::InvalidArguments);
+
+    if(token.type != token_type::string) return parse_error::WrongTokenType;
+
+    const char* start = str + token.pos;
+    const char* end   = str + token.pos + token.len;
+
+    if(!addQuotes)
+    {
+        ++start;
+        --end;
+    }
+    if(!unescape)
+    {
+        out = std::string(start, end);
+    }
+    else
+    {
+        out.clear();
+        out.reserve(token.len + 1);
+        for(const char* pch = start; pch < end; ++pch)
+        {
+            if(pch[0] == '\\')
+            {
+                switch(pch[1])
+                {
+                    case '\\': case '\?':
+                    case '\"': case '\'':
+                        ++pch;
+                        break;
+                }
+            }
+            out += *pch;
+        }
+    }
+    return parse_error::None;
+}
+
+std::string tokenizer::stringize_tokens(
+    const char* str,
+    const token_data* token_begin,
+    const token_data* token_end
+    )
+{
+    Check_ValidArg(str         != nullptr, {});
+    Check_ValidArg(token_begin != nullptr, {});
+    Check_ValidArg(token_end   != nullptr, {});
+
+    std::string out;
+    out.reserve(size_t(token_end->len + token_end->pos - token_begin->pos));
+
+    for(const token_data* token = token_begin; token <= token_end; ++token)
+    {
+        out.append(str + token->pos, token->len);
+    }
+
+    return out;
+}
+
+parse_error tokenizer::extract_token_number(const char* str, const compact_tokens& tokens, size_t index, float& number)
+{
+    Check_ValidArg(index < tokens.size(), parse_error::InvalidArguments);
+
+    return extract_token_number(str, tokens[index], number);
+}
+parse_error tokenizer::extract_token_number(const char* str, const compact_tokens& tokens, size_t index, double& number)
+{
+    Check_ValidArg(index < tokens.size(), parse_error::InvalidArguments);
+
+    return extract_token_number(str, tokens[index], number);
+}
+parse_error tokenizer::extract_token_string(
+    const char* str,
+    const compact_tokens& tokens,
+    size_t index,
+    std::string& out,
+    bool unescape,
+    bool addQuotes
+    )
+{
+    Check_ValidArg(index < tokens.size(), parse_error::InvalidArguments);
+
+    return extract_token_string(str, tokens[index], out, unescape, addQuotes);
+}
+
+std::string tokenizer::stringize_tokens(
+    const char* str,
+    const compact_tokens& tokens,
+    size_t first_index,
+    size_t last_index
+    )
+{
+    Check_ValidArg(str != nullptr, {});
+    Check_ValidArg((first_index <= last_index) && (last_index < tokens.size()), {});
+
+    std::string out;
+    out.reserve(size_t(tokens.positions[last_index] + tokens.lengths[last_index] - tokens.positions[first_index]));
+
+    for(size_t index = first_index; index <= last_index; ++index)
+    {
+        out.append(str + tokens.positions[index], tokens.lengths[index]);
+    }
+
+    return out;
+}
+
+void grammar::clear()
+{
+    m_start_index = npos;
+
+    m_chunks .clear();
+    m_rules  .clear();
+    m_symbols.clear();
+
+    m_loop_ends          .clear();
+    m_keyword_classes    .clear();
+    m_punctuation_classes.clear();
+    m_rule_first         .clear();
+    m_rule_nullable      .clear();
+    m_dispatch           .clear();
+    m_dispatch_rules     .clear();
+    m_ll1_table          .clear();
+    m_ll1_loop_first     .clear();
+    m_code               .clear();
+    m_rule_code          .clear();
+    m_loop_code          .clear();
+    m_inline_sets        .clear();
+    m_earley_code        .clear();
+    m_earley_productions .clear();
+    m_earley_nonterminals.clear();
+    m_earley_empty       .clear();
+
+    m_engine = grammar_engine::backtracking;
+}
+
+rule grammar::add_rule(symbol_id id)
+{
+    return add(id);
+}
+
+result_t grammar::prepare(symbol_id start_id, grammar_engine engine, unsigned optimizations)
+{
+    m_start_index = npos;
+    m_engine      = grammar_engine::backtracking;
+
+    m_optimization_report = {m_chunks.size(), m_chunks.size(), 0, 0, 0, 0, 0};
+
+    result_t result = prepare_rules();
+
+    if(!result) return result;
+
+    m_optimization_report.rules_before = m_rules.size();
+    m_optimization_report.rules_after  = m_rules.size();
+
+    if(find_symbol_with_id(start_id) == npos)
+    {
+        return {parse_error::SymbolWithoutRule, start_id, 0};
+    }
+    if(optimizations != Optimize_None)
+    {
+        optimize_rules(start_id, optimizations);
+
+        result = prepare_rules();
+
+        if(!result) return result;
+
+        m_optimization_report.chunks_after = m_chunks.size();
+        m_optimization_report.rules_after  = m_rules.size();
+    }
+    m_start_index = find_symbol_with_id(start_id);
+
+    return prepare_engine(start_id, engine);
+}
+
+// the rules and symbols of the chunks, the symbol chunks become rule chunks with the index of their symbol
+result_t grammar::prepare_rules()
+{
+    m_rules  .clear();
+    m_symbols.clear();
+
+    size_t prev_rule_index = npos;
+    size_t loops_count     = 0;
+
+    for(size_t index = 0; index < m_chunks.size(); ++index)
+    {
+        const chunk_data& chunk = m_chunks[index];
+
+        switch(chunk.type)
+        {
+            default: continue;
+
+            case chunk_type::start: break;
+
+            case chunk_type::loop:
+                if((chunk.arg2 == 0) || (chunk.arg2 < chunk.arg1))
+                {
+                    return {parse_error::InvalidLoopArguments, chunk.id, 0};
+                }
+                ++loops_count;
+                continue;
+
+            case chunk_type::next:
+                if(loops_count == 0)
+                {
+                    return {parse_error::NextWithoutLoop, chunk.id, 0};
+                }
+                --loops_count;
+                continue;
+        }
+        if(prev_rule_index != npos)
+        {
+            Assert_Check(index > 0);
+            m_rules[prev_rule_index].last_chunk = (index - 1);
+        }
+        if(loops_count != 0)
+        {
+            return {parse_error::MismatchLoopNextPairs, chunk.id, 0};
+        }
+        prev_rule_index = m_rules.size();
+
+        m_rules.push_back({chunk.id, 0, index + 1, npos});
+    }
+    if(loops_count != 0)
+    {
+        return {parse_error::MismatchLoopNextPairs, symbol_id(0), 0};
+    }
+    if(prev_rule_index != npos)
+    {
+        Assert_Check(m_chunks.size() > 0);
+        m_rules[prev_rule_index].last_chunk = (m_chunks.size() - 1);
+    }
+    // one sort for all symbols - the rules of a symbol keep the order they were added in
+    std::stable_sort(m_rules.begin(), m_rules.end(), [] (const rule_data& a, const rule_data& b) { return (a.id < b.id); });
+
+    for(size_t index = 0; index < m_rules.size(); ++index)
+    {
+        rule_data& rule = m_rules[index];
+
+        if(m_symbols.empty() || (m_symbols.back().id != rule.id))
+        {
+            m_symbols.push_back({rule.id, index, index});
+        }
+        symbol_data& symbol = m_symbols.back();
+
+        rule.order       = unsigned(index - symbol.first_rule);
+        symbol.last_rule = index;
+    }
+
+    for(chunk_data& chunk : m_chunks)
+    {
+        if(chunk.type != chunk_type::symbol) continue;
+
+        const size_t index = find_symbol_with_id(chunk.id);
+
+        if(index == npos)
+        {
+            return {parse_error::SymbolWithoutRule, chunk.id, 0};
+        }
+        chunk.type = chunk_type::rule;
+        chunk.arg1 = index;
+    }
+    return {parse_error::None, symbol_id(0), 0};
+}
+
+//
+// Optimizer - rewrites of the rules that keep the tokens accepted by check(). The engine is a PEG: a rule matches at most
+// one way at a position, so alternatives with a common prefix match it the same way and may share one match of it,
+// nested alternatives may be flattened, and greedy loops of a body that always consumes tokens may be split and merged.
+//
+
+void grammar::optimize_rules(symbol_id start_id, unsigned optimizations)
+{
+    std::vector<symbol_rules> symbols;
+
+    for(const symbol_data& symbol : m_symbols)
+    {
+        symbols.push_back({symbol.id, {}, false});
+
+        for(size_t rule_index = symbol.first_rule; rule_index <= symbol.last_rule; ++rule_index)
+        {
+            const rule_data& rule = m_rules[rule_index];
+
+            chunks_t chunks(m_chunks.begin() + std::ptrdiff_t(rule.first_chunk), m_chunks.begin() + std::ptrdiff_t(rule.last_chunk + 1));
+
+            for(chunk_data& chunk : chunks)
+            {
+                if(chunk.type == chunk_type::rule) chunk = {chunk_type::symbol, m_symbols[chunk.arg1].id, 0, 0};
+            }
+            symbols.back().rules.push_back(std::move(chunks));
+        }
+    }
+
+    if((optimizations & Optimize_Unit_Rules) != 0)
+    {
+        inline_unit_rules(symbols, start_id);
+    }
+    if((optimizations & Optimize_Left_Factoring) != 0)
+    {
+        update_nullable(symbols);
+        factor_rules(symbols);
+    }
+    if((optimizations & Optimize_Loops) != 0)
+    {
+        update_nullable(symbols);
+
+        for(symbol_rules& symbol : symbols)
+        {
+            for(chunks_t& rule : symbol.rules) merge_loops(rule, symbols);
+        }
+    }
+
+    m_chunks.clear();
+
+    for(const symbol_rules& symbol : symbols)
+    {
+        for(const chunks_t& rule : symbol.rules)
+        {
+            m_chunks.push_back({chunk_type::start, symbol.id, 0, 0});
+            m_chunks.insert(m_chunks.end(), rule.begin(), rule.end());
+        }
+    }
+}
+
+// A symbol whose only rule calls another symbol is replaced by that symbol. An alternative that only calls a symbol
+// used nowhere else gets the rules of that symbol in its place - ordered choice is associative, A / B with A -> a1 / a2
+// tries the same rules in the same order as a1 / a2 / B.
+void grammar::inline_unit_rules(std::vector<symbol_rules>& symbols, symbol_id start_id)
+{
+    auto references = [&symbols](symbol_id id)
+    {
+        size_t count = 0;
+
+        for(const symbol_rules& symbol : symbols)
+        {
+            for(const chunks_t& rule : symbol.rules)
+            {
+                for(const chunk_data& chunk : rule) count += ((chunk.type == chunk_type::symbol) && (chunk.id == id)) ? 1 : 0;
+            }
+        }
+        return count;
+    };
+
+    // every change removes a symbol and the search starts over
+    for(bool changed = true; changed; )
+    {
+        changed = false;
+
+        for(size_t index = 0; !changed && (index < symbols.size()); ++index)
+        {
+            symbol_rules& symbol = symbols[index];
+
+            for(size_t rule_index = 0; rule_index < symbol.rules.size(); ++rule_index)
+            {
+                const chunks_t& rule = symbol.rules[rule_index];
+
+                if((rule.size() != 1) || (rule[0].type != chunk_type::symbol) || (rule[0].id == symbol.id)) continue;
+
+                const symbol_id target_id = rule[0].id;
+
+                if((symbol.rules.size() == 1) && (symbol.id != start_id))
+                {
+                    for(symbol_rules& other : symbols)
+                    {
+                        for(chunks_t& other_rule : other.rules)
+                        {
+                            for(chunk_data& chunk : other_rule)
+                            {
+                                if((chunk.type == chunk_type::symbol) && (chunk.id == symbol.id)) chunk.id = target_id;
+                            }
+                        }
+                    }
+                    symbols.erase(symbols.begin() + std::ptrdiff_t(index));
+                }
+                else
+                {
+                    const size_t target = find_rules(symbols, target_id);
+
+                    if((target_id == start_id) || (target == npos) || (references(target_id) != 1)) continue;
+
+                    std::vector<chunks_t> target_rules = std::move(symbols[target].rules);
+
+                    symbol.rules.erase(symbol.rules.begin() + std::ptrdiff_t(rule_index));
+                    symbol.rules.insert(
+                        symbol.rules.begin() + std::ptrdiff_t(rule_index),
+                        std::make_move_iterator(target_rules.begin()),
+                        std::make_move_iterator(target_rules.end()));
+
+                    symbols.erase(symbols.begin() + std::ptrdiff_t(target));
+                }
+                ++m_optimization_report.inlined_symbols;
+
+                changed = true;
+                break;
+            }
+        }
+    }
+}
+
+// Neighbour alternatives that start with the same items become one alternative - the common prefix followed by a new
+// symbol with the rest of each of them as its rules (p a / p b is p (a / b) when p matches one way). Alternatives that
+// start with loops of the same body that always consumes tokens share the repeats all of them need first - loop(m, n)
+// is loop(k, k) followed by loop(m - k, n - k). A rest that is empty always passes, the alternatives after it are
+// never tried and are dropped; p (a / empty) is written as p loop(0, 1) a next. The new symbols are factored as well.
+// A prefix that may match no tokens is left alone - the alternatives are tried by their first tokens (prepare_dispatch)
+// and with such p the new alternative p (a / empty) would be tried for tokens that p a was never tried for.
+void grammar::factor_rules(std::vector<symbol_rules>& symbols)
+{
+    auto repeats = [](const chunk_data& loop, size_t split) { return (loop.arg2 == npos) ? npos : (loop.arg2 - split); };
+
+    for(size_t index = 0; index < symbols.size(); ++index)
+    {
+        // a copy - the symbol keeps its rules for the nullable symbols while the new symbols are added
+        const std::vector<chunks_t> rules = symbols[index].rules;
+
+        std::vector<chunks_t> factored;
+
+        for(size_t first = 0; first < rules.size(); )
+        {
+            const chunks_t& head = rules[first];
+
+            const size_t head_end = head.empty() ? 0 : item_end(head, 0);
+
+            auto same_head = [&head, head_end](const chunks_t& rule, size_t from)
+            {
+                return (rule.size() >= head_end) && (item_end(rule, 0) == head_end) && same_chunks(&rule[from], &head[from], head_end - from);
+            };
+
+            size_t last  = first + 1;
+            size_t split = 0; // repeats shared by the first loops of the alternatives, 0 - the first items are the same
+
+            while((last < rules.size()) && (head_end != 0) && !rules[last].empty() && same_head(rules[last], 0)) ++last;
+
+            const bool split_loops = (last == first + 1) && (head_end != 0) && (head[0].type == chunk_type::loop) && (head[0].arg1 != 0) &&
+                !items_nullable(symbols, head, 1, head_end - 1);
+
+            if(split_loops)
+            {
+                split = head[0].arg1;
+
+                for( ; (last < rules.size()) && !rules[last].empty() && (rules[last][0].type == chunk_type::loop) && (rules[last][0].arg1 != 0) && same_head(rules[last], 1); ++last)
+                {
+                    split = std::min(split, rules[last][0].arg1);
+                }
+            }
+            // the new symbol needs an id above all the others
+            if((last == first + 1) || (int(symbols.back().id) == std::numeric_limits<int>::max()))
+            {
+                factored.push_back(rules[first++]);
+                continue;
+            }
+
+            chunks_t              prefix;
+            std::vector<chunks_t> rests;
+
+            if(split == 0)
+            {
+                size_t length = head_end;
+
+                for(bool same = true; same && (length < head.size()); )
+                {
+                    const size_t end = item_end(head, length);
+
+                    for(size_t other = first + 1; same && (other < last); ++other)
+                    {
+                        const chunks_t& rule = rules[other];
+
+                        same = (length < rule.size()) && (item_end(rule, length) == end) && same_chunks(&rule[length], &head[length], end - length);
+                    }
+                    if(same) length = end;
+                }
+                if(items_nullable(symbols, head, 0, length))
+                {
+                    factored.insert(factored.end(), rules.begin() + std::ptrdiff_t(first), rules.begin() + std::ptrdiff_t(last));
+
+                    first = last;
+                    continue;
+                }
+                prefix.insert(prefix.end(), head.begin(), head.begin() + std::ptrdiff_t(length));
+
+                for(size_t other = first; other < last; ++other)
+                {
+                    rests.emplace_back(rules[other].begin() + std::ptrdiff_t(length), rules[other].end());
+                }
+            }
+            else
+            {
+                prefix.insert(prefix.end(), head.begin(), head.begin() + std::ptrdiff_t(head_end));
+                prefix.front() = {chunk_type::loop, symbol_id(0), split, split};
+
+                for(size_t other = first; other < last; ++other)
+                {
+                    const chunks_t& rule = rules[other];
+
+                    chunks_t rest;
+
+                    if(repeats(rule[0], split) != 0)
+                    {
+                        rest.insert(rest.end(), rule.begin(), rule.begin() + std::ptrdiff_t(head_end));
+                        rest.front() = {chunk_type::loop, symbol_id(0), rule[0].arg1 - split, repeats(rule[0], split)};
+                    }
+                    rest.insert(rest.end(), rule.begin() + std::ptrdiff_t(head_end), rule.end());
+
+                    rests.push_back(std::move(rest));
+                }
+            }
+            m_optimization_report.factored_alternatives += (last - first);
+
+            for(size_t rest = 0; rest < rests.size(); ++rest)
+            {
+                if(rests[rest].empty())
+                {
+                    rests.resize(rest + 1);
+                    break;
+                }
+            }
+            if(rests.front().empty())
+            {
+                // the prefix alone
+            }
+            else if((rests.size() == 2) && rests.back().empty())
+            {
+                prefix.push_back({chunk_type::loop, symbol_id(0), 0, 1});
+                prefix.insert(prefix.end(), rests.front().begin(), rests.front().end());
+                prefix.push_back({chunk_type::next, symbol_id(0), 0, 0});
+            }
+            else
+            {
+                const symbol_id id = symbol_id(int(symbols.back().id) + 1);
+
+                prefix.push_back({chunk_type::symbol, id, 0, 0});
+
+                symbols.push_back({id, std::move(rests), false});
+
+                update_nullable(symbols);
+            }
+            factored.push_back(std::move(prefix));
+
+            first = last;
+        }
+        symbols[index].rules = std::move(factored);
+    }
+}
+
+// loop(1, 1) is its body. A loop of a body that always consumes tokens takes the repeats of a loop of the same body
+// right before it when that loop has a fixed count (loop(k, k) matches exactly k bodies, the loop after it continues
+// the same greedy repeats), or one repeat more when the body itself is right before it. A loop after an unbounded loop
+// of the same body never gets a repeat, it is dropped when it needs none.
+void grammar::merge_loops(chunks_t& chunks, const std::vector<symbol_rules>& symbols)
+{
+    auto add = [](size_t a, size_t b) { return ((a == npos) || (b == npos) || (a + b < a)) ? npos : (a + b); };
+
+    chunks_t            merged;
+    std::vector<size_t> starts; // where the items of merged start
+
+    for(size_t index = 0; index < chunks.size(); )
+    {
+        const size_t end = item_end(chunks, index);
+
+        if(chunks[index].type != chunk_type::loop)
+        {
+            starts.push_back(merged.size());
+            merged.push_back(chunks[index]);
+
+            index = end;
+            continue;
+        }
+        chunk_data loop = chunks[index];
+        chunks_t   body(chunks.begin() + std::ptrdiff_t(index + 1), chunks.begin() + std::ptrdiff_t(end - 1));
+
+        merge_loops(body, symbols);
+
+        index = end;
+
+        if((loop.arg1 == 1) && (loop.arg2 == 1))
+        {
+            for(size_t at = 0; at < body.size(); at = item_end(body, at)) starts.push_back(merged.size() + at);
+
+            merged.insert(merged.end(), body.begin(), body.end());
+
+            ++m_optimization_report.merged_loops;
+            continue;
+        }
+        if(!body.empty() && !items_nullable(symbols, body, 0, body.size()) && !starts.empty())
+        {
+            chunk_data& before = merged[starts.back()];
+
+            const bool same_loop = (before.type == chunk_type::loop) && (merged.size() - starts.back() == body.size() + 2) &&
+                same_chunks(&before + 1, body.data(), body.size());
+
+            if(same_loop && (before.arg1 == before.arg2))
+            {
+                before.arg1 += loop.arg1;
+                before.arg2  = add(before.arg2, loop.arg2);
+
+                ++m_optimization_report.merged_loops;
+                continue;
+            }
+            if(same_loop && (before.arg2 == npos) && (loop.arg1 == 0))
+            {
+                ++m_optimization_report.merged_loops;
+                continue;
+            }
+
+            const size_t body_start = merged.size() - std::min(merged.size(), body.size());
+
+            if((merged.size() >= body.size()) && std::binary_search(starts.begin(), starts.end(), body_start) &&
+                same_chunks(&merged[body_start], body.data(), body.size()))
+            {
+                merged.resize(body_start);
+                starts.erase(std::lower_bound(starts.begin(), starts.end(), body_start), starts.end());
+
+                loop.arg1 += 1;
+                loop.arg2  = add(loop.arg2, 1);
+
+                ++m_optimization_report.merged_loops;
+            }
+        }
+        starts.push_back(merged.size());
+
+        merged.push_back(loop);
+        merged.insert(merged.end(), body.begin(), body.end());
+        merged.push_back({chunk_type::next, symbol_id(0), 0, 0});
+    }
+    chunks.swap(merged);
+}
+
+size_t grammar::find_rules(const std::vector<symbol_rules>& symbols, symbol_id id)
+{
+    auto it = std::lower_bound(symbols.begin(), symbols.end(), id, [] (const symbol_rules& symbol, symbol_id other) { return (symbol.id < other); });
+
+    return ((it != symbols.end()) && (it->id == id)) ? size_t(it - symbols.begin()) : npos;
+}
+
+void grammar::update_nullable(std::vector<symbol_rules>& symbols)
+{
+    for(symbol_rules& symbol : symbols) symbol.nullable = false;
+
+    for(bool changed = true; changed; )
+    {
+        changed = false;
+
+        for(symbol_rules& symbol : symbols)
+        {
+            if(symbol.nullable) continue;
+
+            for(const chunks_t& rule : symbol.rules)
+            {
+                if(items_nullable(symbols, rule, 0, rule.size()))
+                {
+                    symbol.nullable = true;
+                    changed         = true;
+                    break;
+                }
+            }
+        }
+    }
+}
+
+// whether the items [first, last) may pass without consuming tokens
+bool grammar::items_nullable(const std::vector<symbol_rules>& symbols, const chunks_t& chunks, size_t first, size_t last)
+{
+    for(size_t index = first; index < last; index = item_end(chunks, index))
+    {
+        const chunk_data& chunk = chunks[index];
+
+        switch(chunk.type)
+        {
+            case chunk_type::symbol:
+                {
+                    const size_t symbol = find_rules(symbols, chunk.id);
+
+                    if((symbol == npos) || !symbols[symbol].nullable) return false;
+                }
+                break;
+
+            case chunk_type::loop:
+                if((chunk.arg1 != 0) && !items_nullable(symbols, chunks, index + 1, item_end(chunks, index) - 1)) return false;
+                break;
+
+            default: return false;
+        }
+    }
+    return true;
+}
+
+// the index after the item that starts at index - a terminal, a symbol or a whole loop
+size_t grammar::item_end(const chunks_t& chunks, size_t index)
+{
+    for(size_t depth = 0; index < chunks.size(); )
+    {
+        switch(chunks[index++].type)
+        {
+            case chunk_type::loop: ++depth; break;
+            case chunk_type::next: --depth; break;
+            default: break;
+        }
+        if(depth == 0) return index;
+    }
+    return index;
+}
+
+bool grammar::same_chunks(const chunk_data* a, const chunk_data* b, size_t count)
+{
+    for(size_t index = 0; index < count; ++index)
+    {
+        if((a[index].type != b[index].type) || (a[index].id != b[index].id) || (a[index].arg1 != b[index].arg1) || (a[index].arg2 != b[index].arg2)) return false;
+    }
+    return true;
+}
+
+result_t grammar::prepare_engine(symbol_id start_id, grammar_engine engine)
+{
+    if(!prepare_loops())
+    {
+        m_start_index = npos;
+
+        return {parse_error::MismatchLoopNextPairs, start_id, 0};
+    }
+    prepare_terminal_classes();
+    prepare_first_sets();
+    prepare_dispatch();
+
+    if(engine == grammar_engine::earley)
+    {
+        m_engine = grammar_engine::earley;
+    }
+    else if(engine != grammar_engine::backtracking)
+    {
+        if(prepare_ll1())
+        {
+            m_engine = grammar_engine::ll1;
+        }
+        else if(engine == grammar_engine::ll1)
+        {
+            m_start_index = npos;
+
+            return {parse_error::GrammarNotLL1, start_id, 0};
+        }
+    }
+
+    prepare_code();
+    prepare_earley();
+
+    return {parse_error::None, symbol_id(0), 0};
+}
+
+void grammar::prepare_code()
+{
+    m_inline_sets.assign(m_symbols.size() * m_class_words, 0);
+    m_code       .assign(code_size(m_rules.data(), m_rules.size()), {op_code::ret, 0, 0, 0});
+    m_rule_code  .assign(m_rules.size(), 0);
+    m_loop_code  .assign(loops_count(m_chunks.data(), m_chunks.size()), {0, 0, 0, npos});
+
+    build_code(*this);
+}
+
+// A body of at most this many instructions is repeated in place in the productions, longer ones go to helpers
+static constexpr size_t earley_unrolled_slots = 16;
+
+void grammar::prepare_earley()
+{
+    m_earley_code        .clear();
+    m_earley_productions .clear();
+    m_earley_nonterminals.clear();
+    m_earley_empty       .clear();
+
+    if(m_engine != grammar_engine::earley) return;
+
+    std::vector<std::vector<instruction>> rule_slots(m_rules.size());
+    std::vector<earley_rules_t>           helpers;
+
+    for(size_t rule_index = 0; rule_index < m_rules.size(); ++rule_index)
+    {
+        lower_earley(m_rules[rule_index].first_chunk, m_rules[rule_index].last_chunk + 1, rule_slots[rule_index], helpers);
+    }
+
+    auto add_production = [this](size_t nonterminal, const std::vector<instruction>& slots)
+    {
+        m_earley_code.insert(m_earley_code.end(), slots.begin(), slots.end());
+        m_earley_code.push_back({op_code::ret, 0, 0, std::uint32_t(m_earley_productions.size())});
+
+        m_earley_productions.push_back({nonterminal, m_earley_code.size() - slots.size() - 1});
+    };
+
+    for(size_t symbol_index = 0; symbol_index < m_symbols.size(); ++symbol_index)
+    {
+        m_earley_nonterminals.push_back(m_earley_productions.size());
+
+        for(size_t rule_index = m_symbols[symbol_index].first_rule; rule_index <= m_symbols[symbol_index].last_rule; ++rule_index)
+        {
+            add_production(symbol_index, rule_slots[rule_index]);
+        }
+    }
+    for(size_t helper = 0; helper < helpers.size(); ++helper)
+    {
+        m_earley_nonterminals.push_back(m_earley_productions.size());
+
+        for(const std::vector<instruction>& slots : helpers[helper]) add_production(m_symbols.size() + helper, slots);
+    }
+    m_earley_nonterminals.push_back(m_earley_productions.size());
+
+    prepare_earley_empty();
+}
+
+// the first production found to match no tokens calls only nonterminals found before it, so following the productions
+// of m_earley_empty never comes back to a nonterminal
+void grammar::prepare_earley_empty()
+{
+    m_earley_empty.assign(m_earley_nonterminals.size() - 1, npos);
+
+    for(bool changed = true; changed; )
+    {
+        changed = false;
+
+        for(size_t production = 0; production < m_earley_productions.size(); ++production)
+        {
+            const size_t nonterminal = m_earley_productions[production].nonterminal;
+
+            if(m_earley_empty[nonterminal] != npos) continue;
+
+            size_t slot = m_earley_productions[production].code;
+
+            while((m_earley_code[slot].op == op_code::call) && (m_earley_empty[m_earley_code[slot].arg] != npos)) ++slot;
+
+            if(m_earley_code[slot].op != op_code::ret) continue;
+
+            m_earley_empty[nonterminal] = production;
+            changed                     = true;
+        }
+    }
+}
+
+// the chunks [first_chunk, end_chunk) as instructions of a production, the loops become helper nonterminals
+void grammar::lower_earley(size_t first_chunk, size_t end_chunk, std::vector<instruction>& slots, std::vector<earley_rules_t>& helpers) const
+{
+    for(size_t index = first_chunk; index < end_chunk; ++index)
+    {
+        const chunk_data& chunk = m_chunks[index];
+
+        switch(chunk.type)
+        {
+            case chunk_type::ident      :
+            case chunk_type::string     :
+            case chunk_type::number     : slots.push_back({op_code::match_type, std::uint8_t(chunk.type), 0, 0}); break;
+
+            case chunk_type::keyword    :
+            case chunk_type::punctuation: slots.push_back({op_code::match_id, std::uint8_t(chunk.type), 0, std::uint32_t(chunk.id)}); break;
+
+            case chunk_type::rule: slots.push_back({op_code::call, 0, 0, std::uint32_t(chunk.arg1)}); break;
+
+            case chunk_type::loop:
+                {
+                    std::vector<instruction> body;
+
+                    lower_earley(index + 1, m_loop_ends[index], body, helpers);
+
+                    // a loop of an empty body matches no tokens however many times it repeats
+                    if(!body.empty()) lower_earley_loop(chunk, body, slots, helpers);
+
+                    index = m_loop_ends[index];
+                }
+                break;
+
+            default: Assert_Fail(); break;
+        }
+    }
+}
+
+// loop(min, max) is the body min times followed by max - min optional bodies. The counts are taken apart into powers
+// of two, so a loop takes helpers by the logarithm of its counts: the body 2^k times is the body 2^(k-1) times twice,
+// min repeats are the powers of its bits and the optional ones are optional powers 1, 2, 4 ... and an optional rest.
+// A loop without max ends with a left-recursive helper, which Earley matches in linear time. Bounded loops are linear
+// as well, yet a set keeps an item for every power the repeats so far may be split into - some 130 items per set for
+// loop(3, 100000) against a few for loop(0), which makes such a loop some 50 to 80 times slower per token.
+void grammar::lower_earley_loop(const chunk_data& loop, const std::vector<instruction>& body, std::vector<instruction>& slots, std::vector<earley_rules_t>& helpers) const
+{
+    auto optional = [this, &helpers](const std::vector<instruction>& repeats)
+    {
+        return instruction {op_code::call, 0, 0, std::uint32_t(add_earley_helper({{}, repeats}, helpers))};
+    };
+
+    std::vector<std::vector<instruction>> powers {body}; // powers[k] - the body 2^k times
+
+    size_t required  = loop.arg1;
+    size_t optionals = (loop.arg2 == npos) ? 0 : (loop.arg2 - loop.arg1);
+
+    for(size_t bit = 0, weight = 1; ; ++bit, weight *= 2)
+    {
+        const std::vector<instruction>& power = powers[bit];
+
+        if((required & weight) != 0) slots.insert(slots.end(), power.begin(), power.end());
+
+        if(optionals >= weight)
+        {
+            slots.push_back(optional(power));
+            optionals -= weight;
+        }
+        // min has no higher bits and the optionals left are less than the next power - they are taken by their bits
+        if(((required >> bit) <= 1) && ((optionals / 2) < weight))
+        {
+            std::vector<instruction> rest;
+
+            for(size_t rest_bit = 0; rest_bit <= bit; ++rest_bit)
+            {
+                if((optionals & (size_t(1) << rest_bit)) != 0) rest.insert(rest.end(), powers[rest_bit].begin(), powers[rest_bit].end());
+            }
+            if(!rest.empty()) slots.push_back(optional(rest));
+            break;
+        }
+
+        std::vector<instruction> twice(power);
+        twice.insert(twice.end(), power.begin(), power.end());
+
+        if(twice.size() > earley_unrolled_slots)
+        {
+            twice = {{op_code::call, 0, 0, std::uint32_t(add_earley_helper({twice}, helpers))}};
+        }
+        powers.push_back(std::move(twice));
+    }
+
+    if(loop.arg2 == npos)
+    {
+        // the repeats after min: helper -> (nothing) | helper body
+        const std::uint32_t helper = std::uint32_t(m_symbols.size() + helpers.size());
+
+        std::vector<instruction> repeat {{op_code::call, 0, 0, helper}};
+        repeat.insert(repeat.end(), body.begin(), body.end());
+
+        add_earley_helper({{}, std::move(repeat)}, helpers);
+
+        slots.push_back({op_code::call, 0, 0, helper});
+    }
+}
+
+size_t grammar::add_earley_helper(earley_rules_t&& rules, std::vector<earley_rules_t>& helpers) const
+{
+    helpers.push_back(std::move(rules));
+
+    return m_symbols.size() + helpers.size() - 1;
+}
+
+// pairs every loop with its next - fails when a loop is not closed in its rule, so the FIRST sets and the bytecode
+// never meet a loop without an end
+bool grammar::prepare_loops()
+{
+    m_loop_ends.assign(m_chunks.size(), npos);
+
+    return build_loops(*this);
+}
+
+void grammar::prepare_terminal_classes()
+{
+    m_keyword_classes    .assign(terminal_ids(m_chunks.data(), m_chunks.size(), chunk_type::keyword    ), unsigned(Class_Other));
+    m_punctuation_classes.assign(terminal_ids(m_chunks.data(), m_chunks.size(), chunk_type::punctuation), unsigned(Class_Other));
+
+    build_terminal_classes(*this);
+}
+
+template<class Token>
+size_t grammar::terminal_class(const Token* token, const Token* end) const
+{
+    if(token >= end) return Class_End;
+
+    const prepared_table<unsigned>* classes;
+
+    switch(token->type)
+    {
+        case token_type::ident : return Class_Ident;
+        case token_type::string: return Class_String;
+        case token_type::number: return Class_Number;
+
+        case token_type::keyword    : classes = &m_keyword_classes    ; break;
+        case token_type::punctuation: classes = &m_punctuation_classes; break;
+
+        default: return Class_Other;
+    }
+    const size_t id = size_t(unsigned(token->id));
+
+    return (id < classes->size()) ? (*classes)[id] : size_t(Class_Other);
+}
+
+size_t grammar::terminal_class(const chunk_data& chunk) const
+{
+    return chunk_class(*this, chunk);
+}
+
+void grammar::prepare_first_sets()
+{
+    m_rule_first   .assign(m_rules.size() * m_class_words, 0);
+    m_rule_nullable.assign(m_rules.size(), 0);
+
+    std::vector<std::uint64_t> first(m_class_words);
+
+    build_first_sets(*this, first.data());
+}
+
+void grammar::prepare_dispatch()
+{
+    m_dispatch      .assign(m_symbols.size() * m_classes_count + 1, 0);
+    m_dispatch_rules.clear();
+
+    m_dispatch_rules.assign(build_dispatch(*this), 0);
+
+    build_dispatch(*this);
+}
+
+// accumulates the classes of the second token matched by chunks [first_chunk, last_chunk] - the ones that may follow
+// the first token - and returns whether the chunks may pass with exactly one token; rule_second and rule_one are the
+// same of every rule, as far as the fixpoint of prepare_second_sets got
+bool grammar::sequence_second(
+    size_t first_chunk,
+    size_t last_chunk,
+    const std::vector<std::uint64_t>& rule_second,
+    const std::vector<char>& rule_one,
+    std::uint64_t* second
+    )
+    const
+{
+    const size_t words = m_class_words;
+
+    auto add = [words](std::uint64_t* set, const std::uint64_t* other)
+    {
+        for(size_t word = 0; word < words; ++word) set[word] |= other[word];
+    };
+
+    bool zero = true;   // the chunks so far may pass without tokens
+    bool one  = false;  // the chunks so far may pass with exactly one token
+
+    for(size_t index = first_chunk; (index <= last_chunk) && (zero || one); ++index)
+    {
+        const chunk_data& chunk = m_chunks[index];
+
+        bool chunk_zero = false;
+        bool chunk_one  = false;
+
+        switch(chunk.type)
+        {
+            case chunk_type::rule:
+                {
+                    const symbol_data& symbol = m_symbols[chunk.arg1];
+
+                    for(size_t rule_index = symbol.first_rule; rule_index <= symbol.last_rule; ++rule_index)
+                    {
+                        if(one ) add(second, &m_rule_first[rule_index * words]);
+                        if(zero) add(second, &rule_second [rule_index * words]);
+
+                        chunk_zero = chunk_zero || (m_rule_nullable[rule_index] != 0);
+                        chunk_one  = chunk_one  || (rule_one[rule_index] != 0);
+                    }
+                }
+                break;
+
+            case chunk_type::loop:
+                {
+                    const size_t next_index = m_loop_ends[index];
+
+                    std::vector<std::uint64_t> body_first (words, 0);
+                    std::vector<std::uint64_t> body_second(words, 0);
+
+                    const bool body_zero = sequence_first (*this, index + 1, next_index - 1, body_first.data());
+                    const bool body_one  = sequence_second(index + 1, next_index - 1, rule_second, rule_one, body_second.data());
+
+                    // an iteration of one token may be followed by another iteration
+                    if(body_one && (chunk.arg2 > 1)) add(body_second.data(), body_first.data());
+
+                    if(one ) add(second, body_first .data());
+                    if(zero) add(second, body_second.data());
+
+                    chunk_zero = body_zero || (chunk.arg1 == 0);
+                    chunk_one  = body_one;
+
+                    index = next_index;
+                }
+                break;
+
+            default:
+                {
+                    const size_t cls = terminal_class(chunk);
+
+                    if(one) second[cls / 64] |= (std::uint64_t(1) << (cls % 64));
+
+                    chunk_one = true;
+                }
+                break;
+        }
+        one  = (one && chunk_zero) || (zero && chunk_one);
+        zero = zero && chunk_zero;
+    }
+    return one;
+}
+
+// the second token sets of the rules - with m_rule_first they tell the rules that never pass the same tokens
+void grammar::prepare_second_sets(std::vector<std::uint64_t>& rule_second, std::vector<char>& rule_one) const
+{
+    rule_second.assign(m_rules.size() * m_class_words, 0);
+    rule_one   .assign(m_rules.size(), 0);
+
+    std::vector<std::uint64_t> second(m_class_words);
+
+    for(bool changed = true; changed; )
+    {
+        changed = false;
+
+        for(size_t rule_index = 0; rule_index < m_rules.size(); ++rule_index)
+        {
+            const rule_data& rule = m_rules[rule_index];
+
+            std::uint64_t* rule_set = &rule_second[rule_index * m_class_words];
+
+            std::copy(rule_set, rule_set + m_class_words, second.begin());
+
+            const bool one = sequence_second(rule.first_chunk, rule.last_chunk, rule_second, rule_one, second.data()) || (rule_one[rule_index] != 0);
+
+            if(!std::equal(second.begin(), second.end(), rule_set) || (one != (rule_one[rule_index] != 0)))
+            {
+                std::copy(second.begin(), second.end(), rule_set);
+
+                rule_one[rule_index] = char(one);
+
+                changed = true;
+            }
+        }
+    }
+}
+
+result_t grammar::reoptimize(const grammar_profile& profile)
+{
+    Check_ValidState(m_start_index != npos, {parse_error::UnpreparedGramar, symbol_id(0), 0});
+
+    std::vector<std::uint64_t> passed(m_rules.size());
+
+    for(size_t rule_index = 0; rule_index < m_rules.size(); ++rule_index)
+    {
+        passed[rule_index] = profile.get_passed(m_rules[rule_index].id, m_rules[rule_index].order);
+    }
+
+    std::vector<std::uint64_t> rule_second;
+    std::vector<char>          rule_one;
+
+    prepare_second_sets(rule_second, rule_one);
+
+    // the alternatives of a dispatch list share the class of the first token, when neither of two of them may pass
+    // without a second token and their second token sets are disjoint, at most one of them passes any input
+    auto exclusive = [&] (size_t a, size_t b)
+    {
+        if((m_rule_nullable[a] != 0) || (m_rule_nullable[b] != 0) || (rule_one[a] != 0) || (rule_one[b] != 0)) return false;
+
+        for(size_t word = 0; word < m_class_words; ++word)
+        {
+            if((rule_second[a * m_class_words + word] & rule_second[b * m_class_words + word]) != 0) return false;
+        }
+        return true;
+    };
+
+    // swapping two neighbours that never pass the same input does not change which alternative passes first
+    for(size_t index = 0; index + 1 < m_dispatch.size(); ++index)
+    {
+        size_t* first = m_dispatch_rules.data() + m_dispatch[index];
+        size_t* last  = m_dispatch_rules.data() + m_dispatch[index + 1];
+
+        for(bool swapped = true; swapped; )
+        {
+            swapped = false;
+
+            for(size_t* it = first; (it != last) && (it + 1 != last); ++it)
+            {
+                if((passed[it[1]] > passed[it[0]]) && exclusive(it[0], it[1]))
+                {
+                    std::swap(it[0], it[1]);
+                    swapped = true;
+                }
+            }
+        }
+    }
+    return {parse_error::None, symbol_id(0), 0};
+}
+
+result_t grammar::check(
+    const tokens_t& tokens,
+    size_t index,
+    size_t count
+    )
+    const
+{
+    check_stack stack;
+
+    return check_range(tokens.data(), tokens.size(), index, count, stack, nullptr, nullptr);
+}
+
+result_t grammar::check(
+    const tokens_t& tokens,
+    memo_table& memo,
+    size_t index,
+    size_t count
+    )
+    const
+{
+    check_stack stack;
+
+    return check_range(tokens.data(), tokens.size(), index, count, stack, &memo, nullptr);
+}
+
+result_t grammar::check(
+    const tokens_t& tokens,
+    check_stack& stack,
+    memo_table* memo,
+    size_t index,
+    size_t count
+    )
+    const
+{
+    return check_range(tokens.data(), tokens.size(), index, count, stack, memo, nullptr);
+}
+
+result_t grammar::parse(
+    const tokens_t& tokens,
+    parse_tree_t& tree,
+    size_t index,
+    size_t count
+    )
+    const
+{
+    check_stack stack;
+
+    return check_range(tokens.data(), tokens.size(), index, count, stack, nullptr, &tree);
+}
+
+result_t grammar::parse(
+    const tokens_t& tokens,
+    parse_tree_t& tree,
+    check_stack& stack,
+    size_t index,
+    size_t count
+    )
+    const
+{
+    return check_range(tokens.data(), tokens.size(), index, count, stack, nullptr, &tree);
+}
+
+template<class Token>
+result_t grammar::check_range(const Token* tokens, size_t size, size_t index, size_t count, check_stack& stack, memo_table* memo, parse_tree_t* tree) const
+{
+    if(tree != nullptr) tree->clear();
+
+    Check_ValidState(m_start_index != npos, {parse_error::UnpreparedGramar, symbol_id(0), 0});
+
+    if(count == npos) count = size;
+
+    Check_ValidArg(index < size, {parse_error::InvalidArguments, symbol_id(0), 0});
+
+    const Token* token = tokens + index;
+
+    const Token* end = (index + count >= size)
+        ? (tokens + size)
+        : (tokens + (index + count));
+
+    if((memo != nullptr) && !memo->start(token, end, m_symbols.size()))
+    {
+        memo = nullptr;
+    }
+
+    // memoized symbols are not verified again, so there would be no nodes for them
+    Assert_Check((memo == nullptr) || (tree == nullptr));
+
+    if(tree != nullptr)
+    {
+        // tree[0] is reserved for the start symbol, it is known only when the check passes
+        stack.m_nodes.clear();
+        tree->push_back({});
+    }
+
+    verify_context<Token> ctx {tokens, end, stack, memo, tree, nullptr, m_start_index};
+
+    if(stack.m_trace != nullptr) stack.m_trace->record(trace_event::check_begin, index, 0);
+
+    const parse_error err = verify(token, ctx);
+
+    if(stack.m_trace != nullptr) stack.m_trace->record(trace_event::check_end, index, size_t(token - (tokens + index)), symbol_id(0), 0, err);
+
+    if((tree != nullptr) && (err != parse_error::None))
+    {
+        tree->clear();
+    }
+
+    switch(err)
+    {
+        case parse_error::None:
+            if(tree != nullptr)
+            {
+                Assert_Check(stack.m_nodes.size() == 1);
+
+                tree->front() = stack.m_nodes.back();
+            }
+            return {parse_error::None, symbol_id(0), 0};
+
+        case parse_error::MaxDepthExceeded:
+            {
+                // the innermost symbol being verified and the token where it called one symbol too deep
+                const size_t symbol_index = stack.m_frames.empty() ? m_start_index : stack.m_frames.back().symbol_index;
+
+                return {err, m_symbols[symbol_index].id, size_t(token - tokens)};
+            }
+
+        default:
+            return {err, symbol_id(0), 0};
+    }
+}
+
+result_t grammar::parse_reach(const tokens_t& tokens, size_t symbol_index, size_t index, check_stack& stack, parse_tree_t& tree, std::vector<size_t>& reach, size_t& furthest) const
+{
+    Assert_Check(m_engine != grammar_engine::earley);
+
+    tree .clear();
+    reach.clear();
+
+    Check_ValidState(m_start_index != npos, {parse_error::UnpreparedGramar, symbol_id(0), 0});
+    Check_ValidArg(index < tokens.size(), {parse_error::InvalidArguments, symbol_id(0), 0});
+
+    stack.m_nodes     .clear();
+    stack.m_node_reach.clear();
+
+    tree .push_back({});
+    reach.push_back(npos);
+
+    verify_context<token_data> ctx {tokens.data(), tokens.data() + tokens.size(), stack, nullptr, &tree, nullptr, symbol_index, &reach};
+
+    const token_data* token = tokens.data() + index;
+
+    const parse_error err = verify(token, ctx);
+
+    switch(err)
+    {
+        case parse_error::None:
+            Assert_Check(stack.m_nodes.size() == 1);
+
+            tree .front() = stack.m_nodes.back();
+            reach.front() = stack.m_node_reach.back();
+            furthest      = ctx.furthest;
+
+            return {parse_error::None, symbol_id(0), 0};
+
+        case parse_error::MaxDepthExceeded:
+            {
+                tree .clear();
+                reach.clear();
+
+                const size_t frame_symbol = stack.m_frames.empty() ? symbol_index : stack.m_frames.back().symbol_index;
+
+                return {err, m_symbols[frame_symbol].id, size_t(token - tokens.data())};
+            }
+
+        default:
+            tree .clear();
+            reach.clear();
+
+            return {err, symbol_id(0), 0};
+    }
+}
+
+result_t grammar::check(
+    const compact_tokens& tokens,
+    size_t index,
+    size_t count
+    )
+    const
+{
+    check_stack stack;
+
+    return check_range(tokens.kinds.data(), tokens.size(), index, count, stack, nullptr, nullptr);
+}
+
+result_t grammar::check(
+    const compact_tokens& tokens,
+    memo_table& memo,
+    size_t index,
+    size_t count
+    )
+    const
+{
+    check_stack stack;
+
+    return check_range(tokens.kinds.data(), tokens.size(), index, count, stack, &memo, nullptr);
+}
+
+result_t grammar::check(
+    const compact_tokens& tokens,
+    check_stack& stack,
+    memo_table* memo,
+    size_t index,
+    size_t count
+    )
+    const
+{
+    return check_range(tokens.kinds.data(), tokens.size(), index, count, stack, memo, nullptr);
+}
+
+result_t grammar::parse(
+    const compact_tokens& tokens,
+    parse_tree_t& tree,
+    size_t index,
+    size_t count
+    )
+    const
+{
+    check_stack stack;
+
+    return check_range(tokens.kinds.data(), tokens.size(), index, count, stack, nullptr, &tree);
+}
+
+result_t grammar::parse(
+    const compact_tokens& tokens,
+    parse_tree_t& tree,
+    check_stack& stack,
+    size_t index,
+    size_t count
+    )
+    const
+{
+    return check_range(tokens.kinds.data(), tokens.size(), index, count, stack, nullptr, &tree);
+}
+
+result_t grammar::check(
+    check_context& ctx,
+    size_t index,
+    size_t count
+    )
+    const
+{
+    return check_range(ctx.tokens.data(), ctx.tokens.size(), index, count, ctx.stack, ctx.packrat ? &ctx.memo : nullptr, nullptr);
+}
+
+result_t grammar::parse(
+    check_context& ctx,
+    size_t index,
+    size_t count
+    )
+    const
+{
+    return check_range(ctx.tokens.data(), ctx.tokens.size(), index, count, ctx.stack, nullptr, &ctx.tree);
+}
+
+result_t grammar::check(token_source& source) const
+{
+    check_stack stack;
+
+    return check(source, stack);
+}
+
+result_t grammar::check(token_source& source, check_stack& stack) const
+{
+    Check_ValidState(m_start_index != npos, {parse_error::UnpreparedGramar, symbol_id(0), 0});
+
+    Check_ValidArg(source.m_begin != nullptr, {parse_error::InvalidArguments, symbol_id(0), 0});
+
+    // a source is consumed by a check, reset() it for the next one
+    Check_ValidState(source.m_tokens.empty() && (source.m_dropped == 0), {parse_error::InvalidArguments, symbol_id(0), 0});
+
+    source.pull(0, 0);
+
+    const token_data* token = source.m_tokens.data();
+
+    verify_context<token_data> ctx {token, token + source.m_tokens.size(), stack, nullptr, nullptr, &source, m_start_index};
+
+    if(stack.m_trace != nullptr) stack.m_trace->record(trace_event::check_begin, 0, 0);
+
+    const parse_error err = verify(token, ctx);
+
+    if(stack.m_trace != nullptr) stack.m_trace->record(trace_event::check_end, 0, source.m_dropped + size_t(token - source.m_tokens.data()), symbol_id(0), 0, err);
+
+    if(err == parse_error::None) source.drain();
+
+    // the tokens the check reached are valid only before a tokenizer error
+    if(source.m_result.err != parse_error::None) return source.m_result;
+
+    switch(err)
+    {
+        case parse_error::None:
+            return {parse_error::None, symbol_id(0), 0};
+
+        case parse_error::MaxDepthExceeded:
+            {
+                const size_t symbol_index = stack.m_frames.empty() ? m_start_index : stack.m_frames.back().symbol_index;
+
+                return {err, m_symbols[symbol_index].id, source.m_dropped + size_t(token - source.m_tokens.data())};
+            }
+
+        default:
+            return {err, symbol_id(0), 0};
+    }
+}
+
+// The check reached the end of the pulled tokens - the tokens before the oldest position the check may return to
+// are dropped (the start of a symbol with alternatives left or of an open loop iteration) and the next ones pulled.
+// The stacks keep pointers to the tokens, they are moved along; positions dropped are never read again.
+void grammar::pull_tokens(const token_data*& token, verify_context<token_data>& ctx) const
+{
+    token_source& source = *ctx.source;
+
+    if(source.m_exhausted) return;
+
+    const token_data* base = source.m_tokens.data();
+
+    size_t keep = size_t(token - base);
+
+    if(m_engine == grammar_engine::backtracking)
+    {
+        for(const check_stack::frame& frame : ctx.stack.m_frames)
+        {
+            if((frame.dispatch + 1) != frame.dispatch_end) keep = std::min(keep, size_t(static_cast<const token_data*>(frame.start_token) - base));
+        }
+        for(const check_stack::loop& loop : ctx.stack.m_loops)
+        {
+            keep = std::min(keep, size_t(static_cast<const token_data*>(loop.token) - base));
+        }
+    }
+
+    // the stacks are walked on every pull, pulling at least as many tokens as they hold keeps that linear
+    source.pull(keep, ctx.stack.m_frames.size() + ctx.stack.m_loops.size());
+
+    const token_data* new_base = source.m_tokens.data();
+
+    auto move = [base, keep, new_base](const void* position)
+    {
+        const size_t index = size_t(static_cast<const token_data*>(position) - base);
+
+        return (index < keep) ? new_base : (new_base + (index - keep));
+    };
+
+    for(check_stack::frame& frame : ctx.stack.m_frames) frame.start_token = move(frame.start_token);
+    for(check_stack::loop&  loop  : ctx.stack.m_loops ) loop.token        = move(loop.token);
+
+    token = move(token);
+
+    ctx.begin = new_base;
+    ctx.end   = new_base + source.m_tokens.size();
+}
+
+void check_context::clear()
+{
+    tokens.clear();
+    tokens.shrink_to_fit();
+
+    stack.clear();
+    memo .clear();
+
+    tree.clear();
+    tree.shrink_to_fit();
+}
+
+void check_stats::clear()
+{
+    *this = check_stats();
+}
+
+check_stats& check_stats::operator+=(const check_stats& other)
+{
+    checks            += other.checks;
+    alternatives      += other.alternatives;
+    backtracks        += other.backtracks;
+    tokens_reverified += other.tokens_reverified;
+    loop_iterations   += other.loop_iterations;
+    memo_hits         += other.memo_hits;
+    max_depth          = std::max(max_depth, other.max_depth);
+
+    if(rules.size() < other.rules.size())
+    {
+        rules.resize(other.rules.size(), {symbol_id(0), 0, 0, 0, 0});
+    }
+    for(size_t index = 0; index < other.rules.size(); ++index)
+    {
+        rule_counters&       rule       = rules[index];
+        const rule_counters& other_rule = other.rules[index];
+
+        rule.id           = other_rule.id;
+        rule.alternative  = other_rule.alternative;
+        rule.tried             += other_rule.tried;
+        rule.failed            += other_rule.failed;
+        rule.tokens_reverified += other_rule.tokens_reverified;
+    }
+    return *this;
+}
+
+static std::int64_t steady_nanoseconds()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+trace_buffer::trace_buffer(size_t capacity) : m_events(std::max(capacity, size_t(1))), m_origin(steady_nanoseconds())
+{
+}
+
+void trace_buffer::clear()
+{
+    m_next    = 0;
+    m_written = 0;
+}
+
+void trace_buffer::record(trace_event type, size_t pos, size_t count, symbol_id id, unsigned alternative, parse_error err)
+{
+    m_events[m_next] = {std::uint64_t(steady_nanoseconds() - m_origin), pos, count, id, alternative, err, type};
+
+    if(++m_next == m_events.size()) m_next = 0;
+
+    ++m_written;
+}
+
+// The begin and end events are paired with a stack - rule_exit and rule_fail end the innermost rule_enter, check_end
+// and tokenize_end end their begin event and the rules left open inside it (a check stopped by MaxDepthExceeded or by
+// a failure of the ll1 engine, which does not unwind). Ends whose begin was overwritten are dropped.
+void trace_buffer::write_chrome_trace(std::string& json, symbol_name_fn symbol_name, unsigned thread_id) const
+{
+    auto append_time = [&json](std::uint64_t nanoseconds)
+    {
+        const std::uint64_t fraction = nanoseconds % 1000;
+
+        json += std::to_string(nanoseconds / 1000);
+        json += '.';
+        json += char('0' + fraction / 100);
+        json += char('0' + fraction / 10 % 10);
+        json += char('0' + fraction % 10);
+    };
+    auto append_symbol = [&json, symbol_name](const event& e)
+    {
+        const char* name = (symbol_name != nullptr) ? symbol_name(e.id) : nullptr;
+
+        if(name == nullptr)
+        {
+            json += std::to_string(int(e.id));
+        }
+        else for( ; *name != 0; ++name)
+        {
+            if((*name == '"') || (*name == '\\')) json += '\\';
+
+            if(static_cast<unsigned char>(*name) >= 0x20) json += *name;
+        }
+        json += '/';
+        json += std::to_string(e.alternative);
+    };
+
+    bool first = true;
+
+    // end is nullptr for a begin event left open at the time of last
+    auto append_event = [&](const event& begin, const event* end, const event& last)
+    {
+        json += first ? "\n{" : ",\n{";
+        first = false;
+
+        const bool instant = (begin.type == trace_event::loop_iteration);
+        const bool failed  = (end != nullptr) && (end->type == trace_event::rule_fail);
+
+        json += instant ? "\"ph\":\"i\",\"s\":\"t\"" : "\"ph\":\"X\"";
+        json += ",\"pid\":0,\"tid\":";
+        json += std::to_string(thread_id);
+        json += ",\"ts\":";
+        append_time(begin.time);
+
+        if(!instant)
+        {
+            json += ",\"dur\":";
+            append_time(last.time - begin.time);
+        }
+        json += ",\"name\":\"";
+
+        switch(begin.type)
+        {
+            case trace_event::tokenize_begin: json += "tokenize\",\"cat\":\"tokenizer\""; break;
+            case trace_event::check_begin:    json += "check\",\"cat\":\"grammar\"";       break;
+            case trace_event::loop_iteration: json += "loop\",\"cat\":\"loop\"";          break;
+
+            default:
+                append_symbol(begin);
+                json += failed ? " failed\",\"cat\":\"backtrack\"" : "\",\"cat\":\"rule\"";
+                break;
+        }
+        json += ",\"args\":{\"pos\":";
+        json += std::to_string(begin.pos);
+
+        if(instant)
+        {
+            json += ",\"iterations\":";
+            json += std::to_string(begin.count);
+        }
+        else if(end == nullptr)
+        {
+            json += ",\"open\":true";
+        }
+        else
+        {
+            json += ",\"tokens\":";
+            json += std::to_string(end->count);
+
+            if(end->err != parse_error::None)
+            {
+                json += ",\"err\":";
+                json += std::to_string(int(end->err));
+            }
+        }
+        json += "}}";
+    };
+
+    json += "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+
+    const size_t count = size();
+
+    std::vector<size_t> open;
+
+    for(size_t index = 0; index < count; ++index)
+    {
+        const event& e = (*this)[index];
+
+        trace_event begin_type = trace_event::rule_enter;
+
+        switch(e.type)
+        {
+            case trace_event::tokenize_begin:
+            case trace_event::check_begin:
+            case trace_event::rule_enter:
+                open.push_back(index);
+                continue;
+
+            case trace_event::loop_iteration:
+                append_event(e, &e, e);
+                continue;
+
+            case trace_event::tokenize_end: begin_type = trace_event::tokenize_begin; break;
+            case trace_event::check_end:    begin_type = trace_event::check_begin;    break;
+
+            default: break;
+        }
+        if(begin_type != trace_event::rule_enter)
+        {
+            while(!open.empty() && ((*this)[open.back()].type == trace_event::rule_enter))
+            {
+                append_event((*this)[open.back()], nullptr, e);
+                open.pop_back();
+            }
+        }
+        if(!open.empty() && ((*this)[open.back()].type == begin_type))
+        {
+            append_event((*this)[open.back()], &e, e);
+            open.pop_back();
+        }
+    }
+    for(const size_t index : open)
+    {
+        append_event((*this)[index], nullptr, (*this)[count - 1]);
+    }
+    json += "\n]}\n";
+}
+
+static bool rule_count_less(const grammar_profile::rule_count& a, const grammar_profile::rule_count& b)
+{
+    return (a.id != b.id) ? (a.id < b.id) : (a.alternative < b.alternative);
+}
+
+grammar_profile& grammar_profile::operator+=(const grammar_profile& other)
+{
+    std::vector<rule_count> rules;
+
+    rules.reserve(m_rules.size() + other.m_rules.size());
+
+    auto it       = m_rules.begin();
+    auto other_it = other.m_rules.begin();
+
+    while((it != m_rules.end()) || (other_it != other.m_rules.end()))
+    {
+        if((other_it == other.m_rules.end()) || ((it != m_rules.end()) && rule_count_less(*it, *other_it)))
+        {
+            rules.push_back(*it++);
+        }
+        else if((it == m_rules.end()) || rule_count_less(*other_it, *it))
+        {
+            rules.push_back(*other_it++);
+        }
+        else
+        {
+            rules.push_back({it->id, it->alternative, it->passed + other_it->passed});
+            ++it;
+            ++other_it;
+        }
+    }
+    m_rules.swap(rules);
+
+    return *this;
+}
+
+std::uint64_t grammar_profile::get_passed(symbol_id id, unsigned alternative) const
+{
+    const auto it = std::lower_bound(m_rules.begin(), m_rules.end(), rule_count {id, alternative, 0}, rule_count_less);
+
+    return ((it != m_rules.end()) && (it->id == id) && (it->alternative == alternative)) ? it->passed : 0;
+}
+
+static constexpr std::string_view profile_header = "fagramm profile 1\n";
+
+void grammar_profile::save(std::string& out) const
+{
+    out += profile_header;
+
+    for(const rule_count& rule : m_rules)
+    {
+        out += std::to_string(int(rule.id));
+        out += ' ';
+        out += std::to_string(rule.alternative);
+        out += ' ';
+        out += std::to_string(rule.passed);
+        out += '\n';
+    }
+}
+
+result_t grammar_profile::load(std::string_view text)
+{
+    m_rules.clear();
+
+    if(text.substr(0, profile_header.size()) != profile_header) return {parse_error::InvalidProfile, symbol_id(0), 0};
+
+    std::vector<rule_count> rules;
+
+    for(size_t pos = profile_header.size(); pos < text.size(); )
+    {
+        const size_t line_end = std::min(text.find('\n', pos), text.size());
+
+        // three decimal numbers separated by single spaces, the first one may be negative
+        std::uint64_t values[3] = {};
+
+        size_t index = pos;
+        bool   valid = true;
+        bool   minus = (text[index] == '-');
+
+        if(minus) ++index;
+
+        for(size_t value = 0; valid && (value < 3); ++value)
+        {
+            const size_t first = index;
+
+            for( ; (index < line_end) && (text[index] >= '0') && (text[index] <= '9') && (values[value] <= (~std::uint64_t(0) - 9) / 10); ++index)
+            {
+                values[value] = values[value] * 10 + std::uint64_t(text[index] - '0');
+            }
+            valid = (index != first) && (index == line_end || ((value < 2) && (text[index++] == ' ')));
+        }
+        valid = valid && (index == line_end) && (values[0] <= std::uint64_t(minus ? 0x80000000u : 0x7FFFFFFFu)) && (values[1] <= 0xFFFFFFFFu);
+
+        if(!valid) return {parse_error::InvalidProfile, symbol_id(0), pos};
+
+        const std::int64_t id = minus ? -std::int64_t(values[0]) : std::int64_t(values[0]);
+
+        rules.push_back({symbol_id(id), unsigned(values[1]), values[2]});
+
+        pos = line_end + 1;
+    }
+    std::sort(rules.begin(), rules.end(), rule_count_less);
+
+    // the counts of a rule saved more than once add up
+    for(const rule_count& rule : rules)
+    {
+        if(!m_rules.empty() && !rule_count_less(m_rules.back(), rule))
+        {
+            m_rules.back().passed += rule.passed;
+        }
+        else
+        {
+            m_rules.push_back(rule);
+        }
+    }
+    return {parse_error::None, symbol_id(0), 0};
+}
+
+void check_stack::clear()
+{
+    m_frames.clear();
+    m_frames.shrink_to_fit();
+
+    m_loops.clear();
+    m_loops.shrink_to_fit();
+
+    m_nodes.clear();
+    m_nodes.shrink_to_fit();
+
+    m_node_reach.clear();
+    m_node_reach.shrink_to_fit();
+
+    m_frame_marks.clear();
+    m_frame_marks.shrink_to_fit();
+
+    m_loop_marks.clear();
+    m_loop_marks.shrink_to_fit();
+
+    m_earley_items.clear();
+    m_earley_items.shrink_to_fit();
+
+    m_earley_sets.clear();
+    m_earley_sets.shrink_to_fit();
+
+    m_earley_scanned.clear();
+    m_earley_scanned.shrink_to_fit();
+
+    m_earley_index.clear();
+    m_earley_index.shrink_to_fit();
+
+    m_earley_predicted.clear();
+    m_earley_predicted.shrink_to_fit();
+
+    m_earley_callees.clear();
+    m_earley_callees.shrink_to_fit();
+
+    m_earley_steps.clear();
+    m_earley_steps.shrink_to_fit();
+
+    m_earley_next.clear();
+    m_earley_next.shrink_to_fit();
+
+    m_earley_links.clear();
+    m_earley_links.shrink_to_fit();
+
+    m_earley_callers.clear();
+    m_earley_callers.shrink_to_fit();
+
+    m_earley_origins.clear();
+    m_earley_origins.shrink_to_fit();
+
+    m_earley_path.clear();
+    m_earley_path.shrink_to_fit();
+
+    m_earley_entries.clear();
+    m_earley_entries.shrink_to_fit();
+}
+
+void memo_table::clear()
+{
+    m_entries.clear();
+    m_entries.shrink_to_fit();
+
+    m_base    = nullptr;
+    m_symbols = 0;
+    m_hashed  = false;
+    m_stamp   = 0;
+}
+
+template<class Token>
+bool memo_table::start(const Token* begin, const Token* end, size_t symbols_count)
+{
+    const size_t positions = size_t(end - begin) + 1;
+
+    if((m_max_entries == 0) || (symbols_count == 0) || (positions >= size_t(UINT32_MAX))) return false;
+
+    const size_t needed = positions * symbols_count;
+
+    m_base    = begin;
+    m_symbols = symbols_count;
+    m_hashed  = (needed / symbols_count != positions) || (needed > m_max_entries);
+
+    size_t size = needed;
+
+    if(m_hashed)
+    {
+        for(size = 1; (size * 2) <= m_max_entries; size *= 2);
+    }
+    if(m_entries.size() < size)
+    {
+        m_entries.resize(size, entry {0, 0, 0, 0});
+    }
+    if(m_hashed && (m_entries.size() != size))
+    {
+        m_entries.resize(size);
+    }
+
+    if(++m_stamp == 0)
+    {
+        for(entry& e : m_entries) e.stamp = 0;
+        m_stamp = 1;
+    }
+    return true;
+}
+
+// the grammar is LL(1) (and checking it predictively accepts the same tokens as the ordered choice of verify_rules) when
+// - the alternatives of every symbol have disjoint FIRST sets and only the last one may pass without consuming tokens
+// - the alternatives before a nullable last one do not start with a terminal that may follow the symbol
+// - loop bodies always consume tokens and a loop that may repeat or be left does not start with a terminal that may follow it
+// The start symbol may be followed by anything since check() accepts trailing tokens.
+bool grammar::prepare_ll1()
+{
+    std::vector<std::uint64_t> follow(m_symbols.size() * m_class_words);
+    std::vector<std::uint64_t> first(m_class_words);
+
+    m_ll1_table     .assign(m_symbols.size() * m_classes_count, npos);
+    m_ll1_loop_first.assign(loops_count(m_chunks.data(), m_chunks.size()) * m_class_words, 0);
+
+    return build_ll1(*this, follow.data(), first.data());
+}
+
+size_t grammar::find_symbol_with_id(symbol_id id) const
+{
+    return find_symbol(*this, id);
+}
+
+// The children of the symbol are the nodes completed since it started - they become one block of the tree and
+// the node of the symbol waits for its own parent in their place.
+template<class Token>
+void grammar::add_node(verify_context<Token>& ctx, const check_stack::frame& frame, const Token* token) const
+{
+    const Token* start_token = static_cast<const Token*>(frame.start_token);
+
+    std::vector<parse_node>& nodes = ctx.stack.m_nodes;
+    parse_tree_t&            tree  = *ctx.tree;
+
+    const size_t nodes_base     = ctx.stack.m_frame_marks.back().nodes;
+    const size_t rule_index     = *frame.dispatch;
+    const size_t first_child    = tree.size();
+    const size_t children_count = nodes.size() - nodes_base;
+
+    tree.insert(tree.end(), nodes.begin() + std::ptrdiff_t(nodes_base), nodes.end());
+    nodes.resize(nodes_base);
+
+    if(ctx.reach != nullptr)
+    {
+        std::vector<size_t>& reach = ctx.stack.m_node_reach;
+
+        ctx.reach->insert(ctx.reach->end(), reach.begin() + std::ptrdiff_t(nodes_base), reach.end());
+        reach.resize(nodes_base);
+        reach.push_back(ctx.stack.m_frame_marks.back().reach);
+    }
+    ctx.stack.m_frame_marks.pop_back();
+
+    nodes.push_back({
+        m_rules[rule_index].id,
+        unsigned(rule_index - m_symbols[frame.symbol_index].first_rule),
+        size_t(start_token - ctx.begin),
+        size_t(token - start_token),
+        first_child,
+        children_count});
+}
+
+// an inlined symbol passed with a single token - its node is a leaf with the first alternative that matches the token
+template<class Token>
+void grammar::add_leaf_node(verify_context<Token>& ctx, size_t symbol_index, const Token* token) const
+{
+    const symbol_data& symbol = m_symbols[symbol_index];
+    const size_t       cls    = terminal_class(token, ctx.end);
+
+    size_t rule_index = symbol.first_rule;
+
+    while((rule_index < symbol.last_rule) && (terminal_class(m_chunks[m_rules[rule_index].first_chunk]) != cls)) ++rule_index;
+
+    ctx.stack.m_nodes.push_back({symbol.id, unsigned(rule_index - symbol.first_rule), size_t(token - ctx.begin), 1, ctx.tree->size(), 0});
+
+    // the symbol is not entered on its own - incremental_check does not parse it again
+    if(ctx.reach != nullptr) ctx.stack.m_node_reach.push_back(npos);
+}
+
+void grammar::start_profile(grammar_profile& profile) const
+{
+    if(profile.m_rules.size() == m_rules.size()) return;
+
+    // the counts of the rules of another grammar are dropped
+    std::vector<grammar_profile::rule_count> rules(m_rules.size());
+
+    for(size_t index = 0; index < m_rules.size(); ++index)
+    {
+        rules[index] = {m_rules[index].id, m_rules[index].order, profile.get_passed(m_rules[index].id, m_rules[index].order)};
+    }
+    profile.m_rules.swap(rules);
+}
+
+void grammar::start_stats(check_stats& stats) const
+{
+    if(stats.rules.size() != m_rules.size())
+    {
+        stats.rules.resize(m_rules.size(), {symbol_id(0), 0, 0, 0, 0});
+
+        for(size_t index = 0; index < m_rules.size(); ++index)
+        {
+            stats.rules[index].id          = m_rules[index].id;
+            stats.rules[index].alternative = m_rules[index].order;
+        }
+    }
+    ++stats.checks;
+}
+
+#if FAGRAMM_STATS
+static void count_backtrack(check_stats& stats, size_t rule_index, size_t tokens)
+{
+    check_stats::rule_counters& rule = stats.rules[rule_index];
+
+    ++rule.failed;
+    ++stats.backtracks;
+
+    rule .tokens_reverified += tokens;
+    stats.tokens_reverified += tokens;
+}
+#endif
+
+template<class Token>
+void grammar::record_trace(const verify_context<Token>& ctx, trace_event type, const void* pos_token, size_t count, size_t rule_index) const
+{
+    // the tokens of a token_source are a window, the tokens before it were dropped
+    const size_t dropped = (ctx.source != nullptr) ? ctx.source->m_dropped : 0;
+    const size_t pos     = dropped + size_t(static_cast<const Token*>(pos_token) - ctx.begin);
+
+    if(rule_index == npos)
+    {
+        ctx.stack.m_trace->record(type, pos, count);
+    }
+    else
+    {
+        ctx.stack.m_trace->record(type, pos, count, m_rules[rule_index].id, m_rules[rule_index].order);
+    }
+}
+
+// Ordered choice without recursion - a call pushes a frame with the dispatched alternatives of the symbol, a failure
+// unwinds to the innermost loop that may be left or the innermost frame that has an alternative left to try.
+template<class Token>
+parse_error grammar::verify_rules(const Token*& token, verify_context<Token>& ctx) const
+{
+    const Token* end  = ctx.end;
+    memo_table*  memo = ctx.memo;
+
+    std::vector<check_stack::frame>&      frames      = ctx.stack.m_frames;
+    std::vector<check_stack::loop>&       loops       = ctx.stack.m_loops;
+    std::vector<check_stack::nodes_mark>& frame_marks = ctx.stack.m_frame_marks;
+    std::vector<check_stack::nodes_mark>& loop_marks  = ctx.stack.m_loop_marks;
+
+    frames     .clear();
+    loops      .clear();
+    frame_marks.clear();
+    loop_marks .clear();
+
+#if FAGRAMM_STATS
+    check_stats& stats = ctx.stack.m_stats;
+    start_stats(stats);
+#endif
+
+    const trace_buffer* trace   = ctx.stack.m_trace;
+    grammar_profile*    profile = ctx.stack.m_profile;
+
+    if(profile != nullptr) start_profile(*profile);
+
+    const instruction* code = m_code.data();
+
+    size_t pc         = npos;
+    size_t call_index = ctx.start_index;
+
+    // tokens are examined only at token, so the furthest one examined is the furthest token was before going back
+    const Token* furthest = token;
+
+    for(;;)
+    {
+        if constexpr(std::is_same_v<Token, token_data>)
+        {
+            if((token == end) && (ctx.source != nullptr))
+            {
+                pull_tokens(token, ctx);
+                end = ctx.end;
+            }
+        }
+
+        bool passed = true;
+
+        if(call_index != npos)
+        {
+            const size_t symbol_index = call_index;
+
+            call_index = npos;
+
+            memo_table::entry* memo_entry = nullptr;
+
+            if(memo != nullptr)
+            {
+                memo_entry = &memo->slot(symbol_index, token);
+
+                if(memo->is_set(*memo_entry, symbol_index, token))
+                {
+                    Stats_Update(++stats.memo_hits);
+
+                    passed = (memo_entry->result != 0);
+
+                    if(passed) token = memo->base<Token>() + (memo_entry->result - 1);
+                }
+                else
+                {
+                    memo_entry = nullptr;
+                }
+            }
+            if(memo_entry == nullptr)
+            {
+                const size_t  dispatch_index = symbol_index * m_classes_count + terminal_class(token, end);
+                const size_t* dispatch_begin = m_dispatch_rules.data() + m_dispatch[dispatch_index];
+                const size_t* dispatch_end   = m_dispatch_rules.data() + m_dispatch[dispatch_index + 1];
+
+                if(dispatch_begin != dispatch_end)
+                {
+                    if(frames.size() >= ctx.stack.m_max_depth) return parse_error::MaxDepthExceeded;
+
+                    frames.push_back({symbol_index, pc, loops.size(), token, dispatch_begin, dispatch_end});
+
+                    Stats_Update(++stats.alternatives, ++stats.rules[*dispatch_begin].tried, stats.max_depth = std::max(stats.max_depth, frames.size()));
+
+                    if(trace != nullptr) record_trace(ctx, trace_event::rule_enter, token, 0, *dispatch_begin);
+
+                    if(ctx.tree != nullptr) frame_marks.push_back(current_mark(ctx, size_t(std::max(furthest, token) - ctx.begin)));
+
+                    pc = m_rule_code[*dispatch_begin];
+                    continue;
+                }
+                if(memo != nullptr) memo->set(memo->slot(symbol_index, token), symbol_index, token, false, token);
+
+                passed = false;
+            }
+            if(frames.empty()) return passed ? parse_error::None : parse_error::GrammarCheckFailed;
+        }
+        else
+        {
+            const instruction& instr = code[pc++];
+
+            switch(instr.op)
+            {
+                case op_code::match_type:
+                    passed = (token < end) && (token->type == token_type(instr.type));
+                    break;
+
+                case op_code::match_id:
+                    passed = (token < end) && (token->type == token_type(instr.type)) && (token->id == symbol_id(instr.arg));
+                    break;
+
+                case op_code::match_set:
+                    passed = has_class(&m_inline_sets[instr.arg * m_class_words], terminal_class(token, end));
+
+                    if(passed && (ctx.tree != nullptr)) add_leaf_node(ctx, instr.arg, token);
+                    break;
+
+                case op_code::call:
+                    call_index = instr.arg;
+                    continue;
+
+                case op_code::loop:
+                    loops.push_back({0, instr.arg, token});
+
+                    if(ctx.tree != nullptr) loop_marks.push_back(current_mark(ctx));
+                    continue;
+
+                case op_code::next:
+                    {
+                        Assert_Check(!loops.empty());
+
+                        Stats_Update(++stats.loop_iterations);
+
+                        check_stack::loop& current_loop = loops.back();
+                        const loop_code&   loop         = m_loop_code[current_loop.loop_index];
+
+                        // an iteration that consumed no tokens would repeat forever - leave the loop instead
+                        const bool no_progress = (token == current_loop.token) && (current_loop.repeats >= loop.min_repeats);
+
+                        if(trace != nullptr) record_trace(ctx, trace_event::loop_iteration, token, current_loop.repeats + 1);
+
+                        if((++current_loop.repeats == loop.max_repeats) || no_progress)
+                        {
+                            loops.pop_back();
+
+                            if(ctx.tree != nullptr) loop_marks.pop_back();
+                        }
+                        else
+                        {
+                            current_loop.token = token;
+
+                            if(ctx.tree != nullptr) loop_marks.back() = current_mark(ctx);
+
+                            pc = loop.body;
+                        }
+                    }
+                    continue;
+
+                case op_code::ret:
+                    {
+                        const check_stack::frame& current = frames.back();
+
+                        if(trace != nullptr) record_trace(ctx, trace_event::rule_exit, current.start_token, size_t(token - static_cast<const Token*>(current.start_token)), *current.dispatch);
+
+                        if(profile != nullptr) ++profile->m_rules[*current.dispatch].passed;
+
+                        if(ctx.tree != nullptr) add_node(ctx, current, token);
+
+                        if(memo != nullptr)
+                        {
+                            const Token* start_token = static_cast<const Token*>(current.start_token);
+
+                            memo->set(memo->slot(current.symbol_index, start_token), current.symbol_index, start_token, true, token);
+                        }
+
+                        pc = current.return_pc;
+                        frames.pop_back();
+
+                        if(frames.empty())
+                        {
+                            // a match examined the token before token, the next one is examined only by a failure
+                            ctx.furthest = size_t(((token > furthest) ? (token - 1) : furthest) - ctx.begin);
+                            return parse_error::None;
+                        }
+                    }
+                    continue;
+
+                default: Assert_Fail(); return parse_error::GrammarCheckFailed;
+            }
+            if(passed)
+            {
+                ++token;
+                continue;
+            }
+        }
+        if(passed) continue;
+
+        furthest = std::max(furthest, token);
+
+        // a failed iteration leaves the innermost loop of the frame that has enough repeats, the loops inside it fail
+        // with the iteration; without such a loop the alternative fails and the next one is tried or the frame fails
+        for(;;)
+        {
+            check_stack::frame& current = frames.back();
+
+            bool left_loop = false;
+
+            for( ; loops.size() > current.loops_base; loops.pop_back())
+            {
+                const check_stack::loop& current_loop = loops.back();
+                const loop_code&         loop         = m_loop_code[current_loop.loop_index];
+
+                if(loop.min_repeats <= current_loop.repeats)
+                {
+                    Stats_Update(stats.tokens_reverified += size_t(token - static_cast<const Token*>(current_loop.token)));
+
+                    pc        = loop.exit;
+                    token     = static_cast<const Token*>(current_loop.token);
+                    left_loop = true;
+
+                    loops.pop_back();
+                    break;
+                }
+            }
+            if(ctx.tree != nullptr)
+            {
+                if(left_loop) rollback_nodes(ctx, loop_marks[loops.size()]);
+
+                loop_marks.resize(loops.size());
+            }
+            if(left_loop) break;
+
+            Stats_Update(count_backtrack(stats, *current.dispatch, size_t(token - static_cast<const Token*>(current.start_token))));
+
+            if(trace != nullptr) record_trace(ctx, trace_event::rule_fail, current.start_token, size_t(token - static_cast<const Token*>(current.start_token)), *current.dispatch);
+
+            token = static_cast<const Token*>(current.start_token);
+
+            if(ctx.tree != nullptr) rollback_nodes(ctx, frame_marks.back());
+
+            if(++current.dispatch != current.dispatch_end)
+            {
+                Stats_Update(++stats.alternatives, ++stats.rules[*current.dispatch].tried);
+
+                if(trace != nullptr) record_trace(ctx, trace_event::rule_enter, current.start_token, 0, *current.dispatch);
+
+                pc = m_rule_code[*current.dispatch];
+                break;
+            }
+            if(memo != nullptr) memo->set(memo->slot(current.symbol_index, token), current.symbol_index, token, false, token);
+
+            frames.pop_back();
+
+            if(ctx.tree != nullptr) frame_marks.pop_back();
+
+            if(frames.empty()) return parse_error::GrammarCheckFailed;
+        }
+    }
+}
+
+template<class Token>
+parse_error grammar::verify_ll1(const Token*& token, verify_context<Token>& ctx) const
+{
+    const Token* end = ctx.end;
+
+    std::vector<check_stack::frame>& frames = ctx.stack.m_frames;
+    std::vector<check_stack::loop>&  loops  = ctx.stack.m_loops;
+
+    frames.clear();
+    loops .clear();
+    ctx.stack.m_frame_marks.clear();
+
+#if FAGRAMM_STATS
+    check_stats& stats = ctx.stack.m_stats;
+    start_stats(stats);
+#endif
+
+    const trace_buffer* trace   = ctx.stack.m_trace;
+    grammar_profile*    profile = ctx.stack.m_profile;
+
+    if(profile != nullptr) start_profile(*profile);
+
+    const instruction* code = m_code.data();
+
+    size_t pc = npos;
+
+    for(size_t symbol_index = ctx.start_index; ; )
+    {
+        if constexpr(std::is_same_v<Token, token_data>)
+        {
+            if((token == end) && (ctx.source != nullptr))
+            {
+                pull_tokens(token, ctx);
+                end = ctx.end;
+            }
+        }
+
+        if(symbol_index != npos)
+        {
+            const size_t* rule_index = &m_ll1_table[symbol_index * m_classes_count + terminal_class(token, end)];
+
+            if(*rule_index == npos) return parse_error::GrammarCheckFailed;
+
+            if(frames.size() >= ctx.stack.m_max_depth) return parse_error::MaxDepthExceeded;
+
+            // a predictive check never comes back to an alternative, the frame keeps only what a node of the tree needs
+            frames.push_back({symbol_index, pc, 0, token, rule_index, rule_index + 1});
+
+            Stats_Update(++stats.alternatives, ++stats.rules[*rule_index].tried, stats.max_depth = std::max(stats.max_depth, frames.size()));
+
+            if(trace != nullptr) record_trace(ctx, trace_event::rule_enter, token, 0, *rule_index);
+
+            if(ctx.tree != nullptr) ctx.stack.m_frame_marks.push_back(current_mark(ctx, size_t(token - ctx.begin)));
+
+            pc = m_rule_code[*rule_index];
+
+            symbol_index = npos;
+        }
+
+        const instruction& instr = code[pc++];
+
+        switch(instr.op)
+        {
+            case op_code::match_type: if((token < end) && (token->type == token_type(instr.type))) break; return parse_error::GrammarCheckFailed;
+
+            case op_code::match_id: if((token < end) && (token->type == token_type(instr.type)) && (token->id == symbol_id(instr.arg))) break; return parse_error::GrammarCheckFailed;
+
+            case op_code::match_set:
+                if(!has_class(&m_inline_sets[instr.arg * m_class_words], terminal_class(token, end))) return parse_error::GrammarCheckFailed;
+
+                if(ctx.tree != nullptr) add_leaf_node(ctx, instr.arg, token);
+                break;
+
+            case op_code::call: symbol_index = instr.arg; continue;
+
+            case op_code::loop:
+                {
+                    const loop_code& loop = m_loop_code[instr.arg];
+
+                    if((loop.min_repeats == 0) && !has_class(&m_ll1_loop_first[instr.arg * m_class_words], terminal_class(token, end)))
+                    {
+                        pc = loop.exit;
+                        continue;
+                    }
+                    loops.push_back({0, instr.arg, token});
+                }
+                continue;
+
+            case op_code::next:
+                {
+                    Assert_Check(!loops.empty());
+
+                    check_stack::loop& current_loop = loops.back();
+                    const loop_code&   loop         = m_loop_code[current_loop.loop_index];
+
+                    Stats_Update(++stats.loop_iterations);
+
+                    ++current_loop.repeats;
+
+                    if(trace != nullptr) record_trace(ctx, trace_event::loop_iteration, token, current_loop.repeats);
+
+                    const bool repeat = (current_loop.repeats < loop.min_repeats) || ((current_loop.repeats < loop.max_repeats) &&
+                        has_class(&m_ll1_loop_first[current_loop.loop_index * m_class_words], terminal_class(token, end)));
+
+                    if(repeat)
+                    {
+                        pc = loop.body;
+                    }
+                    else
+                    {
+                        loops.pop_back();
+                    }
+                }
+                continue;
+
+            case op_code::ret:
+                if(trace != nullptr)
+                {
+                    const check_stack::frame& current = frames.back();
+
+                    record_trace(ctx, trace_event::rule_exit, current.start_token, size_t(token - static_cast<const Token*>(current.start_token)), *current.dispatch);
+                }
+                if(profile != nullptr) ++profile->m_rules[*frames.back().dispatch].passed;
+
+                if(ctx.tree != nullptr) add_node(ctx, frames.back(), token);
+
+                pc = frames.back().return_pc;
+                frames.pop_back();
+
+                if(frames.empty())
+                {
+                    ctx.furthest = size_t(token - ctx.begin);
+                    return parse_error::None;
+                }
+                continue;
+
+            default: Assert_Fail(); return parse_error::GrammarCheckFailed;
+        }
+        ++token;
+    }
+}
+
+template<class Token>
+parse_error grammar::verify(const Token*& token, verify_context<Token>& ctx) const
+{
+    switch(m_engine)
+    {
+        case grammar_engine::ll1   : return verify_ll1   (token, ctx);
+        case grammar_engine::earley: return verify_earley(token, ctx);
+
+        default: return verify_rules(token, ctx);
+    }
+}
+
+// Earley recognizer - set k of the chart holds the items of the productions that may match from their origin up to
+// token k, each with the instruction it matches next. An item calling a nonterminal predicts its productions, an item
+// matching token k is scanned into the next set and a complete item advances the items of its origin set that call
+// its nonterminal; a call of a nullable nonterminal is advanced at once as well (Aycock and Horspool), so the items
+// that match no tokens need no completion. The check passes with the longest prefix of the tokens the start symbol
+// matches, it stops at the end of the tokens or when no item matched the token.
+//
+// Every nonterminal predicted in a set gets an entry of m_earley_links and every item keeps the entry of its
+// production, so a completion finds the items waiting for it by the entry: the single caller is kept in the entry,
+// several callers are looked up in the origin set and chained there once the set was looked up a few times. Without a
+// tree or a profile a completion whose origin set has a single caller that ends with the call takes its Leo item (Leo
+// 1991) - the topmost complete item of the chain of such callers - instead of completing the whole chain. Unlike the
+// ordered choice of verify_rules every alternative and every count of loop repeats is tried and left recursion is
+// matched.
+//
+// A set has an item per production position and origin at most, so a check takes O(n^3) time for n tokens in general
+// and O(n^2) for unambiguous grammars; it is linear for the LR(k) grammars, left and right recursion and unbounded
+// loops (left recursive helpers) among them. A parse completes every chain since the tree is read back from the
+// complete items, so right recursion takes O(n^2) there. Bounded loops are linear but heavy, see lower_earley_loop.
+template<class Token>
+parse_error grammar::verify_earley(const Token*& token, verify_context<Token>& ctx) const
+{
+    check_stack& stack = ctx.stack;
+
+    std::vector<check_stack::earley_item>&       items     = stack.m_earley_items;
+    std::vector<size_t>&                         sets      = stack.m_earley_sets;
+    std::vector<check_stack::earley_item>&       scanned   = stack.m_earley_scanned;
+    std::vector<check_stack::earley_key>&        index     = stack.m_earley_index;
+    std::vector<check_stack::earley_prediction>& predicted = stack.m_earley_predicted;
+    std::vector<check_stack::earley_caller>&     callers   = stack.m_earley_callers;
+    std::vector<check_stack::earley_links>&      links     = stack.m_earley_links;
+    std::vector<check_stack::earley_origin>&     origins   = stack.m_earley_origins;
+    std::vector<size_t>&                         callees   = stack.m_earley_callees;
+    std::vector<size_t>&                         path      = stack.m_earley_path;
+
+    using leo_state = check_stack::earley_leo;
+
+    // pull_tokens keeps the tokens of the frames and loops - the chart needs only the current one
+    stack.m_frames.clear();
+    stack.m_loops .clear();
+
+    items  .clear();
+    sets   .clear();
+    scanned.clear();
+    callers  .clear();
+    links    .clear();
+    origins  .clear();
+
+#if FAGRAMM_STATS
+    check_stats& stats = stack.m_stats;
+    start_stats(stats);
+#endif
+
+    grammar_profile* profile = stack.m_profile;
+
+    if(profile != nullptr) start_profile(*profile);
+
+    // Leo items skip the complete items the tree is read back from and the rules the profile counts
+    const bool use_leo = (ctx.tree == nullptr) && (profile == nullptr);
+
+    const size_t nonterminals = m_earley_nonterminals.size() - 1;
+
+    if(predicted.size() < nonterminals) predicted.resize(nonterminals, {0, 0});
+    if(callees  .size() < nonterminals) callees  .resize(nonterminals, 0);
+    if(index.size() < 64) index.assign(64, {0, 0, 0});
+
+    const instruction* code = m_earley_code.data();
+
+    const Token* end         = ctx.end;
+    const size_t first_token = size_t(token - ctx.begin);
+
+    size_t stamp    = 0;
+    size_t count    = 0;    // items in the current set
+    size_t accepted = npos; // the last set with a complete start item
+    size_t root     = npos; // that item
+
+    // the entry of an item stands for its origin, as the slot tells the nonterminal
+    auto find_key = [&index, &stamp](size_t slot, size_t entry) -> check_stack::earley_key&
+    {
+        const size_t mask = index.size() - 1;
+
+        size_t at = size_t(((std::uint64_t(slot) * 0x9E3779B97F4A7C15u) ^ std::uint64_t(entry)) * 0xC2B2AE3D27D4EB4Fu >> 32) & mask;
+
+        while((index[at].stamp == stamp) && ((index[at].slot != slot) || (index[at].links != entry))) at = (at + 1) & mask;
+
+        return index[at];
+    };
+    auto add = [&](const check_stack::earley_item& item)
+    {
+        check_stack::earley_key& key = find_key(item.slot, item.links);
+
+        if(key.stamp == stamp) return;
+
+        key = {item.slot, item.links, stamp};
+        items.push_back(item);
+
+        // at most half full - a larger table takes the items of the set again
+        if(++count * 2 > index.size())
+        {
+            index.assign(index.size() * 2, {0, 0, 0});
+
+            for(size_t at = sets.back(); at < items.size(); ++at) find_key(items[at].slot, items[at].links) = {items[at].slot, items[at].links, stamp};
+        }
+    };
+    // the entry of the nonterminal in the set - the productions are predicted with the first call
+    auto predict = [&](size_t nonterminal, size_t set) -> size_t
+    {
+        if(predicted[nonterminal].stamp == stamp) return predicted[nonterminal].links;
+
+        const size_t entry = links.size();
+
+        predicted[nonterminal] = {stamp, entry};
+
+        links.push_back({set, nonterminal, npos, npos, 0, 0, leo_state::unknown, false});
+
+        for(size_t production = m_earley_nonterminals[nonterminal]; production < m_earley_nonterminals[nonterminal + 1]; ++production)
+        {
+            Stats_Update(if(production < m_rules.size()) { ++stats.alternatives; ++stats.rules[production].tried; });
+
+            add({m_earley_productions[production].code, entry});
+        }
+        return entry;
+    };
+    // the callers of the entries of a finished set - a few completions of entries with several callers scan the set
+    // for them, the following ones chain them once for all the entries of the set (most completions of loops and of
+    // unambiguous grammars have a single caller, most sets are reached by a few completions)
+    auto find_callers = [&](size_t entry) -> size_t
+    {
+        const size_t origin = links[entry].origin;
+
+        check_stack::earley_origin& from = origins[origin];
+
+        if(from.links == npos) return links[entry].callers;
+
+        if(from.scans < 4)
+        {
+            ++from.scans;
+            return npos;
+        }
+        for(size_t at = from.links; (at < links.size()) && (links[at].origin == origin); ++at) callees[links[at].nonterminal] = at;
+
+        for(size_t at = sets[origin + 1]; at-- > sets[origin]; )
+        {
+            const instruction& instr = code[items[at].slot];
+
+            if(instr.op != op_code::call) continue;
+
+            check_stack::earley_links& callee = links[callees[instr.arg]];
+
+            callers.push_back({at, callee.callers});
+            callee.callers = callers.size() - 1;
+        }
+        from.links = npos;
+
+        return links[entry].callers;
+    };
+    // the Leo item of the completions with the entry - while the origin set has a single caller that ends with the
+    // call, the complete caller is followed to the callers of its own entry; an accepting item is not skipped
+    auto leo_item = [&](size_t entry, check_stack::earley_item& top) -> bool
+    {
+        bool found = false;
+
+        path.clear();
+
+        while(entry != npos)
+        {
+            const check_stack::earley_links& current = links[entry];
+
+            if(current.leo == leo_state::item)
+            {
+                top   = {current.leo_slot, current.leo_links};
+                found = true;
+                break;
+            }
+            // a cycle of unit productions ends at the entry being resolved
+            if(current.leo != leo_state::unknown) break;
+
+            const size_t caller = current.caller;
+
+            if((caller == npos) || current.several || (code[items[caller].slot + 1].op != op_code::ret))
+            {
+                links[entry].leo = leo_state::none;
+                break;
+            }
+            links[entry].leo = leo_state::pending;
+            path.push_back(entry);
+
+            const check_stack::earley_item& waiting = items[caller];
+
+            if((m_earley_productions[code[waiting.slot + 1].arg].nonterminal == ctx.start_index) && (links[waiting.links].origin == 0)) break;
+
+            entry = waiting.links;
+        }
+        for(size_t at = path.size(); at-- > 0; )
+        {
+            check_stack::earley_links& resolved = links[path[at]];
+
+            if(!found)
+            {
+                const check_stack::earley_item& waiting = items[resolved.caller];
+
+                top   = {waiting.slot + 1, waiting.links};
+                found = true;
+            }
+            resolved.leo_slot  = top.slot;
+            resolved.leo_links = top.links;
+            resolved.leo       = leo_state::item;
+        }
+        return found;
+    };
+
+    size_t set = 0;
+
+    for( ; ; ++set, ++token)
+    {
+        if constexpr(std::is_same_v<Token, token_data>)
+        {
+            if((token == end) && (ctx.source != nullptr))
+            {
+                pull_tokens(token, ctx);
+                end = ctx.end;
+            }
+        }
+
+        stamp = ++stack.m_earley_stamp;
+        count = 0;
+
+        sets     .push_back(items.size());
+        origins  .push_back({links.size(), 0});
+
+        for(const check_stack::earley_item& item : scanned) add(item);
+
+        scanned.clear();
+
+        if(set == 0) predict(ctx.start_index, 0);
+
+        for(size_t at = sets.back(); at < items.size(); ++at)
+        {
+            const check_stack::earley_item item  = items[at];
+            const instruction&             instr = code[item.slot];
+
+            switch(instr.op)
+            {
+                case op_code::match_type:
+                    if((token < end) && (token->type == token_type(instr.type))) scanned.push_back({item.slot + 1, item.links});
+                    break;
+
+                case op_code::match_id:
+                    if((token < end) && (token->type == token_type(instr.type)) && (token->id == symbol_id(instr.arg))) scanned.push_back({item.slot + 1, item.links});
+                    break;
+
+                case op_code::call:
+                    {
+                        check_stack::earley_links& callee = links[predict(instr.arg, set)];
+
+                        if(callee.caller == npos) callee.caller = at; else callee.several = true;
+
+                        if(m_earley_empty[instr.arg] != npos) add({item.slot + 1, item.links});
+                    }
+                    break;
+
+                case op_code::ret:
+                    {
+                        const size_t production  = instr.arg;
+                        const size_t nonterminal = m_earley_productions[production].nonterminal;
+                        const size_t origin      = links[item.links].origin;
+
+                        if((profile != nullptr) && (production < m_rules.size())) ++profile->m_rules[production].passed;
+
+                        if((nonterminal == ctx.start_index) && (origin == 0) && (accepted != set))
+                        {
+                            accepted = set;
+                            root     = at;
+                        }
+                        // the callers of a production that matched no tokens were advanced when they called it
+                        if(origin == set) break;
+
+                        check_stack::earley_item top;
+
+                        if(use_leo && leo_item(item.links, top))
+                        {
+                            add(top);
+                            break;
+                        }
+                        const check_stack::earley_links& entry = links[item.links];
+
+                        if(!entry.several)
+                        {
+                            if(entry.caller != npos) add({items[entry.caller].slot + 1, items[entry.caller].links});
+                            break;
+                        }
+                        const size_t first = find_callers(item.links);
+
+                        if(first == npos)
+                        {
+                            for(size_t caller = sets[origin]; caller < sets[origin + 1]; ++caller)
+                            {
+                                const check_stack::earley_item waiting = items[caller];
+
+                                if((code[waiting.slot].op == op_code::call) && (code[waiting.slot].arg == nonterminal)) add({waiting.slot + 1, waiting.links});
+                            }
+                            break;
+                        }
+                        for(size_t caller = first; caller != npos; caller = callers[caller].next)
+                        {
+                            const check_stack::earley_item& waiting = items[callers[caller].item];
+
+                            add({waiting.slot + 1, waiting.links});
+                        }
+                    }
+                    break;
+
+                default: Assert_Fail(); return parse_error::GrammarCheckFailed;
+            }
+        }
+        if(scanned.empty()) break;
+    }
+    sets.push_back(items.size());
+
+    if(accepted == npos) return parse_error::GrammarCheckFailed;
+
+    // back to the end of the accepted tokens, a token_source may have dropped them already
+    token -= std::min(size_t(token - ctx.begin), set - accepted);
+
+    if(ctx.tree != nullptr) earley_tree(root, accepted, first_token, ctx);
+
+    return parse_error::None;
+}
+
+// The parse tree of the accepted tokens, read back from the chart starting with the complete start item. An item is
+// split into the item before its last instruction and what that instruction matched - a token, a complete item of the
+// called nonterminal or no tokens for a nullable one, see m_earley_empty. Only items added to the chart before the
+// item being split are taken, so the walk ends in cyclic grammars as well; the ones that added it are among them.
+template<class Token>
+void grammar::earley_tree(size_t root_item, size_t end, size_t first_token, verify_context<Token>& ctx) const
+{
+    using walk = check_stack::earley_walk;
+
+    const std::vector<check_stack::earley_item>&  items = ctx.stack.m_earley_items;
+    const std::vector<size_t>&                    sets  = ctx.stack.m_earley_sets;
+    const std::vector<check_stack::earley_links>& links = ctx.stack.m_earley_links;
+
+    std::vector<size_t>&                    next    = ctx.stack.m_earley_next;
+    std::vector<check_stack::earley_step>&  steps   = ctx.stack.m_earley_steps;
+    std::vector<parse_node>&                nodes   = ctx.stack.m_nodes;
+    std::vector<check_stack::earley_entry>& entries = ctx.stack.m_earley_entries;
+
+    // the entry of the item of set at slot with origin - or with origin npos, the first complete item of nonterminal slot
+    auto find_entry = [&entries](size_t set, size_t slot, size_t origin) -> check_stack::earley_entry&
+    {
+        const size_t mask = entries.size() - 1;
+
+        size_t at = size_t(((((std::uint64_t(set) * 0x9E3779B97F4A7C15u) ^ std::uint64_t(slot)) * 0xC2B2AE3D27D4EB4Fu) ^ std::uint64_t(origin)) * 0x9E3779B97F4A7C15u >> 32) & mask;
+
+        while((entries[at].item != npos) && ((entries[at].set != set) || (entries[at].slot != slot) || (entries[at].origin != origin))) at = (at + 1) & mask;
+
+        return entries[at];
+    };
+    // the item of set at slot with origin, added before item before
+    auto find_item = [&find_entry](size_t set, size_t slot, size_t origin, size_t before)
+    {
+        const size_t at = find_entry(set, slot, origin).item;
+
+        return (at < before) ? at : npos;
+    };
+
+    // every item and the complete items of every nonterminal of a set, chained through next in the order they were
+    // added
+    size_t entries_size = 64;
+
+    while(entries_size < items.size() * 2) entries_size *= 2;
+
+    entries.assign(entries_size, {0, 0, 0, npos});
+    next   .resize(items.size());
+
+    for(size_t set = sets.size() - 1; set-- > 0; )
+    {
+        for(size_t at = sets[set + 1]; at-- > sets[set]; )
+        {
+            const check_stack::earley_item& item  = items[at];
+            const instruction&              instr = m_earley_code[item.slot];
+
+            const size_t origin = links[item.links].origin;
+
+            find_entry(set, item.slot, origin) = {set, item.slot, origin, at};
+
+            if(instr.op != op_code::ret) continue;
+
+            check_stack::earley_entry& first = find_entry(set, m_earley_productions[instr.arg].nonterminal, npos);
+
+            next[at] = first.item;
+            first    = {set, m_earley_productions[instr.arg].nonterminal, npos, at};
+        }
+    }
+
+    steps.clear();
+    steps.push_back({walk::item, root_item, 0, end, 0});
+
+    // the steps pushed last run first - a node is pushed before its children and the children from the last one
+    while(!steps.empty())
+    {
+        const check_stack::earley_step step = steps.back();
+
+        steps.pop_back();
+
+        switch(step.type)
+        {
+            case walk::item:
+                {
+                    size_t item = step.arg;
+                    size_t pos  = step.end;
+
+                    const size_t production = m_earley_code[items[item].slot].arg;
+                    const size_t origin     = links[items[item].links].origin;
+
+                    if(production < m_rules.size()) steps.push_back({walk::node, production, origin, pos, nodes.size()});
+
+                    for(size_t slot = items[item].slot; slot > m_earley_productions[production].code; --slot)
+                    {
+                        const instruction& instr = m_earley_code[slot - 1];
+
+                        size_t before = npos;
+
+                        if(instr.op != op_code::call)
+                        {
+                            before = find_item(--pos, slot - 1, origin, npos);
+                        }
+                        else
+                        {
+                            // the complete items of the called nonterminal in the set, in the order they were added
+                            const size_t completed = find_entry(pos, instr.arg, npos).item;
+
+                            for(size_t at = completed; (before == npos) && (at < item); at = next[at])
+                            {
+                                const size_t from = links[items[at].links].origin;
+
+                                if((from < origin) || (from >= pos)) continue;
+
+                                before = find_item(from, slot - 1, origin, npos);
+
+                                if(before == npos) continue;
+
+                                steps.push_back({walk::item, at, 0, pos, 0});
+                                pos = from;
+                            }
+                            if(before == npos)
+                            {
+                                before = find_item(pos, slot - 1, origin, item);
+
+                                steps.push_back({walk::empty, instr.arg, pos, pos, 0});
+                            }
+                        }
+                        Assert_Check(before != npos);
+
+                        item = before;
+                    }
+                }
+                break;
+
+            case walk::empty:
+                {
+                    const size_t production = m_earley_empty[step.arg];
+                    const size_t first_slot = m_earley_productions[production].code;
+
+                    if(production < m_rules.size()) steps.push_back({walk::node, production, step.end, step.end, nodes.size()});
+
+                    size_t last_slot = first_slot;
+
+                    while(m_earley_code[last_slot].op != op_code::ret) ++last_slot;
+
+                    for(size_t slot = last_slot; slot > first_slot; --slot)
+                    {
+                        steps.push_back({walk::empty, m_earley_code[slot - 1].arg, step.end, step.end, 0});
+                    }
+                }
+                break;
+
+            case walk::node:
+                {
+                    parse_tree_t& tree = *ctx.tree;
+
+                    const size_t symbol_index   = m_earley_productions[step.arg].nonterminal;
+                    const size_t first_child    = tree.size();
+                    const size_t children_count = nodes.size() - step.nodes;
+
+                    tree.insert(tree.end(), nodes.begin() + std::ptrdiff_t(step.nodes), nodes.end());
+                    nodes.resize(step.nodes);
+
+                    nodes.push_back({
+                        m_rules[step.arg].id,
+                        unsigned(step.arg - m_symbols[symbol_index].first_rule),
+                        first_token + step.start,
+                        step.end - step.start,
+                        first_child,
+                        children_count});
+                }
+                break;
+        }
+    }
+}
+
+struct validation_pool::state
+{
+    // the range and the context are on separate cache lines - thieves read the range, only the owner uses the context
+    struct worker
+    {
+        alignas(64) std::atomic<std::uint64_t> range {0}; // first input << 32 | end of the inputs left to the worker
+
+        alignas(64) check_context ctx;
+    };
+
+    void thread_main(size_t index);
+    void work(size_t index);
+
+    bool take (worker& w, size_t& input);
+    bool steal(worker& thief, size_t& input);
+
+    size_t                    workers_count = 0;
+    std::unique_ptr<worker[]> workers;
+    std::vector<std::thread>  threads;
+
+    std::mutex              mutex;
+    std::condition_variable start;
+    std::condition_variable done;
+
+    size_t generation = 0; // batches started
+    size_t running    = 0; // threads that have not finished the current batch
+    bool   stop       = false;
+
+    // the current batch
+    const tokenizer*        tk      = nullptr;
+    const grammar*          g       = nullptr;
+    const std::string_view* inputs  = nullptr;
+    result_t*               results = nullptr;
+    size_t                  base    = 0; // index of the first input of the slice being validated
+};
+
+validation_pool::validation_pool(size_t threads_count) : m_state(new state)
+{
+    if(threads_count == 0) threads_count = std::thread::hardware_concurrency();
+    if(threads_count == 0) threads_count = 1;
+
+    m_state->workers_count = threads_count;
+    m_state->workers.reset(new state::worker[threads_count]);
+
+    // worker 0 is the thread that calls validate_many
+    m_state->threads.reserve(threads_count - 1);
+
+    for(size_t index = 1; index < threads_count; ++index)
+    {
+        m_state->threads.emplace_back(&state::thread_main, m_state, index);
+    }
+}
+
+validation_pool::~validation_pool()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_state->mutex);
+        m_state->stop = true;
+    }
+    m_state->start.notify_all();
+
+    for(std::thread& thread : m_state->threads) thread.join();
+
+    delete m_state;
+}
+
+size_t validation_pool::get_threads_count() const
+{
+    return m_state->workers_count;
+}
+
+void validation_pool::validate_many(
+    const tokenizer& t,
+    const grammar& g,
+    const std::string_view* inputs,
+    result_t* results,
+    size_t count
+    )
+{
+    Check_ValidArg((count == 0) || ((inputs != nullptr) && (results != nullptr)),);
+
+    state& st = *m_state;
+
+    // the ranges of the workers hold 32 bit indexes, bigger batches are validated in slices
+    constexpr size_t max_slice = size_t(1) << 31;
+
+    for(size_t base = 0; base < count; base += max_slice)
+    {
+        const size_t slice = std::min(count - base, max_slice);
+
+        for(size_t index = 0; index < st.workers_count; ++index)
+        {
+            const std::uint64_t first = slice *  index      / st.workers_count;
+            const std::uint64_t last  = slice * (index + 1) / st.workers_count;
+
+            st.workers[index].range.store((first << 32) | last, std::memory_order_relaxed);
+        }
+        {
+            std::lock_guard<std::mutex> lock(st.mutex);
+
+            st.tk      = &t;
+            st.g       = &g;
+            st.inputs  = inputs;
+            st.results = results;
+            st.base    = base;
+            st.running = st.threads.size();
+
+            ++st.generation;
+        }
+        st.start.notify_all();
+
+        st.work(0);
+
+        std::unique_lock<std::mutex> lock(st.mutex);
+
+        st.done.wait(lock, [&st] { return (st.running == 0); });
+    }
+}
+
+check_stats validation_pool::get_stats() const
+{
+    check_stats stats;
+
+    for(size_t index = 0; index < m_state->workers_count; ++index)
+    {
+        stats += m_state->workers[index].ctx.stack.get_stats();
+    }
+    return stats;
+}
+
+void validation_pool::reset_stats()
+{
+    for(size_t index = 0; index < m_state->workers_count; ++index)
+    {
+        m_state->workers[index].ctx.stack.reset_stats();
+    }
+}
+
+void validation_pool::state::thread_main(size_t index)
+{
+    size_t current = 0;
+
+    for(;;)
+    {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+
+            start.wait(lock, [this, current] { return stop || (generation != current); });
+
+            if(stop) return;
+
+            current = generation;
+        }
+
+        work(index);
+
+        bool last;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            last = (--running == 0);
+        }
+        if(last) done.notify_one();
+    }
+}
+
+void validation_pool::state::work(size_t index)
+{
+    worker& w = workers[index];
+
+    size_t input;
+
+    while(take(w, input) || steal(w, input))
+    {
+        const std::string_view& str = inputs[base + input];
+
+        result_t result = tk->tokenize(w.ctx, str.data(), str.size());
+
+        if(result) result = g->check(w.ctx);
+
+        results[base + input] = result;
+    }
+}
+
+bool validation_pool::state::take(worker& w, size_t& input)
+{
+    std::uint64_t range = w.range.load(std::memory_order_acquire);
+
+    for(;;)
+    {
+        const std::uint64_t first = (range >> 32);
+        const std::uint64_t last  = (range & 0xFFFFFFFFu);
+
+        if(first >= last) return false;
+
+        if(w.range.compare_exchange_weak(range, ((first + 1) << 32) | last, std::memory_order_acq_rel))
+        {
+            input = size_t(first);
+            return true;
+        }
+    }
+}
+
+// takes the second half of the inputs left to another worker - the first of them is validated at once, the others
+// become the range of the thief (where other thieves may find them in turn)
+bool validation_pool::state::steal(worker& thief, size_t& input)
+{
+    const size_t thief_index = size_t(&thief - workers.get());
+
+    for(size_t offset = 1; offset < workers_count; ++offset)
+    {
+        worker& victim = workers[(thief_index + offset) % workers_count];
+
+        std::uint64_t range = victim.range.load(std::memory_order_acquire);
+
+        for(;;)
+        {
+            const std::uint64_t first = (range >> 32);
+            const std::uint64_t last  = (range & 0xFFFFFFFFu);
+
+            if(first >= last) break;
+
+            const std::uint64_t middle = first + (last - first) / 2;
+
+            if(victim.range.compare_exchange_weak(range, (first << 32) | middle, std::memory_order_acq_rel))
+            {
+                thief.range.store(((middle + 1) << 32) | last, std::memory_order_release);
+
+                input = size_t(middle);
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+//
+// grammar_image - a header followed by the tables of the tokenizer and the grammar. Arrays are stored as an
+// element count followed by the elements in memory layout (the header pins the size_t width and the byte order),
+// zero padded before the elements to their alignment from the start of the image; structs with padding or pointers
+// are stored field by field.
+//
+static constexpr char          image_magic[4]   = {'F', 'A', 'G', 'R'};
+static constexpr std::uint32_t image_byte_order = 0x01020304u;
+
+struct image_header
+{
+    char          magic[4];
+    std::uint32_t version;
+    std::uint32_t size_width;
+    std::uint32_t byte_order;
+    std::uint64_t payload_size;
+    std::uint64_t checksum;
+};
+static_assert(sizeof(image_header) == 32, "image header size");
+
+// FNV-1a over 64 bit words - the image may be several megabytes, a byte wise hash would cost more than the loading
+static std::uint64_t image_checksum(const char* data, size_t size)
+{
+    std::uint64_t hash = 0xCBF29CE484222325u;
+
+    const char* end = data + size;
+
+    for( ; size_t(end - data) >= sizeof(std::uint64_t); data += sizeof(std::uint64_t))
+    {
+        std::uint64_t word;
+        std::memcpy(&word, data, sizeof(word));
+
+        hash = (hash ^ word) * 0x100000001B3u;
+        hash ^= (hash >> 29);
+    }
+    for( ; data < end; ++data)
+    {
+        hash = (hash ^ (unsigned char)*data) * 0x100000001B3u;
+    }
+    return hash;
+}
+
+class grammar_image::writer
+{
+public:
+    explicit writer(std::vector<char>& out) : m_out(out) {}
+
+    void put_bytes(const void* data, size_t size)
+    {
+        const char* bytes = static_cast<const char*>(data);
+
+        m_out.insert(m_out.end(), bytes, bytes + size);
+    }
+
+    template<class T>
+    void put(const T& value)
+    {
+        static_assert(std::has_unique_object_representations_v<T>, "padding would be saved");
+
+        put_bytes(&value, sizeof(T));
+    }
+
+    template<class Array>
+    void put_array(const Array& values)
+    {
+        using T = typename Array::value_type;
+
+        static_assert(std::has_unique_object_representations_v<T>, "padding would be saved");
+
+        put(std::uint64_t(values.size()));
+
+        m_out.resize((m_out.size() + alignof(T) - 1) / alignof(T) * alignof(T), 0);
+
+        put_bytes(values.data(), values.size() * sizeof(T));
+    }
+
+private:
+    std::vector<char>& m_out;
+};
+
+class grammar_image::reader
+{
+public:
+    // image is the start of the image, the offsets of the array elements are aligned from there
+    reader(const char* image, const char* data, size_t size, bool mapped) : m_image(image), m_pos(data), m_end(data + size), m_mapped(mapped) {}
+
+    // the tables are read in place where they are aligned (load_mapped)
+    bool mapped() const { return m_mapped; }
+
+    bool contains(const void* data) const
+    {
+        return (m_image <= static_cast<const char*>(data)) && (static_cast<const char*>(data) < m_end);
+    }
+
+    // null when the image ends before size bytes
+    const char* get_bytes(size_t size)
+    {
+        if(size > size_t(m_end - m_pos)) return nullptr;
+
+        const char* bytes = m_pos;
+        m_pos += size;
+        return bytes;
+    }
+
+    template<class T>
+    bool get(T& value)
+    {
+        const char* bytes = get_bytes(sizeof(T));
+
+        if(bytes == nullptr) return false;
+
+        std::memcpy(&value, bytes, sizeof(T));
+        return true;
+    }
+
+    // binds the table to the elements in the image when it is mapped and they are aligned in memory, the image of
+    // load() or one at a misaligned address is copied
+    template<class T>
+    bool get_array(prepared_table<T>& values)
+    {
+        std::uint64_t count;
+
+        if(!get(count) || (get_bytes((alignof(T) - size_t(m_pos - m_image) % alignof(T)) % alignof(T)) == nullptr) ||
+            (count > std::uint64_t(m_end - m_pos) / sizeof(T)))
+        {
+            return false;
+        }
+
+        const char* bytes = get_bytes(size_t(count) * sizeof(T));
+
+        if(m_mapped && (reinterpret_cast<std::uintptr_t>(bytes) % alignof(T) == 0))
+        {
+            values.bind(reinterpret_cast<const T*>(bytes), size_t(count));
+            return true;
+        }
+        values.resize(size_t(count));
+
+        if(count != 0) std::memcpy(values.data(), bytes, size_t(count) * sizeof(T));
+        return true;
+    }
+
+    const char* position() const { return m_pos; }
+
+private:
+    const char* m_image;
+    const char* m_pos;
+    const char* m_end;
+    bool        m_mapped;
+};
+
+result_t grammar_image::save(const tokenizer& tk, const grammar& g, std::vector<char>& out)
+{
+    Check_ValidState(g.m_start_index != grammar::npos, {parse_error::UnpreparedGramar, symbol_id(0), 0});
+
+    out.clear();
+    out.resize(sizeof(image_header));
+
+    writer image(out);
+
+    save_tokenizer(image, tk);
+    save_grammar  (image, g);
+
+    image_header header {};
+
+    std::memcpy(header.magic, image_magic, sizeof(header.magic));
+
+    header.version      = version;
+    header.size_width   = std::uint32_t(sizeof(size_t));
+    header.byte_order   = image_byte_order;
+    header.payload_size = out.size() - sizeof(image_header);
+    header.checksum     = image_checksum(out.data() + sizeof(image_header), out.size() - sizeof(image_header));
+
+    std::memcpy(out.data(), &header, sizeof(header));
+
+    return {parse_error::None, symbol_id(0), 0};
+}
+
+result_t grammar_image::load(tokenizer& tk, grammar& g, const void* data, size_t size)
+{
+    return load_image(tk, g, data, size, false);
+}
+
+result_t grammar_image::load_mapped(tokenizer& tk, grammar& g, const void* data, size_t size)
+{
+    return load_image(tk, g, data, size, true);
+}
+
+result_t grammar_image::load_image(tokenizer& tk, grammar& g, const void* data, size_t size, bool mapped)
+{
+    Check_ValidArg(data != nullptr, {parse_error::InvalidArguments, symbol_id(0), 0});
+
+    tk.clear();
+    g .clear();
+
+    const char* image = static_cast<const char*>(data);
+
+    image_header header;
+
+    if(size < sizeof(header)) return {parse_error::InvalidImage, symbol_id(0), 0};
+
+    std::memcpy(&header, image, sizeof(header));
+
+    if((std::memcmp(header.magic, image_magic, sizeof(header.magic)) != 0) ||
+        (header.version != version) ||
+        (header.size_width != sizeof(size_t)) ||
+        (header.byte_order != image_byte_order) ||
+        (header.payload_size != size - sizeof(header)) ||
+        (header.checksum != image_checksum(image + sizeof(header), size - sizeof(header))))
+    {
+        return {parse_error::InvalidImage, symbol_id(0), 0};
     }
-    return true;
+
+    reader in(image, image + sizeof(header), size - sizeof(header), mapped);
+
+    if(!load_tokenizer(in, tk) || !load_grammar(in, g) || (in.get_bytes(1) != nullptr))
+    {
+        const size_t pos = size_t(in.position() - image);
+
+        tk.clear();
+        g .clear();
+
+        return {parse_error::InvalidImage, symbol_id(0), pos};
+    }
+    return {parse_error::None, symbol_id(0), 0};
 }
 
-parse_error tokenizer::extract_token_number(const char* str, const token_data& token, float& number)
+void grammar_image::save_tokenizer(writer& out, const tokenizer& tk)
 {
-    Check_ValidArg(str != nullptr, parse_error::InvalidArguments);
+    out.put(tk.m_flags);
+    out.put_bytes(tk.m_char_classes.data(), tk.m_char_classes.size());
 
-    if(token.type != token_type::number) return parse_error::WrongTokenType;
+    for(const tokenizer::token_descs_t* descs : {&tk.m_punctuations, &tk.m_keywords})
+    {
+        out.put(std::uint64_t(descs->size()));
 
-    const char* start = str + token.pos;
-    char* end;
-    number = std::strtof(start, &end);
+        for(const tokenizer::token_desc& desc : *descs)
+        {
+            out.put(desc.id);
+            out.put(desc.len);
+            out.put_bytes(desc.str, desc.len + 1);
+        }
+    }
+    for(const tokenizer::token_index* index : {&tk.m_punctuation_index, &tk.m_keyword_index})
+    {
+        out.put_bytes(index->chars.data(), index->chars.size());
+        out.put(index->alphabet);
+        out.put(index->max_len);
+        out.put_array(index->trie);
+        out.put_array(index->leaf);
+    }
+}
 
-    Assert_Check(size_t(end - start) == token.len);
+bool grammar_image::load_tokenizer(reader& in, tokenizer& tk)
+{
+    const char* char_classes = nullptr;
 
-    return parse_error::None;
+    if(!in.get(tk.m_flags) || ((char_classes = in.get_bytes(tk.m_char_classes.size())) == nullptr)) return false;
+
+    std::memcpy(tk.m_char_classes.data(), char_classes, tk.m_char_classes.size());
+
+    // the terminating zero never has a class, see reset_char_classes
+    if(tk.m_char_classes[0] != 0) return false;
+
+    for(unsigned char classes : tk.m_char_classes)
+    {
+        if((classes & ~unsigned(tokenizer::Char_All)) != 0) return false;
+    }
+
+    tk.m_space_set = tokenizer::make_scan_set(tk.m_char_classes, tokenizer::Char_Space);
+    tk.m_ident_set = tokenizer::make_scan_set(tk.m_char_classes, tokenizer::Char_Ident);
+
+    // the strings are copied to the tokenizer, the descs get their addresses once all of them are there (load_mapped
+    // points them to the image)
+    std::vector<size_t> offsets;
+
+    for(tokenizer::token_descs_t* descs : {&tk.m_punctuations, &tk.m_keywords})
+    {
+        std::uint64_t count;
+
+        if(!in.get(count)) return false;
+
+        for(std::uint64_t index = 0; index < count; ++index)
+        {
+            tokenizer::token_desc desc {symbol_id(0), nullptr, 0};
+
+            if(!in.get(desc.id) || !in.get(desc.len) || (desc.len == 0) || (desc.len == size_t(-1))) return false;
+
+            const char* str = in.get_bytes(desc.len + 1);
+
+            if((str == nullptr) || (str[desc.len] != 0)) return false;
+
+            if(in.mapped())
+            {
+                desc.str = str;
+            }
+            else
+            {
+                offsets.push_back(tk.m_strings.size());
+                tk.m_strings.insert(tk.m_strings.end(), str, str + desc.len + 1);
+            }
+            descs->push_back(desc);
+        }
+    }
+    if(!in.mapped())
+    {
+        size_t string_index = 0;
+
+        for(tokenizer::token_descs_t* descs : {&tk.m_punctuations, &tk.m_keywords})
+        {
+            for(tokenizer::token_desc& desc : *descs) desc.str = tk.m_strings.data() + offsets[string_index++];
+        }
+    }
+    for(tokenizer::token_index* index : {&tk.m_punctuation_index, &tk.m_keyword_index})
+    {
+        const size_t descs_count = (index == &tk.m_punctuation_index) ? tk.m_punctuations.size() : tk.m_keywords.size();
+
+        const char* chars = in.get_bytes(sizeof(tokenizer::no_chars));
+
+        if((chars == nullptr) || !in.get(index->alphabet) || !in.get(index->max_len) ||
+            !in.get_array(index->trie) || !in.get_array(index->leaf))
+        {
+            return false;
+        }
+        const unsigned char* index_chars = reinterpret_cast<const unsigned char*>(chars);
+
+        if(in.mapped())
+        {
+            index->chars.bind(index_chars, sizeof(tokenizer::no_chars));
+        }
+        else
+        {
+            index->chars.assign(index_chars, index_chars + sizeof(tokenizer::no_chars));
+        }
+
+        // checked through a const index, a mutable access would copy the tables bound to the image
+        const tokenizer::token_index& loaded = *index;
+
+        if(loaded.max_len == 0) continue;
+
+        if((loaded.alphabet == 0) || (loaded.leaf.empty()) || (loaded.trie.size() / loaded.alphabet != loaded.leaf.size()) ||
+            (loaded.trie.size() % loaded.alphabet != 0))
+        {
+            return false;
+        }
+
+        // matching stops at the terminating zero only when it is not in the alphabet and has no edges
+        if(loaded.chars[0] != 0) return false;
+
+        for(size_t node = 0; node < loaded.leaf.size(); ++node)
+        {
+            if(loaded.trie[node * loaded.alphabet] != 0) return false;
+        }
+
+        for(unsigned char ch : loaded.chars)       if(ch >= loaded.alphabet)          return false;
+        for(unsigned node : loaded.trie)           if(node >= loaded.leaf.size())     return false;
+        for(unsigned desc_index : loaded.leaf)     if(desc_index > descs_count)       return false;
+    }
+    return true;
 }
-parse_error tokenizer::extract_token_number(const char* str, const token_data& token, double& number)
+
+void grammar_image::save_grammar(writer& out, const grammar& g)
 {
-    Check_ValidArg(str != nullptr, parse_error::InvalidArguments);
+    out.put(g.m_start_index);
+    out.put(g.m_engine);
 
-    if(token.type != token_type::number) return parse_error::WrongTokenType;
+    out.put_array(g.m_chunks);
+    out.put_array(g.m_rules);
 
-    const char* start = str + token.pos;
-    char* end;
-    number = std::strtod(start, &end);
+    out.put(std::uint64_t(g.m_symbols.size()));
 
-    Assert_Check(size_t(end - start) == token.len);
+    for(const grammar::symbol_data& symbol : g.m_symbols)
+    {
+        out.put(symbol.id);
+        out.put(symbol.first_rule);
+        out.put(symbol.last_rule);
+    }
 
-    return parse_error::None;
+    out.put_array(g.m_loop_ends);
+
+    out.put(g.m_classes_count);
+    out.put(g.m_class_words);
+    out.put_array(g.m_keyword_classes);
+    out.put_array(g.m_punctuation_classes);
+
+    out.put_array(g.m_rule_first);
+    out.put_array(g.m_rule_nullable);
+
+    out.put_array(g.m_dispatch);
+    out.put_array(g.m_dispatch_rules);
+
+    out.put_array(g.m_ll1_table);
+    out.put_array(g.m_ll1_loop_first);
+
+    out.put_array(g.m_code);
+    out.put_array(g.m_rule_code);
+    out.put_array(g.m_loop_code);
+    out.put_array(g.m_inline_sets);
+
+    out.put_array(g.m_earley_code);
+    out.put_array(g.m_earley_productions);
+    out.put_array(g.m_earley_nonterminals);
+    out.put_array(g.m_earley_empty);
 }
-parse_error tokenizer::extract_token_string(
-    const char* str,
-    const token_data& token,
-    std::string& out,
-    bool unescape,
-    bool addQuotes
-    )
+
+// The tables are taken as they are; the indices in them are range checked so a damaged image that passed the
+// checksum fails here instead of in check().
+bool grammar_image::load_grammar(reader& in, grammar& g)
 {
-    Check_ValidArg(str != nullptr, parse_error::InvalidArguments);
+    std::uint64_t symbols_count;
 
-    if(token.type != token_type::string) return parse_error::WrongTokenType;
+    if(!in.get(g.m_start_index) || !in.get(g.m_engine) ||
+        !in.get_array(g.m_chunks) || !in.get_array(g.m_rules) || !in.get(symbols_count))
+    {
+        return false;
+    }
+    for(std::uint64_t index = 0; index < symbols_count; ++index)
+    {
+        grammar::symbol_data symbol;
 
-    const char* start = str + token.pos;
-    const char* end   = str + token.pos + token.len;
+        if(!in.get(symbol.id) || !in.get(symbol.first_rule) || !in.get(symbol.last_rule)) return false;
 
-    if(!addQuotes)
+        g.m_symbols.push_back(symbol);
+    }
+
+    if(!in.get_array(g.m_loop_ends) ||
+        !in.get(g.m_classes_count) || !in.get(g.m_class_words) ||
+        !in.get_array(g.m_keyword_classes) || !in.get_array(g.m_punctuation_classes) ||
+        !in.get_array(g.m_rule_first) || !in.get_array(g.m_rule_nullable) ||
+        !in.get_array(g.m_dispatch) || !in.get_array(g.m_dispatch_rules) ||
+        !in.get_array(g.m_ll1_table) || !in.get_array(g.m_ll1_loop_first) ||
+        !in.get_array(g.m_code) || !in.get_array(g.m_rule_code) || !in.get_array(g.m_loop_code) || !in.get_array(g.m_inline_sets) ||
+        !in.get_array(g.m_earley_code) || !in.get_array(g.m_earley_productions) || !in.get_array(g.m_earley_nonterminals) ||
+        !in.get_array(g.m_earley_empty))
     {
-        ++start;
-        --end;
+        return false;
     }
-    if(!unescape)
+
+    // checked through a const grammar, a mutable access would copy the tables bound to the image
+    const grammar& loaded = g;
+
+    const size_t chunks  = loaded.m_chunks .size();
+    const size_t rules   = loaded.m_rules  .size();
+    const size_t symbols = loaded.m_symbols.size();
+    const size_t classes = loaded.m_classes_count;
+    const size_t words   = loaded.m_class_words;
+    const size_t loops   = loaded.m_loop_code.size();
+
+    if((loaded.m_start_index >= symbols) ||
+        ((loaded.m_engine != grammar_engine::backtracking) && (loaded.m_engine != grammar_engine::ll1) && (loaded.m_engine != grammar_engine::earley)) ||
+        (classes < grammar::Class_Fixed_Count) || (words != (classes + 63) / 64) ||
+        (loaded.m_loop_ends.size() != chunks) ||
+        (loaded.m_rule_first.size() != rules * words) || (loaded.m_rule_nullable.size() != rules) ||
+        (loaded.m_dispatch.size() != symbols * classes + 1) ||
+        (loaded.m_rule_code.size() != rules) || (loaded.m_inline_sets.size() != symbols * words) ||
+        ((loaded.m_engine == grammar_engine::ll1) && ((loaded.m_ll1_table.size() != symbols * classes) || (loaded.m_ll1_loop_first.size() != loops * words))))
     {
-        out = std::string(start, end);
+        return false;
     }
-    else
+
+    for(const grammar::rule_data& rule : loaded.m_rules)
     {
-        out.clear();
-        out.reserve(token.len + 1);
-        for(const char* pch = start; pch < end; ++pch)
+        if((rule.first_chunk > chunks) || (rule.last_chunk >= chunks) || (rule.last_chunk + 1 < rule.first_chunk)) return false;
+    }
+    for(const grammar::symbol_data& symbol : loaded.m_symbols)
+    {
+        if((symbol.first_rule > symbol.last_rule) || (symbol.last_rule >= rules)) return false;
+    }
+    for(unsigned cls : loaded.m_keyword_classes)     if(cls >= classes)                       return false;
+    for(unsigned cls : loaded.m_punctuation_classes) if(cls >= classes)                       return false;
+    for(size_t index = 1; index < loaded.m_dispatch.size(); ++index)
+    {
+        if(loaded.m_dispatch[index - 1] > loaded.m_dispatch[index]) return false;
+    }
+    if(loaded.m_dispatch.back() != loaded.m_dispatch_rules.size()) return false;
+
+    for(size_t rule  : loaded.m_dispatch_rules)      if(rule >= rules)                        return false;
+    for(size_t rule  : loaded.m_ll1_table)           if((rule != grammar::npos) && (rule >= rules)) return false;
+    for(size_t code  : loaded.m_rule_code)           if(code >= loaded.m_code.size())              return false;
+
+    for(const grammar::loop_code& loop : loaded.m_loop_code)
+    {
+        if((loop.body >= loaded.m_code.size()) || (loop.exit > loaded.m_code.size())) return false;
+    }
+    for(const grammar::instruction& instr : loaded.m_code)
+    {
+        switch(instr.op)
         {
-            if(pch[0] == '\\')
+            case grammar::op_code::match_type:
+            case grammar::op_code::match_id:
+            case grammar::op_code::ret:
+                break;
+
+            case grammar::op_code::match_set:
+            case grammar::op_code::call:
+                if(instr.arg >= symbols) return false;
+                break;
+
+            case grammar::op_code::loop:
+            case grammar::op_code::next:
+                if(instr.arg >= loops) return false;
+                break;
+
+            default: return false;
+        }
+    }
+
+    // the earley productions - every one runs up to a ret of its own, the first ones are the rules of the symbols
+    const size_t nonterminals = loaded.m_earley_nonterminals.empty() ? 0 : (loaded.m_earley_nonterminals.size() - 1);
+    const size_t productions  = loaded.m_earley_productions.size();
+
+    if(loaded.m_engine != grammar_engine::earley)
+    {
+        return loaded.m_earley_code.empty() && (productions == 0) && loaded.m_earley_nonterminals.empty() && loaded.m_earley_empty.empty();
+    }
+    if((nonterminals < symbols) || (loaded.m_earley_nonterminals.front() != 0) || (loaded.m_earley_nonterminals.back() != productions) ||
+        (loaded.m_earley_nonterminals[symbols] != rules) || (loaded.m_earley_empty.size() != nonterminals))
+    {
+        return false;
+    }
+    for(size_t nonterminal = 0; nonterminal < nonterminals; ++nonterminal)
+    {
+        const size_t first = loaded.m_earley_nonterminals[nonterminal];
+        const size_t last  = loaded.m_earley_nonterminals[nonterminal + 1];
+
+        if(first > last) return false;
+
+        if((nonterminal < symbols) && ((first != loaded.m_symbols[nonterminal].first_rule) || (last != loaded.m_symbols[nonterminal].last_rule + 1))) return false;
+
+        for(size_t production = first; production < last; ++production)
+        {
+            if(loaded.m_earley_productions[production].nonterminal != nonterminal) return false;
+        }
+    }
+    for(size_t production = 0; production < productions; ++production)
+    {
+        size_t slot = loaded.m_earley_productions[production].code;
+
+        for( ; (slot < loaded.m_earley_code.size()) && (loaded.m_earley_code[slot].op != grammar::op_code::ret); ++slot)
+        {
+            const grammar::instruction& instr = loaded.m_earley_code[slot];
+
+            switch(instr.op)
             {
-                switch(pch[1])
+                case grammar::op_code::match_type:
+                case grammar::op_code::match_id:
+                    break;
+
+                case grammar::op_code::call:
+                    if(instr.arg >= nonterminals) return false;
+                    break;
+
+                default: return false;
+            }
+        }
+        if((slot == loaded.m_earley_code.size()) || (loaded.m_earley_code[slot].arg != production)) return false;
+    }
+
+    // the walk of the empty productions ends only with the table prepare() makes - it is made again and compared,
+    // a table bound to the image is bound to it again
+    const size_t* image_empty = loaded.m_earley_empty.data();
+
+    const std::vector<size_t> empty(image_empty, image_empty + loaded.m_earley_empty.size());
+
+    g.prepare_earley_empty();
+
+    if(!std::equal(empty.begin(), empty.end(), loaded.m_earley_empty.begin(), loaded.m_earley_empty.end())) return false;
+
+    if(in.contains(image_empty)) g.m_earley_empty.bind(image_empty, empty.size());
+    return true;
+}
+
+
+//
+// sentence_generator
+//
+sentence_generator::sentence_generator(const tokenizer& t, const grammar& g, const sentence_options& options)
+    : m_tokenizer(&t)
+    , m_grammar(&g)
+    , m_options(options)
+    , m_state(options.seed)
+{
+    m_result = prepare();
+}
+
+result_t sentence_generator::prepare()
+{
+    const grammar&   g = *m_grammar;
+    const tokenizer& t = *m_tokenizer;
+
+    if(g.m_start_index == npos)
+    {
+        return {parse_error::UnpreparedGramar, symbol_id(0), 0};
+    }
+
+    m_strings.assign(g.m_chunks.size(), nullptr);
+    m_terminals.clear();
+
+    for(size_t index = 0; index < g.m_chunks.size(); ++index)
+    {
+        const chunk_data& chunk = g.m_chunks[index];
+
+        const tokenizer::token_descs_t* descs;
+
+        switch(chunk.type)
+        {
+            case grammar::chunk_type::ident:
+            case grammar::chunk_type::string:
+            case grammar::chunk_type::number:
+                m_terminals.push_back(index);
+                continue;
+
+            case grammar::chunk_type::keyword:     descs = &t.m_keywords;     break;
+            case grammar::chunk_type::punctuation: descs = &t.m_punctuations; break;
+
+            default: continue;
+        }
+        for(const tokenizer::token_desc& desc : *descs)
+        {
+            if(desc.id == chunk.id)
+            {
+                m_strings[index] = desc.str;
+                break;
+            }
+        }
+        if(m_strings[index] == nullptr)
+        {
+            const parse_error err = (chunk.type == grammar::chunk_type::keyword) ? parse_error::InvalidKeyword : parse_error::InvalidPunctuation;
+
+            return {err, chunk.id, 0};
+        }
+        m_terminals.push_back(index);
+    }
+
+    // the heights shrink pass by pass until no symbol gets a shorter way to terminals
+    m_heights     .assign(g.m_symbols.size(), npos);
+    m_rule_heights.assign(g.m_rules  .size(), npos);
+
+    for(bool changed = true; changed; )
+    {
+        changed = false;
+
+        for(size_t symbol_index = 0; symbol_index < g.m_symbols.size(); ++symbol_index)
+        {
+            const grammar::symbol_data& symbol = g.m_symbols[symbol_index];
+
+            for(size_t rule_index = symbol.first_rule; rule_index <= symbol.last_rule; ++rule_index)
+            {
+                const grammar::rule_data& rule = g.m_rules[rule_index];
+
+                const size_t height = sequence_height(rule.first_chunk, rule.last_chunk + 1);
+
+                if(height == npos) continue;
+
+                m_rule_heights[rule_index] = height + 1;
+
+                if(height + 1 < m_heights[symbol_index])
                 {
-                    case '\\': case '\?':
-                    case '\"': case '\'':
-                        ++pch;
-                        break;
+                    m_heights[symbol_index] = height + 1;
+                    changed = true;
                 }
             }
-            out += *pch;
         }
     }
-    return parse_error::None;
+
+    m_loop_heights.assign(g.m_chunks.size(), npos);
+
+    for(size_t index = 0; index < g.m_chunks.size(); ++index)
+    {
+        if(g.m_chunks[index].type != grammar::chunk_type::loop) continue;
+
+        m_loop_heights[index] = sequence_height(index + 1, g.m_loop_ends[index]);
+    }
+
+    if(m_heights[g.m_start_index] == npos)
+    {
+        return {parse_error::UnproductiveSymbol, g.m_symbols[g.m_start_index].id, 0};
+    }
+    return {parse_error::None, symbol_id(0), 0};
+}
+
+// the greatest height of the symbols a sequence must have - the bodies of loops with no minimum are skipped
+size_t sentence_generator::sequence_height(size_t first_chunk, size_t end_chunk) const
+{
+    const grammar& g = *m_grammar;
+
+    size_t height = 0;
+
+    for(size_t index = first_chunk; index < end_chunk; ++index)
+    {
+        const chunk_data& chunk = g.m_chunks[index];
+
+        if((chunk.type == grammar::chunk_type::loop) && (chunk.arg1 == 0))
+        {
+            index = g.m_loop_ends[index];
+        }
+        else if(chunk.type == grammar::chunk_type::rule)
+        {
+            const size_t symbol_height = m_heights[chunk.arg1];
+
+            if(symbol_height == npos) return npos;
+
+            height = std::max(height, symbol_height);
+        }
+    }
+    return height;
 }
 
-std::string tokenizer::stringize_tokens(
-    const char* str,
-    const token_data* token_begin,
-    const token_data* token_end
-    )
+// splitmix64
+std::uint64_t sentence_generator::random()
 {
-    Check_ValidArg(str         != nullptr, {});
-    Check_ValidArg(token_begin != nullptr, {});
-    Check_ValidArg(token_end   != nullptr, {});
+    std::uint64_t z = (m_state += 0x9E3779B97F4A7C15u);
 
-    std::string out;
-    out.reserve(size_t(token_end->len + token_end->pos - token_begin->pos));
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9u;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBu;
 
-    for(const token_data* token = token_begin; token <= token_end; ++token)
+    return z ^ (z >> 31);
+}
+
+void sentence_generator::push_symbol(size_t symbol_index, size_t depth)
+{
+    const grammar& g = *m_grammar;
+
+    const grammar::symbol_data& symbol = g.m_symbols[symbol_index];
+
+    size_t rule_index = npos;
+
+    if(closing(depth))
     {
-        out.append(str + token->pos, token->len);
+        for(size_t index = symbol.first_rule; index <= symbol.last_rule; ++index)
+        {
+            if(m_rule_heights[index] < ((rule_index != npos) ? m_rule_heights[rule_index] : npos)) rule_index = index;
+        }
     }
+    else
+    {
+        // a random one of the alternatives with a way to terminals - above min_depth one of the longer ways if any
+        size_t floor = (depth < m_options.min_depth) ? m_heights[symbol_index] : 0;
+        size_t count = 0;
 
-    return out;
-}
+        for(;;)
+        {
+            for(size_t index = symbol.first_rule; index <= symbol.last_rule; ++index)
+            {
+                if((m_rule_heights[index] != npos) && (m_rule_heights[index] > floor)) ++count;
+            }
+            if((count != 0) || (floor == 0)) break;
 
-void grammar::clear()
-{
-    m_start_index = npos;
+            floor = 0;
+        }
+        for(size_t pick = random(count), index = symbol.first_rule; ; ++index)
+        {
+            if((m_rule_heights[index] == npos) || (m_rule_heights[index] <= floor)) continue;
 
-    m_chunks .clear();
-    m_rules  .clear();
-    m_symbols.clear();
-}
+            if(pick-- == 0)
+            {
+                rule_index = index;
+                break;
+            }
+        }
+    }
+    Assert_Check(rule_index != npos);
 
-rule grammar::add_rule(symbol_id id)
-{
-    return add(id);
+    const grammar::rule_data& rule = g.m_rules[rule_index];
+
+    m_frames.push_back({rule.first_chunk, rule.first_chunk, rule.last_chunk + 1, depth, 0});
 }
 
-result_t grammar::prepare(symbol_id start_id)
+void sentence_generator::walk()
 {
-    m_start_index = npos;
+    const grammar& g = *m_grammar;
 
-    m_rules  .clear();
-    m_symbols.clear();
+    m_frames.clear();
+    m_text  .clear();
+    m_spans .clear();
 
-    size_t prev_rule_index = npos;
-    size_t loops_count     = 0;
+    push_symbol(g.m_start_index, 0);
 
-    for(size_t index = 0; index < m_chunks.size(); ++index)
+    while(!m_frames.empty())
     {
-        const chunk_data& chunk = m_chunks[index];
+        frame& f = m_frames.back();
+
+        if(f.chunk == f.end)
+        {
+            if(f.repeats == 0)
+            {
+                m_frames.pop_back();
+            }
+            else
+            {
+                --f.repeats;
+                f.chunk = f.first;
+            }
+            continue;
+        }
+        const size_t      index = f.chunk++;
+        const chunk_data& chunk = g.m_chunks[index];
+        const size_t      depth = f.depth;
 
         switch(chunk.type)
         {
-            default: continue;
+            case grammar::chunk_type::rule:
+                push_symbol(chunk.arg1, depth + 1);
+                break;
 
-            case chunk_type::start: break;
+            case grammar::chunk_type::loop:
+            {
+                const size_t next_index = g.m_loop_ends[index];
 
-            case chunk_type::loop:
-                if((chunk.arg2 == 0) || (chunk.arg2 < chunk.arg1))
+                f.chunk = next_index + 1;
+
+                size_t repeats = chunk.arg1;
+
+                if(!closing(depth) && (m_loop_heights[index] != npos))
                 {
-                    return {parse_error::InvalidLoopArguments, chunk.id, 0};
+                    repeats += random(std::min(chunk.arg2 - chunk.arg1, m_options.max_repeats) + 1);
                 }
-                ++loops_count;
-                continue;
-
-            case chunk_type::next:
-                if(loops_count == 0)
+                if(repeats != 0)
                 {
-                    return {parse_error::NextWithoutLoop, chunk.id, 0};
+                    m_frames.push_back({index + 1, index + 1, next_index, depth, repeats - 1});
                 }
-                --loops_count;
-                continue;
-        }
-        if(prev_rule_index != npos)
-        {
-            Assert_Check(index > 0);
-            m_rules[prev_rule_index].last_chunk = (index - 1);
+                break;
+            }
+
+            case grammar::chunk_type::next:
+                Assert_Fail();
+                break;
+
+            default:
+            {
+                if(!m_text.empty()) m_text += ' ';
+
+                const size_t begin = m_text.size();
+
+                append_terminal(m_text, index);
+
+                m_spans.push_back({begin, m_text.size()});
+                break;
+            }
         }
-        if(loops_count != 0)
+    }
+}
+
+void sentence_generator::append_terminal(std::string& out, size_t chunk_index)
+{
+    static constexpr char letters[] = "abcdefghijklmnopqrstuvwxyz";
+
+    const chunk_data& chunk = m_grammar->m_chunks[chunk_index];
+
+    switch(chunk.type)
+    {
+        case grammar::chunk_type::ident:
         {
-            return {parse_error::MismatchLoopNextPairs, chunk.id, 0};
+            const size_t begin = out.size();
+
+            for(size_t count = 1 + random(8); count != 0; --count)
+            {
+                out += letters[random(26)];
+            }
+            for(symbol_id id; m_tokenizer->find_keyword(id, out.data() + begin, out.size() - begin); )
+            {
+                out += letters[random(26)];
+            }
+            break;
         }
-        symbol_data& symbol = m_symbols[find_or_add_symbol(chunk.id)];
 
-        prev_rule_index = m_rules.size();
+        case grammar::chunk_type::string:
+            out += '"';
+
+            for(size_t count = random(13); count != 0; --count)
+            {
+                const size_t pick = random(32);
+
+                out += (pick < 26) ? letters[pick] : ' ';
+            }
+            out += '"';
+            break;
+
+        case grammar::chunk_type::number:
+            out += std::to_string(1 + random(99999));
+
+            if(random(2) == 0)
+            {
+                out += '.';
+                out += std::to_string(random(100));
+            }
+            break;
 
-        m_rules.push_back({chunk.id, unsigned(symbol.first_rule++), index + 1, npos});
+        default:
+            out += m_strings[chunk_index];
+            break;
     }
-    if(prev_rule_index != npos)
+}
+
+bool sentence_generator::is_valid(const std::string& sentence)
+{
+    m_tokens.clear();
+
+    if(!m_tokenizer->tokenize(m_tokens, sentence.data(), sentence.size())) return false;
+
+    return bool(m_grammar->check(m_tokens, m_stack));
+}
+
+// one change to the tokens of the sentence
+void sentence_generator::mutate()
+{
+    enum { Drop, Duplicate, Swap, Replace, Insert, Cut, Count };
+
+    const size_t count = m_spans.size();
+
+    int kind = (count == 0) ? Insert : int(random(Count));
+
+    if(((kind == Swap) && (count < 2)) || (((kind == Replace) || (kind == Insert)) && m_terminals.empty()))
     {
-        Assert_Check(m_chunks.size() > 0);
-        m_rules[prev_rule_index].last_chunk = (m_chunks.size() - 1);
+        kind = Drop;
     }
-    std::sort(m_rules.begin(), m_rules.end());
+    const size_t pos = random(count + ((kind == Insert) ? 1 : 0) - ((kind == Swap) ? 1 : 0));
 
-    for(size_t index = 0; index < m_rules.size(); ++index)
+    m_mutated.clear();
+
+    auto separate = [this] ()
     {
-        rule_data& rule = m_rules[index];
+        if(!m_mutated.empty()) m_mutated += ' ';
+    };
+    auto add = [this, &separate] (size_t index)
+    {
+        separate();
+        m_mutated.append(m_text, m_spans[index].begin, m_spans[index].end - m_spans[index].begin);
+    };
+
+    for(size_t index = 0; index <= count; ++index)
+    {
+        if(index == pos)
+        {
+            switch(kind)
+            {
+                case Drop: continue;
+                case Cut:  return;
 
-        const size_t symbol_index = find_symbol_with_id(rule.id);
-        Assert_Check(symbol_index != npos);
+                case Duplicate:
+                    add(index);
+                    break;
 
-        symbol_data& symbol = m_symbols[symbol_index];
+                case Swap:
+                    add(index + 1);
+                    add(index);
+                    ++index;
+                    continue;
 
-        if(symbol.first_rule > symbol.last_rule)
-        {
-            symbol.first_rule = index;
+                case Replace:
+                case Insert:
+                    separate();
+                    append_terminal(m_mutated, m_terminals[random(m_terminals.size())]);
+
+                    if(kind == Replace) continue;
+                    break;
+            }
         }
-        symbol.last_rule = symbol.first_rule + rule.order;
+        if(index < count) add(index);
     }
+}
 
-    for(chunk_data& chunk : m_chunks)
-    {
-        if(chunk.type != chunk_type::symbol) continue;
+result_t sentence_generator::generate(std::string& out)
+{
+    Check_ValidState(m_result, m_result);
 
-        const size_t index = find_symbol_with_id(chunk.id);
+    for(size_t attempt = 0; attempt < max_attempts; ++attempt)
+    {
+        walk();
 
-        if(index == npos)
+        if(!m_options.verify || is_valid(m_text))
         {
-            return {parse_error::SymbolWithoutRule, chunk.id, 0};
+            out += m_text;
+
+            return {parse_error::None, symbol_id(0), 0};
         }
-        chunk.type = chunk_type::rule;
-        chunk.arg1 = index;
     }
+    return {parse_error::GrammarCheckFailed, m_grammar->m_symbols[m_grammar->m_start_index].id, 0};
+}
+
+result_t sentence_generator::generate_near_miss(std::string& out)
+{
+    Check_ValidState(m_result, m_result);
 
+    for(size_t attempt = 0; attempt < max_attempts; ++attempt)
     {
-        const size_t index = find_symbol_with_id(start_id);
+        walk();
 
-        if(index == npos)
+        if(m_options.verify && !is_valid(m_text)) continue;
+
+        mutate();
+
+        if(!m_options.verify || !is_valid(m_mutated))
         {
-            return {parse_error::SymbolWithoutRule, start_id, 0};
+            out += m_mutated;
+
+            return {parse_error::None, symbol_id(0), 0};
         }
-        m_start_index = index;
     }
- 
-    return {parse_error::None, symbol_id(0), 0};
+    return {parse_error::GrammarCheckFailed, m_grammar->m_symbols[m_grammar->m_start_index].id, 0};
 }
 
-result_t grammar::check(
-    const tokens_t& tokens,
-    size_t index,
-    size_t count
-    )
-    const
+result_t incremental_check::reset(const char* str, size_t len)
 {
-    Check_ValidState(m_start_index != npos, {parse_error::UnpreparedGramar, symbol_id(0), 0});
+    Check_ValidArg(str != nullptr, {parse_error::InvalidArguments, symbol_id(0), 0});
 
-    if(count == npos) count = tokens.size();
+    m_text.assign(str, (len != size_t(-1)) ? len : std::strlen(str));
 
-    Check_ValidArg(index < tokens.size(), {parse_error::InvalidArguments, symbol_id(0), 0});
+    return tokenize_all();
+}
 
-    const token_data* token = tokens.data() + index;
+result_t incremental_check::edit(size_t offset, size_t removed, const char* inserted, size_t inserted_len)
+{
+    if(inserted_len == size_t(-1)) inserted_len = (inserted != nullptr) ? std::strlen(inserted) : 0;
+
+    Check_ValidArg((inserted != nullptr) || (inserted_len == 0), {parse_error::InvalidArguments, symbol_id(0), 0});
+    Check_ValidArg((offset <= m_text.size()) && (removed <= m_text.size() - offset), {parse_error::InvalidArguments, symbol_id(0), 0});
+
+    m_text.replace(offset, removed, (inserted != nullptr) ? inserted : "", inserted_len);
 
-    const token_data* end = (index + count >= tokens.size())
-        ? (tokens.data() + tokens.size())
-        : (tokens.data() + (index + count));
+    if(!m_tokenized) return tokenize_all();
 
-    loop_stack_t loop_stack {8};
+    token_edit changed;
 
-    if(!verify_rule(token, end, m_start_index, loop_stack))
+    m_result    = m_tokenizer->retokenize(m_tokens, m_text.data(), m_text.size(), {offset, removed, inserted_len}, changed, m_shift);
+    m_tokenized = bool(m_result);
+
+    if(!m_result)
     {
-        return {parse_error::GrammarCheckFailed, symbol_id(0), 0};
+        m_tree .clear();
+        m_reach.clear();
+        m_parsed = 0;
+
+        return m_result;
     }
-    return {parse_error::None, symbol_id(0), 0};
+    return parse_edit(changed);
 }
 
-size_t grammar::find_symbol_with_id(symbol_id id) const
+const tokens_t& incremental_check::get_tokens()
+{
+    tokenizer::apply_shift(m_tokens, m_shift);
+
+    return m_tokens;
+}
+
+result_t incremental_check::tokenize_all()
 {
-    symbol_data symbol {id, symbol_id(0), 0};
+    m_tokens.clear();
+    m_shift = {0, 0};
 
-    auto it = std::lower_bound(m_symbols.begin(), m_symbols.end(), symbol);
+    m_result    = m_tokenizer->tokenize(m_tokens, m_text.data(), m_text.size());
+    m_tokenized = bool(m_result);
 
-    if(it == m_symbols.end()) return npos;
-    if(id != it->id)          return npos;
+    if(!m_result)
+    {
+        m_tree .clear();
+        m_reach.clear();
+        m_parsed = 0;
 
-    return size_t(std::distance(m_symbols.begin(), it));
+        return m_result;
+    }
+    return parse_all();
 }
-size_t grammar::find_or_add_symbol(symbol_id id)
+
+result_t incremental_check::parse_all()
 {
-    size_t index = find_symbol_with_id(id);
+    const grammar& g = *m_grammar;
+
+    m_parsed = m_tokens.size();
 
-    if(index == npos)
+    if(g.get_engine() == grammar_engine::earley)
     {
-        m_symbols.push_back({id, 0, 0});
-        std::sort(m_symbols.begin(), m_symbols.end());
-        index = find_symbol_with_id(id);
-        Assert_Check(index != npos);
+        m_reach.clear();
+
+        m_result = g.parse(m_tokens, m_tree, m_stack);
     }
-    return index;
+    else
+    {
+        m_result = g.parse_reach(m_tokens, g.m_start_index, 0, m_stack, m_tree, m_reach, m_furthest);
+    }
+    return m_result;
 }
 
-bool grammar::verify_rule(const token_data*& token, const token_data* end, size_t symbol_index, loop_stack_t& loop_stack) const
+result_t incremental_check::parse_edit(const token_edit& changed)
 {
-    const size_t local_loop_stack_index = loop_stack.size();
+    // after a failed check (or with the earley engine) there is nothing to start from
+    if(m_reach.empty()) return parse_all();
 
-    const symbol_data& symbol = m_symbols[symbol_index];
+    m_parsed = 0;
 
-    const token_data* start_token = token;
+    const size_t         first = changed.first;                   // the first replaced token
+    const size_t         last  = changed.first + changed.removed; // the end of the replaced tokens before the edit
+    const std::ptrdiff_t delta = std::ptrdiff_t(changed.inserted) - std::ptrdiff_t(changed.removed);
 
-    for(size_t rule_index = symbol.first_rule; rule_index <= symbol.last_rule; ++rule_index, token = start_token)
-    {
-        const rule_data& rule = m_rules[rule_index];
+    // the check did not examine the replaced tokens (or none were replaced) - it runs as before
+    if((first > m_furthest) || ((changed.removed == 0) && (changed.inserted == 0))) return m_result;
+
+    if(m_tree[0].tokens_count < last) return parse_all();
 
-        size_t chunk_index = rule.first_chunk;
+    // the children are in the order of their tokens, so at most one of them covers the replaced tokens; the nodes the
+    // check entered later than a node that covers them examined at least as far as that one
+    m_path.assign(1, 0);
 
-        for( ; chunk_index <= rule.last_chunk; ++chunk_index)
+    for(;;)
+    {
+        const parse_node& node     = m_tree[m_path.back()];
+        const parse_node* children = m_tree.data() + node.first_child;
+
+        const parse_node* child = std::partition_point(children, children + node.children_count, [first] (const parse_node& n)
         {
-            const chunk_data& chunk = m_chunks[chunk_index];
+            return (n.first_token < first);
+        });
+        if(child == children) break;
 
-            switch(chunk.type)
-            {
-                case chunk_type::rule: if(verify_rule(token, end, chunk.arg1, loop_stack)) continue; break;
+        const size_t index = size_t(--child - m_tree.data());
 
-                case chunk_type::ident : if(verify_token(token, end, token_type::ident )) continue; break;
-                case chunk_type::string: if(verify_token(token, end, token_type::string)) continue; break;
-                case chunk_type::number: if(verify_token(token, end, token_type::number)) continue; break;
+        if((child->first_token + child->tokens_count < last) || (m_reach[index] >= first)) break;
 
-                case chunk_type::punctuation: if(verify_token(token, end, token_type::punctuation, chunk.id)) continue; break;
-                case chunk_type::keyword    : if(verify_token(token, end, token_type::keyword    , chunk.id)) continue; break;
+        m_path.push_back(index);
+    }
 
-                case chunk_type::loop:
-                    {
-                        const size_t min_repeats = chunk.arg1;
-                        const size_t max_repeats = chunk.arg2;
+    const grammar& g = *m_grammar;
 
-                        Assert_Check(max_repeats != 0);
-                        Assert_Check(min_repeats <= max_repeats);
+    const size_t max_depth = m_stack.get_max_depth();
 
-                        loop_stack.push_back({0, min_repeats, max_repeats, chunk_index, token});
-                    }
-                    continue;
+    for(size_t level = m_path.size() - 1; level != 0; --level)
+    {
+        const size_t     node_index = m_path[level];
+        const parse_node node       = m_tree[node_index];
 
-                case chunk_type::next:
-                    {
-                        Assert_Check(!loop_stack.empty());
+        m_parsed += size_t(std::ptrdiff_t(node.tokens_count) + delta);
 
-                        loop_data& current_loop = loop_stack.back();
+        // the node is entered as deep as the whole check enters it
+        m_stack.set_max_depth(max_depth - level);
 
-                        if((current_loop.max_repeats == npos) && (token == current_loop.token))
-                        {
-                            //TODO:ERROR:Infinite loop detected
-                            Assert_Fail();
-                        }
-                        if(++current_loop.cur_repeats == current_loop.max_repeats)
-                        {
-                            loop_stack.pop_back();
-                        }
-                        else
-                        {
-                            current_loop.token = token;
+        size_t furthest = 0;
 
-                            chunk_index = current_loop.first_index;
-                        }
-                    }
-                    continue;
+        const result_t result = g.parse_reach(m_tokens, g.find_symbol_with_id(node.id), node.first_token, m_stack, m_subtree, m_subreach, furthest);
 
-                default: Assert_Fail();
-            }
-            if(loop_stack.size() > local_loop_stack_index)
-            {
-                loop_data& current_loop = loop_stack.back();
+        m_stack.set_max_depth(max_depth);
 
-                if(current_loop.min_repeats <= current_loop.cur_repeats)
-                {
-                    while(m_chunks[++chunk_index].type != chunk_type::next) Assert_Check(chunk_index < rule.last_chunk);
-                    token = current_loop.token;
-                    loop_stack.pop_back();
-                    continue;
-                }
+        // the whole check fails at the same place
+        if(result.err == parse_error::MaxDepthExceeded)
+        {
+            m_tree .clear();
+            m_reach.clear();
 
-                for( ; loop_stack.size() > local_loop_stack_index; loop_stack.pop_back());
-            }
-            break;
+            m_result = result;
+            return m_result;
+        }
+        if(result && (std::ptrdiff_t(m_subtree[0].tokens_count) == std::ptrdiff_t(node.tokens_count) + delta))
+        {
+            splice(level, delta, furthest);
+
+            m_furthest = std::max(size_t(std::ptrdiff_t(m_furthest) + delta), furthest);
+
+            return m_result;
         }
-        if(chunk_index > rule.last_chunk) return true;
     }
-    token = start_token;
-    return false;
+    return parse_all();
 }
 
-bool grammar::verify_token(const token_data*& token, const token_data* end, token_type type) const
+// m_subtree replaces the node m_path[level] and its descendants. A parse appends the children of a node to the tree
+// when the node completes, so the blocks of the descendants are one range of the tree, which starts where the first
+// node completed in it (the one down the first children) had its children and ends with the children of the node. The
+// nodes completed before the node are in front of the range and examined only tokens before the replaced ones; its
+// ancestors (m_path[0, level)) and the nodes completed after it are behind the range.
+void incremental_check::splice(size_t level, std::ptrdiff_t delta, size_t furthest)
 {
-    if((token < end) && (token->type == type))
-    {
-        ++token;
-        return true;
-    }
-    else
+    const size_t     node_index = m_path[level];
+    const parse_node node       = m_tree[node_index];
+
+    const size_t end = node.first_token + node.tokens_count;
+
+    size_t first_completed = node_index;
+
+    while(m_tree[first_completed].children_count != 0) first_completed = m_tree[first_completed].first_child;
+
+    const size_t begin_block = m_tree[first_completed].first_child;
+    const size_t end_block   = node.first_child + node.children_count;
+
+    const std::ptrdiff_t shift = std::ptrdiff_t(m_subtree.size() - 1) - std::ptrdiff_t(end_block - begin_block);
+
+    for(size_t up = 0; up < level; ++up)
     {
-        //error info
-        return false;
+        parse_node& ancestor = m_tree[m_path[up]];
+
+        ancestor.tokens_count = size_t(std::ptrdiff_t(ancestor.tokens_count) + delta);
+        ancestor.first_child  = size_t(std::ptrdiff_t(ancestor.first_child ) + shift);
     }
-}
 
-bool grammar::verify_token(const token_data*& token, const token_data* end, token_type type, symbol_id id) const
-{
-    if((token < end) && (token->type == type) && (token->id == id))
+    // the nodes completed after the node start behind it and the check entered them having examined what the node
+    // examined now - nothing changes for them when the node examined only its own tokens in the same blocks
+    if((delta != 0) || (shift != 0) || (furthest >= m_subtree[0].first_token + m_subtree[0].tokens_count))
     {
-        ++token;
-        return true;
+        for(size_t index = end_block; index < m_tree.size(); ++index)
+        {
+            parse_node& other = m_tree[index];
+
+            if(other.first_token < end) continue;
+
+            other.first_token = size_t(std::ptrdiff_t(other.first_token) + delta);
+            other.first_child = size_t(std::ptrdiff_t(other.first_child) + shift);
+
+            size_t& reach = m_reach[index];
+
+            if(reach != npos) reach = std::max(size_t(std::ptrdiff_t(reach) + delta), furthest);
+        }
     }
-    else
+
+    // the subtree was parsed on its own - its blocks start at 1 and the check had examined m_reach[node_index] before
+    for(size_t index = 0; index < m_subtree.size(); ++index)
     {
-        //error info
-        return false;
+        m_subtree[index].first_child += begin_block - 1;
+
+        if(m_subreach[index] != npos) m_subreach[index] = std::max(m_subreach[index], m_reach[node_index]);
     }
+    m_tree[node_index] = m_subtree[0];
+
+    replace_range(m_tree , begin_block, end_block, m_subtree .begin() + 1, m_subtree .end());
+    replace_range(m_reach, begin_block, end_block, m_subreach.begin() + 1, m_subreach.end());
 }
 
 }